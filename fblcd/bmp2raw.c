@@ -0,0 +1,144 @@
+/*******************************************************************************
+* Function Name  : main
+* Description    : Convert a BMP to the pre-converted RGB565 format (.565)
+*                  that LCD_PutImage maps and blits without decoding
+* Input          : None
+* Output         : None
+* Return         : 0 ok, 1 error
+* Compile/link   : gcc -o bmp2raw bmp2raw.c -lqdbmp -Wall
+* Execute        : ./bmp2raw [-d] image.bmp image.565 [key]
+*                  -d: 4x4 ordered dithering instead of truncation
+*                  key: transparent RGB565 color, e.g. 0xF81F
+*******************************************************************************/
+/* Includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qdbmp.h"
+#include "rgb565.h"
+
+
+/* Function declarations */
+static void put16(unsigned char *p, unsigned int v);
+static void put32(unsigned char *p, unsigned int v);
+
+
+int main(int argc, char *argv[])
+{
+    UCHAR red, green, blue;
+    UINT width, height, stride;
+    UINT r, c;
+    BMP* bmp;
+    FILE *fp;
+    unsigned char hdr[RAW565_OFFSET];
+    unsigned char *row, *bgr;
+    unsigned short *pix;
+    unsigned int flags = 0, key = 0;
+    int dither = 0, failed;
+
+    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+        dither = 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 3) {
+        printf("Usage: [-d] [image.bmp] [image.565] [transparent color]\n");
+        exit(1);
+    }
+    if (argc > 3) {
+        key = strtoul(argv[3], NULL, 0) & 0xFFFF;
+        flags |= RAW565_HAS_KEY;
+    }
+
+    /* Read an image file */
+    bmp = BMP_ReadFile(argv[1]);
+    BMP_CHECK_ERROR(stderr, 1);
+
+    width = BMP_GetWidth(bmp);
+    height = BMP_GetHeight(bmp);
+    // the padded stride has to fit the 16 bit field too
+    if (width > (65535 & ~15) || height > 65535) {
+        printf("Error: %s is too big\n", argv[1]);
+        BMP_Free(bmp);
+        return 1;
+    }
+    stride = (width + 15) & ~15;
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, RAW565_MAGIC, 4);
+    put16(hdr + 4, RAW565_VERSION);
+    put16(hdr + 6, flags);
+    put16(hdr + 8, width);
+    put16(hdr + 10, height);
+    put16(hdr + 12, stride);
+    put16(hdr + 14, key);
+    put32(hdr + 16, RAW565_OFFSET);
+
+    if ((fp = fopen(argv[2], "wb")) == NULL) {
+        printf("Error: cannot create %s\n", argv[2]);
+        BMP_Free(bmp);
+        return 1;
+    }
+    row = (unsigned char*)calloc(stride, 2);
+    bgr = (unsigned char*)malloc(width * 3 + 1);
+    pix = (unsigned short*)malloc(width * sizeof(unsigned short) + 1);
+    if (row == NULL || bgr == NULL || pix == NULL) {
+        printf("Error: out of memory\n");
+        fclose(fp);
+        BMP_Free(bmp);
+        return 1;
+    }
+
+    failed = fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr);
+    for (c = 0; c < height; ++c)
+    {
+        for (r = 0; r < width; ++r)
+        {
+            BMP_GetPixelRGB(bmp, r, c, &red, &green, &blue);
+            bgr[r * 3] = blue;
+            bgr[r * 3 + 1] = green;
+            bgr[r * 3 + 2] = red;
+        }
+        RGB565_ConvertRow(pix, bgr, width, 3, 0, c, dither);
+        for (r = 0; r < width; ++r)
+            put16(row + r * 2, pix[r]);
+        if (fwrite(row, 2, stride, fp) != stride) failed = 1;
+    }
+
+    free(pix);
+    free(bgr);
+    free(row);
+    BMP_Free(bmp);
+    if (fclose(fp) != 0 || failed) {
+        printf("Error writing %s\n", argv[2]);
+        return 1;
+    }
+    printf("%s: %lux%lu -> %s\n", argv[1], (unsigned long)width, (unsigned long)height, argv[2]);
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : put16, put32
+* Description    : Store little endian fields
+* Input          : - v: value
+* Output         : - p: field
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+
+/*******************************************************************************************
+      END FILE
+********************************************************************************************/
@@ -5,8 +5,12 @@
 * Input          : None
 * Output         : None
 * Return         : None
-* Compile/link   : gcc -o fblcd -lrt main.c -lbcm2835 -lqdbmp -lm -mfloat-abi=hard -Wall
+* Compile/link   : gcc -o fblcd -lrt main.c -lbcm2835 -lm -lpthread -mfloat-abi=hard -Wall
+*                  add -O2 -mfpu=neon (ARM) or -O2 -mavx2 (x86) for the SIMD fills
 * Execute        : sudo ./fblcd /dev/fb1 /dev/input/event2
+*                  ./fblcd mem:320x240 --snapshot screen.png (no hardware)
+*                  sudo ./fblcd /dev/fb1 /dev/input/event2 --record touch.log
+*                  ./fblcd mem:320x240 replay-fast:touch.log
 *******************************************************************************/
 /* Includes */
 #include <bcm2835.h>
@@ -20,11 +24,25 @@
 #include <linux/fb.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <stdint.h>
 #include <linux/input.h>
 #include <termios.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "fonts.h"
-#include "qdbmp.h"
+#include "rgb565.h"
 
 
 /* Defines */
@@ -47,7 +65,91 @@
 (( green >> 2 ) << 5  ) | \
 ( blue  >> 3 ))
 
-#define THRESHOLD 2   /* threshold */
+#define MAX_DIRTY 16  /* dirty areas tracked between two LCD_Flush */
+
+#define GLYPH_CACHE_SIZE 256  /* rendered glyphs kept, 256 bytes each, 0 disables */
+#define IMAGE_CACHE_BYTES (1024 * 1024)  /* decoded images kept, 0 disables */
+#define TP_MEDIAN_MAX 5  /* TP_SetFilter median window limit */
+#define TP_DCUTOFF 1.0  /* 1 euro filter speed cutoff in Hz */
+#define MAX_TIMERS 32  /* pending LOOP_AddTimer timers */
+#define BUTTON_RELEASE_MS 150  /* pressed button highlight */
+#define BUTTON_CELL 16  /* hit-test grid cell in pixels */
+#define PRESS_QUEUE 32  /* pressed buttons waiting for TP_Button */
+#define TILE_SIZE 64  /* LCD_EndFrame tile, pixels square */
+#define MAX_THREADS 4  /* LCD_SetThreads limit, the caller included */
+#define TOUCH_RING 64  /* touch events queued between TP_Read and TP_GetTouch */
+#define LATENCY_MAX_US 10000000L  /* longer touch to flush times are not counted */
+#define GESTURE_SLOP 8  /* pixels a tap or long press may move */
+#define GESTURE_LONG_MS 500  /* touch held still for a long press */
+#define GESTURE_DOUBLE_MS 300  /* lift to touch of a double tap */
+#define GESTURE_SWIPE_MS 300  /* longest swipe, touch to lift */
+#define GESTURE_SWIPE_MIN 40  /* shortest swipe in pixels */
+#define GESTURE_FLING_MIN 200  /* pixels per second at the lift to fling */
+#define GESTURE_VELOCITY_MS 100  /* positions used for the velocity */
+#define GESTURE_HISTORY 8  /* positions kept for the velocity */
+#define GESTURE_QUEUE 16  /* gestures waiting for TP_GetGesture */
+
+/* UI widget types */
+#define UI_PANEL 1
+#define UI_BUTTON 2
+#define UI_LABEL 3
+#define UI_IMAGE 4
+#define UI_PROGRESS 5
+#define UI_LIST 6
+#define UI_LIST_ROW 18  /* list row height in pixels */
+#define UI_FLING_MS 16  /* UI_Fling step, one frame */
+#define UI_FLING_DECEL 1200  /* UI_Fling slow down, pixels per second squared */
+
+/* recorded draw commands */
+#define CMD_CLEAR 1
+#define CMD_POINT 2
+#define CMD_HLINE 3
+#define CMD_VLINE 4
+#define CMD_FILL 5
+#define CMD_LINE 6
+#define CMD_CIRCLE 7
+#define CMD_CIRCLEFILL 8
+#define CMD_ROUNDBOX 9
+#define CMD_ARC 10
+#define CMD_CHAR 11
+#define CMD_TEXT 12
+#define CMD_BLIT 13
+#define CMD_IMAGE 14
+
+/* touch events queued by TP_Read */
+#define TOUCH_DOWN 1
+#define TOUCH_MOVE 2
+#define TOUCH_UP 3
+
+/* gestures recognised by TP_Sample */
+#define GESTURE_TAP 1
+#define GESTURE_DOUBLE_TAP 2
+#define GESTURE_LONG_PRESS 3
+#define GESTURE_DRAG 4
+#define GESTURE_SWIPE 5
+#define GESTURE_FLING 6
+
+/* gesture recognition states */
+#define GEST_UP 0
+#define GEST_PRESSED 1   /* inside GESTURE_SLOP of the touch */
+#define GEST_DRAGGING 2
+#define GEST_LONG 3      /* long press reported, waits for the lift */
+
+#ifndef SYN_DROPPED
+#define SYN_DROPPED 3
+#endif
+
+/* TP_Record log: header, then every event */
+#define TPLOG_MAGIC "TPLG"
+#define TPLOG_VERSION 1
+#define TPLOG_HEADER_SIZE 8
+#define TPLOG_EVENT_SIZE 11
+
+/* LCD_ListSave file: header, commands, strings, blit pixels */
+#define LIST_MAGIC "FBDL"
+#define LIST_VERSION 1
+#define LIST_HEADER_SIZE 16
+#define LIST_CMD_SIZE 50
 
 #ifndef EV_SYN
 #define EV_SYN 0
@@ -91,11 +193,165 @@ unsigned short exist,
                xo,
                yo,
                col,
-               fcol,
-               pressed;
-char		   text[50];
+               fcol;
+char		   *text;
+int            release;     /* pending release animation timer, 0 none */
+long long      due;         /* release without a timer, loopNow ms, 0 none */
+int            widget;      /* UI widget + 1 painted by UI_Paint, 0 for LCD_Button */
 } Button;
 
+typedef struct Rect
+{
+short x0,           /* upper left corner */
+      y0,
+      x1,           /* lower right corner, inclusive */
+      y1;
+} Rect;
+
+typedef struct DrawContext
+{
+    Rect clip;              /* drawable area on screen, inclusive */
+    short ox, oy;           /* screen position of the coordinate origin */
+} DrawContext;
+
+typedef struct GlyphTile
+{
+unsigned short fg,
+               bg;
+unsigned char  ch,
+               aa;          /* rendered from GlyphAlpha */
+int            older,       /* LRU list */
+               newer,
+               chain;       /* next in hash bucket */
+unsigned short pix[16 * 8];
+} GlyphTile;
+
+typedef struct Surface
+{
+unsigned short  width,
+                height,
+                stride;     /* pixels per row */
+unsigned short *pixels;     /* RGB565 */
+unsigned char  *alpha;      /* coverage 0..255 per pixel, stride apart, 0 opaque */
+} Surface;
+
+typedef struct BmpStream
+{
+FILE          *fp;
+int            width,
+               height,
+               bpp,         /* 8, 24 or 32 */
+               bottomup,    /* rows stored last to first */
+               alpha;       /* 32 bits with an alpha channel */
+long           offset,      /* first row in the file */
+               rowbytes;    /* padded to 4 bytes */
+unsigned short palette[256];
+unsigned char  bgra[256 * 4];   /* palette as in the file, for dithering */
+} BmpStream;
+
+typedef struct ImageEntry
+{
+char              *path;
+time_t             mtime;
+Surface            surf;
+struct ImageEntry *next;    /* most recently used first */
+} ImageEntry;
+
+typedef struct DrawCmd
+{
+unsigned char      op,      /* CMD_CLEAR .. CMD_IMAGE, 0 draws nothing */
+                   aa;      /* Antialias when recorded */
+unsigned short     col,
+                   bcol;
+DrawContext        ctx;     /* clip and origin when recorded */
+Rect               bounds;  /* screen area it can change, inside ctx.clip */
+int                a[6];    /* coordinates, radius, angles, key, alpha */
+const Surface     *surf;    /* CMD_BLIT, CMD_IMAGE while it is drawn */
+} DrawCmd;
+
+typedef struct DisplayList
+{
+DrawCmd           *cmds;    /* kept when the list is recorded again */
+int                count,
+                   max,
+                   lost;    /* commands not recorded, out of memory */
+char              *text;    /* strings of CMD_TEXT and CMD_IMAGE */
+int                textUsed,
+                   textMax;
+Surface           *owned;   /* blit pixels of a loaded list */
+int                ownedCount;
+} DisplayList;
+
+typedef struct Display
+{
+const char        *prefix;  /* LCD_Init argument it takes, "" any */
+int              (*open)(char *);   /* sets fbp and the Fb sizes, -1 error */
+void             (*close)(void);
+} Display;
+
+typedef struct Input
+{
+const char        *prefix;  /* TP_Init argument it takes, "" any */
+int              (*open)(char *);   /* sets fd, -1 error */
+void             (*close)(void);
+int                finite;  /* a hang-up ends LOOP_Run, it is no error */
+} Input;
+
+typedef struct TouchEvent
+{
+int                type;    /* TOUCH_DOWN, TOUCH_MOVE, TOUCH_UP */
+int                x,       /* raw ABS_X, ABS_Y, ABS_PRESSURE */
+                   y,
+                   pressure;
+struct timeval     time;    /* of the SYN_REPORT */
+} TouchEvent;
+
+typedef struct Gesture
+{
+int                type;    /* GESTURE_TAP .. GESTURE_FLING */
+int                x,       /* screen position, of the touch for taps and */
+                   y,       /* long presses, else of the finger */
+                   dx,      /* drag: moved since the last drag, swipe: */
+                   dy,      /* moved since the touch */
+                   vx,      /* drag, swipe, fling: pixels per second */
+                   vy;
+struct timeval     time;    /* of the event, the clock of the device */
+} Gesture;
+
+typedef struct Replay
+{
+FILE              *fp;      /* the log, after the header */
+int                out,     /* our end of the socket pair */
+                   fast;    /* no waiting between events */
+} Replay;
+
+typedef struct Widget
+{
+    int type;               /* UI_PANEL .. UI_LIST, 0 for a free slot */
+    short x0, y0, x1, y1;   /* bounds on screen, inclusive */
+    unsigned short col;     /* text, frame and bar color */
+    int fill;               /* background color, -1 shows the parent */
+    char *text;             /* label, image file, list items one per line */
+    int value, max;         /* progress value of max, list selected item */
+    int scroll;             /* list: pixels of the items above the top */
+    int items, *lines;      /* list: number of items, offset of each in text */
+    int velocity, carry;    /* list fling: pixels per second, pixels * 1000 */
+    int timer;              /* list fling: LOOP_AddTimer timer, 0 none */
+    long long tick;         /* list fling: loopNow of the last step */
+    int visible, pressed;
+    int button;             /* number reported by TP_Button, -1 none */
+    int parent, child, last, next;  /* children are painted in order, last on top */
+} Widget;
+
+typedef struct LoopTimer
+{
+    long long due;          /* CLOCK_MONOTONIC milliseconds */
+    long interval;          /* repeat period, 0 for once */
+    void (*fn)(void *);
+    void *arg;
+    int id;
+} LoopTimer;
+
 
 /* Global variables */
 char *events[EV_MAX + 1] = {
@@ -361,20 +617,180 @@ FunctionalState getDisplayPoint(Coordinate * displayPtr,Coordinate * screenPtr,M
 Coordinate *Read_Ads7846(void);
 void LCD_Init(char*);
 void LCD_Button(unsigned short, unsigned short, unsigned short, unsigned short, unsigned short, int, unsigned short, unsigned short, char*, unsigned short);
-int LCD_PutImage(unsigned short, unsigned short, char*);
+int LCD_PutImage(int, int, char*);
 void LCD_Clear(unsigned short);
-void LCD_Text(unsigned short, unsigned short, char *, unsigned short, unsigned short);
-void PutChar(unsigned short, unsigned short, unsigned char, unsigned short, unsigned short);
+void LCD_Text(int, int, char *, unsigned short, unsigned short);
+void PutChar(int, int, unsigned char, unsigned short, unsigned short);
 int sgn(int);
-void LCD_DrawLine(unsigned short, unsigned short, unsigned short, unsigned short, unsigned short);
-void LCD_DrawBox(unsigned short, unsigned short, unsigned short, unsigned short, unsigned short, int);
-void LCD_DrawCircle(unsigned short, unsigned short, unsigned short, unsigned short);
-void LCD_DrawCircleFill(unsigned short, unsigned short, unsigned short, unsigned short, unsigned short);
-void LCD_SetPoint(unsigned short, unsigned short, unsigned short);
-short LCD_GetPoint(unsigned short, unsigned short);
+void LCD_DrawLine(int, int, int, int, unsigned short);
+void LCD_DrawBox(int, int, int, int, unsigned short, int);
+void LCD_DrawCircle(int, int, int, unsigned short);
+void LCD_DrawCircleFill(int, int, int, unsigned short, unsigned short);
+void LCD_SetPoint(int, int, unsigned short);
+short LCD_GetPoint(int, int);
 void LCD_SetCursor(unsigned short, unsigned short);
 void DelayMicrosecondsNoSleep(int delay_us);
+static inline void setPixel(int, int, unsigned short);
+static inline unsigned short blend565(unsigned short, unsigned short, int);
+static inline void blendPixel(int, int, unsigned short, int);
+void LCD_SetAntialias(int);
+static void wuLine(int, int, int, int, unsigned short);
+static void wuCircle(int, int, int, unsigned short);
+static unsigned long isqrt(unsigned long long);
+static int glyphAlphaInit(void);
+static void markDirty(int, int, int, int);
+static int circleSpans(int);
+static void spanClip(int, int, int, unsigned short);
+static void roundShape(int, int, int, int, int, unsigned short, int);
+void LCD_DrawRoundBox(int, int, int, int, int, unsigned short, int);
+void LCD_DrawArc(int, int, int, int, int, unsigned short);
+static int clipLine(double *, double *, double *, double *);
+void LCD_SetOrigin(int, int);
+void LCD_GetContext(DrawContext *);
+void LCD_SetContext(const DrawContext *);
+static void setGlyphColors(unsigned short, unsigned short);
+static void putGlyph(int, int, unsigned char);
+int LCD_GlyphCacheInit(int);
+void LCD_GlyphCacheStats(unsigned long *, unsigned long *);
+void LCD_Blit(int, int, Surface *);
+void LCD_BlitKeyed(int, int, Surface *, unsigned short);
+void LCD_BlitAlpha(int, int, Surface *, int);
+static int surfaceAlloc(Surface *, int, int);
+static int surfaceAlphaAlloc(Surface *);
+static void surfaceFree(Surface *);
+static void blitSurface(int, int, const Surface *, int, int);
+int LCD_PutImageAlpha(int, int, char*, int);
+int LCD_ImageCacheInit(long);
+void LCD_SetDither(int);
+static void imageCacheTrim(long);
+void LCD_Invalidate(int, int, int, int);
+void LCD_Flush(void);
+void LCD_HLine(int, int, int, unsigned short);
+void LCD_VLine(int, int, int, unsigned short);
+void LCD_FillRect(int, int, int, int, unsigned short);
+void LCD_ClearRect(int, int, int, int, unsigned short);
+static int fillRect16(Surface *, int, int, int, int, unsigned short, Rect *);
+void LCD_SetClip(int, int, int, int);
+void LCD_ResetClip(void);
 void draw(void);
+void benchmark(void);
+static void benchScene(Surface *);
+static void onTouch(Coordinate *);
+Coordinate *TP_Sample(void);
+int TP_Settled(void);
+int TP_SetFilter(int, double, double);
+static Coordinate *tpFilter(const TouchEvent *);
+static void tpFilterReset(void);
+static int tpMedian(const int *, int);
+static double tpAlpha(double, double);
+int TP_GetGesture(Gesture *);
+void LOOP_OnGesture(void (*)(Gesture *));
+static void onGesture(Gesture *);
+static void gestureFeed(int, const Coordinate *, const struct timeval *);
+static void gestureLong(void *);
+static void gestureVelocity(long long, int *, int *);
+static void gestureDisplay(const Coordinate *, int *, int *);
+static void gestureAdd(int, int, int, int, int, int, int, long long);
+int LOOP_Init(void);
+int LOOP_Run(void);
+void LOOP_Quit(void);
+void LOOP_Wake(void);
+void LOOP_OnTouch(void (*)(Coordinate *));
+void LOOP_OnWake(void (*)(void));
+int LOOP_AddTimer(long, long, void (*)(void *), void *);
+void LOOP_CancelTimer(int);
+static void timerRemove(int);
+static void timerArm(void);
+static void timerExpire(void);
+static void buttonRelease(void *);
+static int buttonGrid(void);
+static void buttonPress(int);
+static void buttonLate(void);
+static Button *buttonSlot(unsigned short);
+void LCD_ButtonRemove(unsigned short);
+static void rectListAdd(Rect *, int *, Rect);
+static long rectArea(const Rect *);
+int UI_Init(unsigned short);
+int UI_Add(int, int, int, int, int, int);
+void UI_Remove(int);
+void UI_SetText(int, const char *);
+void UI_SetValue(int, int);
+int UI_GetValue(int);
+void UI_SetColors(int, unsigned short, int);
+void UI_SetVisible(int, int);
+void UI_SetBounds(int, int, int, int, int);
+void UI_SetButton(int, int);
+void UI_Damage(int, int, int, int);
+long UI_Paint(void);
+int UI_Scroll(int, int);
+void UI_Fling(int, int);
+int UI_ListItem(int, int, int);
+static void uiDamage(int);
+static void uiPressed(int, int);
+static int uiShown(int);
+static int uiScroll(int, int);
+static void uiFling(void *);
+static int uiListIndex(const char *, int **);
+static int uiCovered(int, const Rect *);
+static void uiPaint(int, const Rect *);
+static void uiDraw(int);
+static int uiButton(int, int, int, int, char *, int);
+void LCD_BeginFrame(void);
+void LCD_EndFrame(void);
+int LCD_SetThreads(int);
+static DrawCmd *cmdAdd(int, int, int, int, int);
+static int cmdArea(const DrawCmd *, Rect *);
+static void cmdRun(const DrawCmd *);
+static void frameDraw(void);
+static void tileDrain(void);
+static void *tileWorker(void *);
+static ImageEntry *imageFind(const char *, time_t);
+static int imageLoad(int, int, char *, int, time_t);
+DisplayList *LCD_ListNew(void);
+void LCD_ListFree(DisplayList *);
+void LCD_ListBegin(DisplayList *);
+int LCD_ListEnd(void);
+void LCD_ListDraw(DisplayList *);
+int LCD_ListSave(DisplayList *, char *);
+DisplayList *LCD_ListLoad(char *);
+static DrawCmd *listAdd(DisplayList *);
+static int listText(DisplayList *, const char *);
+static void listReset(DisplayList *);
+static void listAppend(DisplayList *, const DisplayList *);
+static void listRun(DisplayList *);
+static void listTiles(DisplayList *, int, int);
+static int imageResolve(DisplayList *, DrawCmd *);
+static void put16(unsigned char *, unsigned int);
+static void put32(unsigned char *, unsigned int);
+void LCD_Close(void);
+int LCD_Snapshot(char *);
+static int fbdevOpen(char *);
+static void fbdevClose(void);
+static int memOpen(char *);
+static void memClose(void);
+static void fbGetRow(unsigned short *, int);
+static void fbPutRow(int, int, int);
+static void fbRGBRow(unsigned char *, int);
+static void pngChunk(FILE *, const char *, const unsigned char *, unsigned long);
+void TP_Close(void);
+int TP_Record(char *);
+void LOOP_TouchStats(unsigned long *, long *, long *);
+static int evdevOpen(char *);
+static void evdevClose(void);
+static int replayOpen(char *);
+static void replayClose(void);
+static void *replayThread(void *);
+static void tpLog(const struct input_event *, int);
+void TP_GetAdXY(int *, int *);
+int TP_Read(void);
+static int tpEvent(const struct input_event *);
+static void tpResync(void);
+static int tpFrame(const struct timeval *);
+int TP_GetTouch(TouchEvent *);
+void TP_QueueStats(unsigned long *, unsigned long *);
+static unsigned int le16(const unsigned char *);
+static unsigned int le32(const unsigned char *);
+static double nowSeconds(void);
 
 
 /* global variables to store screen info */
@@ -387,19 +803,188 @@ static Coordinate ScreenSample[3];
 //static Coordinate DisplaySample[3] = { {45, 45}, {45, 270}, {190, 190} };
 static Coordinate DisplaySample[3] = { {45, 45}, {45, 195}, {190, 190} };
 static Coordinate Screen;
-static Button Butt[20] = {
-                         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                         };
-
-int fbfd = 0;
+
+/* buttons by number, grown by LCD_Button */
+static Button *Butt = 0;
+static int ButtCount = 0;
+
+/* hit-test grid of BUTTON_CELL cells: GridHead is the first node of a cell,
+   a node is a button and the next node, -1 ends; rebuilt when GridDirty */
+static int *GridHead = 0, *GridNode = 0;
+static int GridCols = 0, GridRows = 0, GridNodes = 0, GridNodeMax = 0;
+static int GridDirty = 1;
+
+/* retained widgets, Widgets[0] is the screen; a change adds the widget
+   bounds to Damage and UI_Paint redraws only those areas */
+static Widget *Widgets = 0;
+static int WidgetCount = 0;
+static Rect Damage[MAX_DIRTY];
+static int DamageCount = 0;
+
+/* demo widgets made by draw */
+static int Status = -1, Level = -1, List = -1;
+
+/* pressed buttons in order, read by TP_Button */
+static int PressQueue[PRESS_QUEUE];
+static int PressFirst = 0, PressCount = 0;
+
+/* buttons released by buttonLate because no timer was free */
+static int PressLate = 0;
+
+int fbfd = -1;
 struct fb_var_screeninfo orig_vinfo;
 long int screensize = 0;
 
-int fd, rd, i, j, k;
-struct input_event ev[64];
+/* display backends: LCD_Init takes the first one whose prefix starts its
+   argument. The backend maps or allocates fbp, FbLine bytes per line of
+   FbBpp pixels; LCD_Flush converts the back buffer to that depth */
+static const Display Displays[] = {
+    { "mem:", memOpen, memClose },
+    { "", fbdevOpen, fbdevClose },
+};
+static const Display *Disp = 0;
+static int FbWidth = 0, FbHeight = 0, FbBpp = 16, FbLine = 0;
+
+/* off-screen back buffer: every primitive draws here, LCD_Flush copies the
+   changed areas to fbp so fbtft does not push half drawn pages over SPI */
+static Surface BackBuffer;
+static Rect Dirty[MAX_DIRTY];
+static int DirtyCount = 0;
+
+/* drawing context: the primitives add the origin to their coordinates and
+   clip to the area once, inner loops do not test pixels */
+static __thread DrawContext Ctx = { { 0, 0, -1, -1 }, 0, 0 };
+
+/* half width of every row of the last midpoint circle, CircleSpan[r + 1]
+   is -1; shared by the circle, rounded box and arc primitives */
+static __thread int *CircleSpan = 0;
+static __thread int CircleSpanMax = 0, CircleSpanR = -1;
+
+/* 4 pixels for every font nibble in the current text colors, a glyph row is
+   two 8 byte copies instead of 8 tested pixels */
+static __thread unsigned short GlyphRow[16][4];
+static __thread unsigned short GlyphFg = 0, GlyphBg = 0;
+static __thread int GlyphRowValid = 0;
+
+/* anti-aliased mode: Wu lines and circles, glyphs from the 4 bit GlyphAlpha
+   font through GlyphRamp, the 16 blends of the current text colors */
+static __thread int Antialias = 0, GlyphAA = 0;
+static unsigned char *GlyphAlpha = 0;
+static __thread unsigned short GlyphRamp[16];
+
+/* rendered glyphs keyed by character and color pair, most recent first */
+static GlyphTile *GlyphCache = 0;
+static int *GlyphBucket = 0;
+static int GlyphCacheSize = GLYPH_CACHE_SIZE;
+static int GlyphCacheUsed = 0, GlyphBuckets = 0;
+static int GlyphNewest = -1, GlyphOldest = -1;
+static unsigned long GlyphHits = 0, GlyphMisses = 0;
+
+/* decoded LCD_PutImage files, keyed by path and modification time */
+static ImageEntry *ImageCache = 0;
+static long ImageCacheBytes = 0, ImageCacheLimit = IMAGE_CACHE_BYTES;
+static int ImageDither = 0;
+
+/* display lists: while Rec is set the primitives add a command to it
+   instead of drawing, Frame is the list of LCD_BeginFrame. A list is
+   drawn by binning its commands into TILE_SIZE tiles, the workers draw
+   whole tiles and every tile runs its commands in order */
+static DisplayList Frame;
+static DisplayList *Rec = 0, *RecOuter = 0;
+static DrawCmd CmdLost;
+static const DrawCmd *TileCmds = 0;
+static char *TileText = 0;
+static int *TileFirst = 0, *TileList = 0;
+static int TileCols = 0, TileRows = 0, TileListMax = 0, TileNext = 0;
+
+/* tile workers: the state above marked __thread is per thread, a worker
+   does not use the glyph cache or mark dirty areas */
+static __thread int TileWorker = 0;
+static pthread_t Workers[MAX_THREADS];
+static int Threads = 1;
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t PoolStart = PTHREAD_COND_INITIALIZER, PoolDone = PTHREAD_COND_INITIALIZER;
+static int PoolGen = 0, PoolBusy = 0, PoolQuit = 0;
+
+/* event loop: epoll on the touch device, a timerfd and a wake-up eventfd */
+static int LoopFd = -1, LoopTimerFd = -1, LoopWakeFd = -1;
+static int LoopRunning = 0;
+static void (*LoopTouch)(Coordinate *) = 0;
+static void (*LoopGesture)(Gesture *) = 0;
+static void (*LoopWake)(void) = 0;
+
+/* LOOP_AddTimer timers, a binary min-heap on due, LoopTimerFd fires for
+   the first one. An id names a slot, (id - 1) % MAX_TIMERS, whose
+   TimerIndex is the heap index; TimerFree holds the released slots */
+static LoopTimer Timers[MAX_TIMERS];
+static int TimerCount = 0, TimerSeq = 0;
+static int TimerIndex[MAX_TIMERS], TimerFree[MAX_TIMERS];
+static int TimerFreeCount = 0, TimerSlots = 0;
+
+/* input backends, TP_Init takes the first one whose prefix starts its
+   argument and the backend opens fd; TouchClock is the clock of the event
+   times */
+static const Input Inputs[] = {
+    { "replay:", replayOpen, replayClose, 1 },
+    { "replay-fast:", replayOpen, replayClose, 1 },
+    { "", evdevOpen, evdevClose, 0 },
+};
+static const Input *Inp = 0;
+static int TouchClock = CLOCK_REALTIME;
+
+/* TP_Record log and the time of the last event written */
+static FILE *TouchLog = 0;
+static struct timeval TouchLogTime;
+
+/* time of the last event read and the LOOP_Run touch to flush latency;
+   TouchEnded when a replay has no more events */
+static struct timeval TouchTime;
+static int TouchEnded = 0;
+static unsigned long LatencyCount = 0;
+static long long LatencySum = 0;
+static long LatencyMax = 0;
+
+/* evdev frame assembly: TouchRaw keeps what TP_Read could not parse yet,
+   the events of a frame change the Frame state and its SYN_REPORT queues
+   the difference to the Touch state (TouchDown as queued); after
+   SYN_DROPPED the events up to the next SYN_REPORT are skipped */
+static struct input_event TouchRaw[64];
+static int TouchRawBytes = 0, TouchDropping = 0;
+static int FrameX = 0, FrameY = 0, FrameP = 0, FrameDown = 0;
+static int TouchX = 0, TouchY = 0, TouchP = 0, TouchDown = 0;
+
+/* single producer, single consumer ring of TouchEvent; the counters only
+   grow, each side writes its own. TouchLost counts events not queued for a
+   full ring, TouchStale moves skipped */
+static TouchEvent TouchRing[TOUCH_RING];
+static unsigned int TouchHead = 0, TouchTail = 0;
+static unsigned long TouchLost = 0, TouchStale = 0;
+
+/* streaming touch filter, see TP_SetFilter: the last FilterMedian raw
+   positions and the 1 euro state, reset when the finger lifts.
+   TouchSettled when TP_Sample filled the window of a touch */
+static int FilterMedian = 3;
+static double FilterMinCutoff = 1.0, FilterBeta = 0.007;
+static int FilterRaw[2][TP_MEDIAN_MAX], FilterCount = 0, FilterNext = 0;
+static double FilterX, FilterY, FilterDX, FilterDY;
+static struct timeval FilterTime;
+static int TouchSettled = 0;
+
+/* gesture recognition: the touch in screen pixels with its time in
+   microseconds, the last tap for a double tap, the last GESTURE_HISTORY
+   positions for the velocity, recognised gestures for TP_GetGesture */
+static int GestState = GEST_UP, GestTimer = 0;
+static int GestX0, GestY0, GestX, GestY;
+static long long GestDown;
+static int GestTapped = 0, GestTapX, GestTapY;
+static long long GestTapTime;
+static int GestHistX[GESTURE_HISTORY], GestHistY[GESTURE_HISTORY];
+static long long GestHistTime[GESTURE_HISTORY];
+static int GestHistCount = 0, GestHistNext = 0;
+static Gesture GestQueue[GESTURE_QUEUE];
+static int GestFirst = 0, GestCount = 0;
+
+int fd = -1, rd, i, j, k;
 int version;
 unsigned short id[4];
 unsigned long bit[EV_MAX][NBITS(KEY_MAX)];
@@ -408,118 +993,528 @@ int abs1[5];
 
 int main(int argc, char *argv[])
 {
-    int l;
-
-	if (argc < 3) {
-		printf("Usage: [/dev/fbX] [/dev/input/eventX]\n");
+    unsigned long hits, misses, touches, stale, lost;
+    long avg, max;
+    double t;
+    int snapshot, bcm;
+
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+		benchmark();
+		exit(0);
+	}
+	snapshot = argc > 2 && strcmp(argv[2], "--snapshot") == 0;
+	if (argc < 3 || (snapshot && argc < 4)) {
+		printf("Usage: [/dev/fbX | mem:WxH[xBPP]] [/dev/input/eventX | replay:log [--record log] | --snapshot file.png|.ppm] | --bench\n");
 		exit(1);
 	}
     
-    TP_Init(argv[2]);
+    if (!snapshot) {
+        TP_Init(argv[2]);
+        // calibration included, a replay of it needs no finger
+        if (argc > 4 && strcmp(argv[3], "--record") == 0 && TP_Record(argv[4])) exit(1);
+    }
     LCD_Init(argv[1]);
+    // one tile thread per core
+    LCD_SetThreads(sysconf(_SC_NPROCESSORS_ONLN));
 
-    if ((int)fbp == -1) {
+    if (fbp == MAP_FAILED) {
         printf("Failed to mmap\n");
     } else {
+        LCD_BeginFrame();
         LCD_Clear(Black);
         draw();
+        UI_Paint();
+        LCD_EndFrame();
+        LCD_Flush();
+    }
+
+    if (snapshot) {
+        // the start screen without touch panel, e.g. with mem:320x240
+        bcm = LCD_Snapshot(argv[3]);
+        LCD_SetThreads(1);
+        LCD_Close();
+        return bcm ? 1 : 0;
     }
 
     TP_Cal();
-    if (!bcm2835_init()) printf("Error open BCM2835\n");
-
-    while(1)
-    {
-        getDisplayPoint(&display, Read_Ads7846(), &matrix);
-
-        if ( ((l = TP_Button()) != -1) )
-        {
-            printf("Pressed button%2d\n", l);
-
-            switch (l) {
-            case 0:
-            	// your code for button 0 pressed here
-                //LCD_PutImage(100, 100, "test2.bmp");
-                break;
-            case 1:
-            	// your code for button 1 pressed here
-                //LCD_PutImage(0, 0, "full_l.bmp");
-				// you can also reload background & buttons
-                draw();
-                break;
-            case 2:
-            	// your code for button 1 pressed here
-                //LCD_PutImage(5, 5, "foto.bmp");
-                break;
-            case 4: // Up
-            	// your code for button 1 pressed here
-                //LCD_PutImage(5, 5, "foto.bmp");
-                break;
-            case 5: // Down
-            	// your code for button 1 pressed here
-                //LCD_PutImage(5, 5, "foto.bmp");
-                break;
-            case 3: 
-            	// your code besor exit here
-				LCD_Clear(Black);
-				// cleanup
-				munmap(fbp, screensize);
-				if (ioctl(fbfd, FBIOPUT_VSCREENINFO, &orig_vinfo)) {
-					printf("Error re-setting variable information\n");
-				}
-				close(fbfd);
-				close(fd);
-				bcm2835_close();
-				exit(0);
-                break;
-            default:
-                // Code
-                break;
-            }
+    // the Pi peripherals only with a framebuffer device
+    bcm = fbfd != -1 && bcm2835_init();
+    if (fbfd != -1 && !bcm) printf("Error open BCM2835\n");
+    // calibration may have drawn over the scene
+    UI_Damage(0, 0, BackBuffer.width - 1, BackBuffer.height - 1);
+
+    if (LOOP_Init()) exit(1);
+    LOOP_OnTouch(onTouch);
+    LOOP_OnGesture(onGesture);
+    t = nowSeconds();
+    LOOP_Run();
+    t = nowSeconds() - t;
+
+    // your code before exit here
+    LCD_GlyphCacheStats(&hits, &misses);
+    printf("Glyph cache: %lu hits %lu misses\n", hits, misses);
+    LOOP_TouchStats(&touches, &avg, &max);
+    printf("Touch: %lu frames in %.2f s, latency %ld us average %ld us max\n", touches, t, avg, max);
+    TP_QueueStats(&stale, &lost);
+    printf("Touch events: %lu stale moves skipped, %lu lost\n", stale, lost);
+    LCD_Clear(Black);
+    LCD_Flush();
+    // cleanup
+    LCD_SetThreads(1);
+    LCD_Close();
+    TP_Close();
+    if (bcm) bcm2835_close();
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : onTouch
+* Description    : Sub of main, called by LOOP_Run for every filtered touch
+* Input          : - p: touch panel point
+* Output         : None
+* Return         : None
+* Attention      : A button is pressed once per touch
+*******************************************************************************/
+static void onTouch(Coordinate *p)
+{
+    int l;
+
+    // a point for every frame, the buttons when the filter settled
+    if (!TP_Settled()) return;
+    getDisplayPoint(&display, p, &matrix);
+
+    if ( ((l = TP_Button()) != -1) )
+    {
+        printf("Pressed button%2d\n", l);
+
+        switch (l) {
+        case 0:
+            // your code for button 0 pressed here
+            //LCD_PutImage(100, 100, "test2.bmp");
+            break;
+        case 1:
+            // your code for button 1 pressed here
+            //LCD_PutImage(0, 0, "full_l.bmp");
+            // changed widgets are repainted, nothing else
+            UI_SetText(Status, "On");
+            break;
+        case 2:
+            // your code for button 1 pressed here
+            //LCD_PutImage(5, 5, "foto.bmp");
+            UI_SetText(Status, "Off");
+            break;
+        case 4: // Up
+            // your code for button 1 pressed here
+            //LCD_PutImage(5, 5, "foto.bmp");
+            UI_SetValue(Level, UI_GetValue(Level) + 10);
+            break;
+        case 5: // Down
+            // your code for button 1 pressed here
+            //LCD_PutImage(5, 5, "foto.bmp");
+            UI_SetValue(Level, UI_GetValue(Level) - 10);
+            break;
+        case 3:
+            // leave LOOP_Run, main cleans up
+            LOOP_Quit();
+            break;
+        default:
+            // Code
+            break;
+        }
+    }
+    //TP_DrawPoint(display.x, display.y);
+}
+
+
+/*******************************************************************************
+* Function Name  : onGesture
+* Description    : Sub of main, called by LOOP_Run for every gesture
+* Input          : - g: the gesture
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void onGesture(Gesture *g)
+{
+    int n;
+
+    switch (g->type) {
+    case GESTURE_TAP:
+        printf("Tap at %d,%d\n", g->x, g->y);
+        // a tap stops the list or selects an item
+        if ((n = UI_ListItem(List, g->x, g->y)) != -1) {
+            UI_Fling(List, 0);
+            UI_SetValue(List, n);
         }
-        //TP_DrawPoint(display.x, display.y);
-    }     
+        break;
+    case GESTURE_DOUBLE_TAP:
+        printf("Double tap at %d,%d\n", g->x, g->y);
+        break;
+    case GESTURE_LONG_PRESS:
+        printf("Long press at %d,%d\n", g->x, g->y);
+        break;
+    case GESTURE_DRAG:
+        // the list follows the finger over it
+        if (UI_ListItem(List, g->x - g->dx, g->y - g->dy) != -1) UI_Scroll(List, -g->dy);
+        break;
+    case GESTURE_SWIPE:
+        printf("Swipe %d,%d\n", g->dx, g->dy);
+        break;
+    case GESTURE_FLING:
+        printf("Fling at %d,%d px/s\n", g->vx, g->vy);
+        if (UI_ListItem(List, g->x, g->y) != -1) UI_Fling(List, -g->vy);
+        break;
+    }
 }
 
 
 /*******************************************************************************
 * Function Name  : draw
-* Description    : Sub of main
+* Description    : Sub of main, build the widget scene
 * Input          : None
 * Output         : None
 * Return         : None
-* Attention      : None
+* Attention      : Painted by UI_Paint
 *******************************************************************************/
 void draw() 
 {
-    LCD_Button(260,10,55,30,Yellow,Blue,3,7,"Image",0);
-    LCD_Button(260,50,55,30,Yellow,Blue,3,7,"On",1);
-    LCD_Button(260,90,55,30,Yellow,Blue,3,7,"Off",2);
-    LCD_Button(260,140,55,30,Yellow,Blue,3,7,"esci",3);
+    char items[40 * 12];
+    int i;
+
+    UI_Init(Black);
+
+    uiButton(260,10,55,30,"Image",0);
+    uiButton(260,50,55,30,"On",1);
+    uiButton(260,90,55,30,"Off",2);
+    uiButton(260,140,55,30,"esci",3);
+
+    uiButton(60,10,55,30,"Up",4);
+    uiButton(60,50,55,30,"Down",5);
+
+    Status = UI_Add(0, UI_LABEL, 60, 100, 180, 115);
+    UI_SetText(Status, "Off");
+    Level = UI_Add(0, UI_PROGRESS, 60, 130, 180, 145);
+    UI_SetColors(Level, Green, -1);
+    UI_SetValue(Level, 50);
+
+    // drag or fling to scroll, tap to select
+    for (i = 0, items[0] = 0; i < 40; i++)
+        sprintf(items + strlen(items), "%sAlarm %2d", i ? "\n" : "", i + 1);
+    List = UI_Add(0, UI_LIST, 5, 160, 250, 235);
+    UI_SetColors(List, White, Blue);
+    UI_SetText(List, items);
+}
+
+
+/*******************************************************************************
+* Function Name  : uiButton
+* Description    : Sub of draw, a button widget in the LCD_Button colors
+* Input          : - x, y: upper left corner
+*                  - w, h: size
+*                  - text: the text
+*                  - buttn: number for TP_Button
+* Output         : None
+* Return         : widget
+* Attention      : None
+*******************************************************************************/
+static int uiButton(int x, int y, int w, int h, char *text, int buttn)
+{
+    int id;
+
+    id = UI_Add(0, UI_BUTTON, x, y, x + w, y + h);
+    UI_SetText(id, text);
+    UI_SetColors(id, Yellow, Blue);
+    UI_SetButton(id, buttn);
+    return id;
+}
+
+
+/*******************************************************************************
+* Function Name  : nowSeconds
+* Description    : Sub of main and benchmark
+* Input          : None
+* Output         : None
+* Return         : monotonic time in seconds
+* Attention      : None
+*******************************************************************************/
+static double nowSeconds(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/*******************************************************************************
+* Function Name  : benchScene
+* Description    : Sub of benchmark, a full screen of buttons and text
+* Input          : - bg: background surface
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void benchScene(Surface *bg)
+{
+    char label[16];
+    int n, x, y;
+
+    LCD_Blit(0, 0, bg);
+    for (n = 0; n < 48; n++)
+    {
+        x = n % 6 * 53 + 2;
+        y = n / 6 * 30 + 2;
+        LCD_DrawRoundBox(x, y, x + 49, y + 26, 6, Yellow, Blue);
+        sprintf(label, "B%02d", n);
+        LCD_Text(x + 13, y + 5, label, Yellow, Blue);
+    }
+    for (n = 0; n < 16; n++)
+    {
+        LCD_DrawLine(n * 20, 0, 319 - n * 20, 239, Green);
+        LCD_DrawCircleFill(n * 20 + 10, 120, 12, White, Red);
+    }
+    LCD_Text(0, 224, "tile renderer 0123456789 km/h", White, Black);
+}
+
+
+/*******************************************************************************
+* Function Name  : benchmark
+* Description    : Sub of main, time the drawing kernels, no display needed
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : ./fblcd --bench
+*******************************************************************************/
+void benchmark(void)
+{
+    const int w = 320, h = 240, frames = 200;
+    unsigned char *src;
+    unsigned short *dst, *ref;
+    unsigned char *al;
+    double t;
+    int bytespp, dither, f, y, mode;
+    char dev[32];
+    Surface s, bg;
+    DisplayList *list;
+
+    src = (unsigned char*)malloc(w * h * 4);
+    dst = (unsigned short*)malloc(w * h * sizeof(unsigned short));
+    if (src == NULL || dst == NULL)
+    {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    for (f = 0; f < w * h * 4; f++)
+        src[f] = rand();
+
+    printf("RGB888 to RGB565, %dx%d\n", w, h);
+    for (bytespp = 3; bytespp <= 4; bytespp++)
+    {
+        for (dither = 0; dither <= 1; dither++)
+        {
+            t = nowSeconds();
+            for (f = 0; f < frames; f++)
+            {
+                for (y = 0; y < h; y++)
+                    RGB565_ConvertRow(dst + y * w, src + y * w * bytespp, w, bytespp, 0, y, dither);
+            }
+            t = nowSeconds() - t;
+            printf("  %d bpp %-9s %8.1f Mpixel/s\n", bytespp * 8, dither ? "dithered" : "plain",
+                   (double)w * h * frames / t / 1e6);
+        }
+    }
 
-    LCD_Button(60,10,55,30,Yellow,Blue,3,7,"Up",4);
-    LCD_Button(60,50,55,30,Yellow,Blue,3,7,"Down",5);
+    // the primitives draw into dst, with and without anti-aliasing
+    BackBuffer.width = BackBuffer.stride = w;
+    BackBuffer.height = h;
+    BackBuffer.pixels = dst;
+    LCD_SetOrigin(0, 0);
+    LCD_ResetClip();
+    printf("Primitives, per second\n");
+    for (f = 0; f < 2; f++)
+    {
+        LCD_SetAntialias(f);
+        srand(1);
+        t = nowSeconds();
+        for (y = 0; y < 20000; y++)
+            LCD_DrawLine(rand() % w, rand() % h, rand() % w, rand() % h, rand());
+        t = nowSeconds() - t;
+        printf("  %-11s lines %9.0f", f ? "antialiased" : "aliased", 20000 / t);
+        t = nowSeconds();
+        for (y = 0; y < 5000; y++)
+            LCD_DrawCircle(w / 2, h / 2, 10 + y % 100, rand());
+        t = nowSeconds() - t;
+        printf("  circles %8.0f", 5000 / t);
+        t = nowSeconds();
+        for (y = 0; y < 2000; y++)
+            LCD_DrawCircleFill(w / 2, h / 2, 10 + y % 100, rand(), rand());
+        t = nowSeconds() - t;
+        printf("  filled %8.0f", 2000 / t);
+        t = nowSeconds();
+        for (y = 0; y < 20000; y++)
+            LCD_Text(0, (y % 15) * 16, "0123456789 km/h", y, ~y);
+        t = nowSeconds() - t;
+        printf("  glyphs %9.0f\n", 20000 * 15 / t);
+        DirtyCount = 0;
+    }
+    LCD_SetAntialias(0);
+
+    if (surfaceAlloc(&s, w, h) == 0 && surfaceAlphaAlloc(&s) == 0)
+    {
+        for (f = 0; f < s.stride * h; f++)
+        {
+            s.pixels[f] = rand();
+            s.alpha[f] = rand();
+        }
+        al = s.alpha;
+        printf("Blits, %dx%d\n", w, h);
+        for (mode = 0; mode < 4; mode++)
+        {
+            s.alpha = mode == 3 ? al : 0;
+            t = nowSeconds();
+            for (f = 0; f < frames; f++)
+            {
+                if (mode == 1)
+                    LCD_BlitKeyed(0, 0, &s, 0xF81F);
+                else
+                    LCD_BlitAlpha(0, 0, &s, mode == 2 ? 128 : 255);
+            }
+            t = nowSeconds() - t;
+            printf("  %-9s %8.1f Mpixel/s\n", mode == 0 ? "copy" : mode == 1 ? "keyed" : mode == 2 ? "alpha 128" : "alpha map",
+                   (double)w * h * frames / t / 1e6);
+            DirtyCount = 0;
+        }
+        s.alpha = al;
+    }
+
+    // the same frame drawn directly and recorded with 1 to 4 threads
+    bg = s;
+    bg.alpha = 0;
+    if (bg.pixels && (ref = (unsigned short*)malloc(w * h * sizeof(unsigned short))) != NULL)
+    {
+        printf("Frames, %dx%d, per second\n", w, h);
+        for (mode = 0; mode <= MAX_THREADS; mode++)
+        {
+            LCD_SetThreads(mode);
+            t = nowSeconds();
+            for (f = 0; f < frames; f++)
+            {
+                if (mode) LCD_BeginFrame();
+                benchScene(&bg);
+                if (mode) LCD_EndFrame();
+                DirtyCount = 0;
+            }
+            t = nowSeconds() - t;
+            if (mode == 0)
+            {
+                memcpy(ref, dst, w * h * sizeof(unsigned short));
+                printf("  direct    %8.1f\n", frames / t);
+            } else {
+                printf("  %d thread%s %8.1f  %s\n", mode, mode > 1 ? "s" : " ", frames / t,
+                       memcmp(ref, dst, w * h * sizeof(unsigned short)) ? "differs" : "same pixels");
+            }
+        }
+        LCD_SetThreads(1);
+
+        // recorded once, replayed every frame
+        if ((list = LCD_ListNew()) != NULL)
+        {
+            LCD_ListBegin(list);
+            benchScene(&bg);
+            LCD_ListEnd();
+            t = nowSeconds();
+            for (f = 0; f < frames; f++)
+            {
+                LCD_ListDraw(list);
+                DirtyCount = 0;
+            }
+            t = nowSeconds() - t;
+            printf("  replayed  %8.1f  %s\n", frames / t,
+                   memcmp(ref, dst, w * h * sizeof(unsigned short)) ? "differs" : "same pixels");
+            LCD_ListFree(list);
+        }
+        free(ref);
+    }
+    surfaceFree(&s);
+    BackBuffer.pixels = 0;
+    free(src);
+    free(dst);
+
+    // full screen LCD_Flush to a framebuffer in memory
+    printf("Flush, %dx%d\n", w, h);
+    for (mode = 16; mode <= 32; mode += 8)
+    {
+        snprintf(dev, sizeof(dev), "mem:%dx%dx%d", w, h, mode);
+        LCD_Init(dev);
+        t = nowSeconds();
+        for (f = 0; f < frames; f++)
+        {
+            LCD_Invalidate(0, 0, w - 1, h - 1);
+            LCD_Flush();
+        }
+        t = nowSeconds() - t;
+        printf("  %d bpp    %8.1f Mpixel/s\n", mode, (double)w * h * frames / t / 1e6);
+        LCD_Close();
+    }
 }
 
 
 /*******************************************************************************
 * Function Name  : TP_Init
 * Description    : Initialize TP Controller.
-* Input          : /dev/input/eventX
+* Input          : /dev/input/eventX, or replay:file (replay-fast:file) to
+*                  replay a TP_Record log in real time (as fast as it is
+*                  read), file - is the standard input
 * Output         : None
 * Return         : None
-* Attention      : None
+* Attention      : A replay gives fd the same events as the device, the end
+*                  of the log ends LOOP_Run
 *******************************************************************************/
 void TP_Init(char* inputb)
 {
+    for (Inp = Inputs; strncmp(inputb, Inp->prefix, strlen(Inp->prefix)) != 0; Inp++);
+    if (Inp->open(inputb)) exit(1);
+}
+
+
+/*******************************************************************************
+* Function Name  : TP_Close
+* Description    : Stop recording and close the pointing device of TP_Init
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+void TP_Close(void)
+{
+    TP_Record(NULL);
+    if (Inp) Inp->close();
+    Inp = 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : evdevOpen, evdevClose
+* Description    : Input backend for a Linux event device
+* Input          : - inputb: /dev/input/eventX
+* Output         : None
+* Return         : 0 ok, -1 error
+* Attention      : Event times are CLOCK_MONOTONIC when the kernel can
+*******************************************************************************/
+static int evdevOpen(char *inputb)
+{
+    int clock = CLOCK_MONOTONIC;
+
     if ((fd = open(inputb, O_RDONLY)) == -1) {
         printf("Error: cannot open pointing device\n");
-        exit(1);
+        return -1;
     }
     
 	if (ioctl(fd, EVIOCGVERSION, &version)) {
 		printf("Error: cannot get version\n");
-		exit(1);
+		close(fd);
+		return -1;
 	}
 
 	printf("Input driver version is %d.%d.%d\n", version >> 16, (version >> 8) & 0xff, version & 0xff);
@@ -532,6 +1527,9 @@ void TP_Init(char* inputb)
 
 	memset(bit, 0, sizeof(bit));
 	ioctl(fd, EVIOCGBIT(0, EV_MAX), bit[0]);
+
+	// event times on the clock LOOP_Run measures the latency with
+	TouchClock = ioctl(fd, EVIOCSCLOCKID, &clock) ? CLOCK_REALTIME : CLOCK_MONOTONIC;
 	
 	/*printf("Supported events:\n");
 
@@ -557,743 +1555,6377 @@ void TP_Init(char* inputb)
 			}
 		}
 	}*/
+    return 0;
+}
+
+static void evdevClose(void)
+{
+    close(fd);
+    fd = -1;
 }
 
 
 /*******************************************************************************
-* Function Name  : LCD_Init
-* Description    : Initialize TFT Controller.
-* Input          : /dev/fbX
+* Function Name  : replayOpen, replayClose
+* Description    : Input backend replaying a TP_Record log
+* Input          : - inputb: replay:file or replay-fast:file
 * Output         : None
-* Return         : None
-* Attention      : None
+* Return         : 0 ok, -1 error
+* Attention      : A thread sends the events of every EV_SYN frame as one
+*                  packet of a socket pair, stamped with the time they are
+*                  sent; fd is the other end. A read gets one frame however
+*                  many are queued, so fast replays are repeatable too
 *******************************************************************************/
-void LCD_Init(char* frameb)
+static int replayOpen(char *inputb)
 {
-    // Open the file for reading and writing
-    fbfd = open(frameb, O_RDWR);
-    if (!fbfd) {
-        printf("Error: cannot open framebuffer device\n");
-        exit(1);
+    Replay *r;
+    unsigned char hdr[TPLOG_HEADER_SIZE];
+    char *file = strchr(inputb, ':') + 1;
+    int p[2], fast;
+    pthread_t t;
+    pthread_attr_t attr;
+
+    if ((r = (Replay*)calloc(1, sizeof(Replay))) == NULL) {
+        printf("Error: out of memory\n");
+        return -1;
     }
-    printf("The framebuffer/pointing device was opened successfully\n");
-
-    // Get variable screen information
-    if (ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo)) {
-        printf("Error reading variable information\n");
+    // r belongs to the thread once it runs
+    r->fast = fast = strncmp(inputb, "replay-fast:", 12) == 0;
+    r->fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "rb");
+    if (r->fp == NULL || fread(hdr, 1, TPLOG_HEADER_SIZE, r->fp) != TPLOG_HEADER_SIZE ||
+        memcmp(hdr, TPLOG_MAGIC, 4) != 0 || le16(hdr + 4) != TPLOG_VERSION)
+    {
+        printf("Error: %s is not a touch log\n", file);
+        if (r->fp && r->fp != stdin) fclose(r->fp);
+        free(r);
+        return -1;
     }
-    printf("Original %dx%d, %dbpp\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel );
-
-    // Store for reset (copy vinfo to vinfo_orig)
-    memcpy(&orig_vinfo, &vinfo, sizeof(struct fb_var_screeninfo));
-
-    // Get fixed screen information
-    if (ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo)) {
-        printf("Error reading fixed information.\n");
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, p)) {
+        printf("Error: cannot create socket pair\n");
+        if (r->fp != stdin) fclose(r->fp);
+        free(r);
+        return -1;
+    }
+    r->out = p[1];
+    fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    fcntl(p[1], F_SETFD, FD_CLOEXEC);
+
+    // detached, it may wait for more input when fd is closed
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&t, &attr, replayThread, r)) {
+        printf("Error: cannot start replay\n");
+        close(p[0]);
+        close(p[1]);
+        if (r->fp != stdin) fclose(r->fp);
+        free(r);
+        pthread_attr_destroy(&attr);
+        return -1;
     }
+    pthread_attr_destroy(&attr);
+    fd = p[0];
+    TouchClock = CLOCK_MONOTONIC;
+    printf("Replaying %s%s\n", file, fast ? " as fast as possible" : "");
+    return 0;
+}
 
-    // map fb to user mem
-    screensize = vinfo.xres * vinfo.yres * vinfo.bits_per_pixel / 8;
-    fbp = (char*)mmap(0,
-              screensize,
-              PROT_READ | PROT_WRITE,
-              MAP_SHARED,
-              fbfd,
-              0);
+static void replayClose(void)
+{
+    // the thread sees the other end is closed and ends
+    close(fd);
+    fd = -1;
 }
 
 
 /*******************************************************************************
-* Function Name  : TP_Button
-* Description    : Return te button pressed
-* Input          : None
+* Function Name  : replayThread
+* Description    : Sub for replayOpen, send the logged events
+* Input          : - arg: the Replay, freed at the end
 * Output         : None
-* Return         : Button pressed -1 if no button pressed
-* Attention      : None
+* Return         : NULL
+* Attention      : Waits by polling its socket so it ends as soon as fd is
+*                  closed; closes its socket at the end of the log
 *******************************************************************************/
-int TP_Button()
+static void *replayThread(void *arg)
 {
-    int i;
-
-    for (i=0; i<20; i++)
+    Replay *r = (Replay*)arg;
+    struct input_event ev[64];
+    struct timespec due, now;
+    struct pollfd pfd;
+    unsigned char b[TPLOG_EVENT_SIZE];
+    long long d;
+    int n = 0;
+
+    pfd.fd = r->out;
+    pfd.events = 0;
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    while (fread(b, 1, TPLOG_EVENT_SIZE, r->fp) == TPLOG_EVENT_SIZE)
     {
-        if (Butt[i].exist)
+        if (!r->fast)
         {
-            if (Butt[i].pressed == 1)
+            d = due.tv_nsec + (long long)le32(b) * 1000;
+            due.tv_sec += d / 1000000000;
+            due.tv_nsec = d % 1000000000;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            d = (due.tv_sec - now.tv_sec) * 1000000LL + (due.tv_nsec - now.tv_nsec) / 1000;
+            if (d > 0 && n > 0)
             {
-               Butt[i].pressed = 0;
-               return i;
+                if (send(r->out, ev, n * sizeof(struct input_event), MSG_NOSIGNAL) < 0) break;
+                n = 0;
             }
+            // rounded up to milliseconds, POLLHUP when fd is closed
+            if (d > 0 && poll(&pfd, 1, (d + 999) / 1000) != 0) break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ev[n].time.tv_sec = now.tv_sec;
+        ev[n].time.tv_usec = now.tv_nsec / 1000;
+        ev[n].type = b[4];
+        ev[n].code = le16(b + 5);
+        ev[n].value = (int)le32(b + 7);
+        // a frame in one packet, readable at once as from the device
+        if (++n == 64 || (ev[n - 1].type == EV_SYN && ev[n - 1].code == SYN_REPORT))
+        {
+            if (send(r->out, ev, n * sizeof(struct input_event), MSG_NOSIGNAL) < 0) break;
+            n = 0;
         }
     }
-    return -1;
+    if (n > 0 && send(r->out, ev, n * sizeof(struct input_event), MSG_NOSIGNAL) < 0) {
+        // nobody reads any more
+    }
+    close(r->out);
+    if (r->fp != stdin) fclose(r->fp);
+    free(r);
+    return NULL;
 }
 
 
-/******************************************************************************
-* Function Name  : LCD_Button
-* Description    : Make button
-* Input          : - x0: point x from upper left corner
-*                  - y0: point y from upper left corner
-*                  - x1: height
-*                  - y1: width
-*                  - col: Line color
-*                  - fcol: fill color -1 means no fill
-*                  - xo: text x origin of button
-*                  - yo: text y origin of button
-*                  - text: the text
-*                  - buttn: number of button
+/*******************************************************************************
+* Function Name  : TP_Record
+* Description    : Write every event read from the pointing device to a log
+* Input          : - file: filename full qualified path, NULL stops
 * Output         : None
-* Return         : None
-******************************************************************************/
-void LCD_Button(unsigned short x0, unsigned short y0, unsigned short x1, unsigned short y1, unsigned short col, int fcol, unsigned short xo, unsigned short yo, char* text, unsigned short buttn)
+* Return         : 0 ok, -1 error
+* Attention      : Little endian, a TPLOG_HEADER_SIZE header then
+*                  TPLOG_EVENT_SIZE bytes per event: microseconds since the
+*                  event before, type, code, value. TP_Init replay:file
+*                  plays it back
+*******************************************************************************/
+int TP_Record(char *file)
 {
-    LCD_DrawBox(x0, y0, x0 + x1, y0 + y1 , col, fcol);
-    LCD_Text(x0 + xo, y0 + yo, text, col, fcol);
-    Butt[buttn].exist = 1;
-    Butt[buttn].x0 = x0;
-    Butt[buttn].y0 = y0;
-    Butt[buttn].x1 = x0 + x1;
-    Butt[buttn].y1 = y0 + y1;
-    Butt[buttn].xo = x0 + xo;
-    Butt[buttn].yo = y0 + yo;
-    Butt[buttn].col = col;
-    Butt[buttn].fcol = fcol;
-    strcpy(Butt[buttn].text, text);
-    Butt[buttn].pressed = 0;
+    unsigned char hdr[TPLOG_HEADER_SIZE];
+
+    if (TouchLog) {
+        if (fclose(TouchLog) != 0) printf("Error writing touch log\n");
+        TouchLog = NULL;
+    }
+    if (file == NULL) return 0;
+
+    if ((TouchLog = fopen(file, "wb")) == NULL) {
+        printf("Error: cannot create %s\n", file);
+        return -1;
+    }
+    memcpy(hdr, TPLOG_MAGIC, 4);
+    put16(hdr + 4, TPLOG_VERSION);
+    put16(hdr + 6, 0);
+    fwrite(hdr, 1, TPLOG_HEADER_SIZE, TouchLog);
+    TouchLogTime.tv_sec = -1;
+    return 0;
 }
 
 
 /*******************************************************************************
-* Function Name  : LCD_PutImage
-* Description    : Show BMP
-* Input          : x upper left corner image start
-*                  y upper left corner image start
-*                  file filename full qualified path
+* Function Name  : tpLog
+* Description    : Sub for TP_GetAdXY, add events to the TP_Record log
+* Input          : - e: events
+*                  - n: count
 * Output         : None
 * Return         : None
-* Attention      : The image must be 8 or 24 bits RGB (sub will convert to 16 bits)
+* Attention      : The first event gets 0 microseconds
 *******************************************************************************/
-int LCD_PutImage(unsigned short x, unsigned short y, char* file)
+static void tpLog(const struct input_event *e, int n)
 {
-    UCHAR red, green, blue;
-    UINT width, height;
-    UINT r, c;
-    BMP* bmp;
+    unsigned char b[TPLOG_EVENT_SIZE];
+    long long d;
 
-    /* Read an image file */
-    bmp = BMP_ReadFile(file);
-    if (BMP_GetError() != BMP_OK)
+    for (; n > 0; n--, e++)
     {
-       /* Print error info */
-       printf( "An error has occurred: %s (code %d)\n", BMP_GetErrorDescription(), BMP_GetError() );
+        d = 0;
+        if (TouchLogTime.tv_sec != -1)
+            d = (e->time.tv_sec - TouchLogTime.tv_sec) * 1000000LL + e->time.tv_usec - TouchLogTime.tv_usec;
+        if (d < 0) d = 0;
+        if (d > 0xFFFFFFFFLL) d = 0xFFFFFFFFLL;
+        TouchLogTime = e->time;
+        put32(b, d);
+        b[4] = e->type;
+        put16(b + 5, e->code);
+        put32(b + 7, e->value);
+        fwrite(b, 1, TPLOG_EVENT_SIZE, TouchLog);
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_Init
+* Description    : Initialize TFT Controller.
+* Input          : /dev/fbX, or mem:WxH[xBPP] for a framebuffer in memory
+* Output         : None
+* Return         : None
+* Attention      : mem: takes 16, 24 or 32 bpp (default 16), nothing is shown,
+*                  LCD_Snapshot writes what would be
+*******************************************************************************/
+void LCD_Init(char* frameb)
+{
+    int i;
+
+    for (Disp = Displays; strncmp(frameb, Disp->prefix, strlen(Disp->prefix)) != 0; Disp++);
+    if (Disp->open(frameb)) exit(1);
+
+    // back buffer starts as a copy of what is on screen
+    BackBuffer.width = FbWidth;
+    BackBuffer.height = FbHeight;
+    BackBuffer.stride = FbWidth;
+    BackBuffer.pixels = (unsigned short*)malloc(BackBuffer.stride * BackBuffer.height * sizeof(unsigned short));
+    if (BackBuffer.pixels == NULL) {
+        printf("Error: cannot allocate back buffer\n");
+        exit(1);
+    }
+    if (fbp != MAP_FAILED) {
+        for (i = 0; i < BackBuffer.height; i++)
+            fbGetRow(BackBuffer.pixels + i * BackBuffer.stride, i);
+    }
+    DirtyCount = 0;
+    LCD_SetOrigin(0, 0);
+    LCD_ResetClip();
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_Close
+* Description    : Free the back buffer and close the display of LCD_Init
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : What is shown stays, call LCD_Flush first
+*******************************************************************************/
+void LCD_Close(void)
+{
+    frameDraw();
+    free(BackBuffer.pixels);
+    BackBuffer.pixels = 0;
+    DirtyCount = 0;
+    if (Disp) Disp->close();
+    Disp = 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : fbdevOpen, fbdevClose
+* Description    : Display backend for a Linux framebuffer device, mapped
+* Input          : - frameb: /dev/fbX
+* Output         : None
+* Return         : 0 ok, -1 error
+* Attention      : 16 bpp is RGB565, 24 and 32 bpp are B G R [X] bytes,
+*                  other channel orders are refused
+*******************************************************************************/
+static int fbdevOpen(char *frameb)
+{
+    // Open the file for reading and writing
+    fbfd = open(frameb, O_RDWR);
+    if (fbfd == -1) {
+        printf("Error: cannot open framebuffer device\n");
+        return -1;
     }
+    printf("The framebuffer/pointing device was opened successfully\n");
 
-    /* Get image's dimensions */
-    width = BMP_GetWidth(bmp);
-    height = BMP_GetHeight(bmp);
+    // Get variable screen information
+    if (ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo)) {
+        printf("Error reading variable information\n");
+    }
+    printf("Original %dx%d, %dbpp\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel );
 
+    // Store for reset (copy vinfo to vinfo_orig)
+    memcpy(&orig_vinfo, &vinfo, sizeof(struct fb_var_screeninfo));
 
-    /* Iterate through all the image's pixels */
-    for (c=0; c<height; ++c)
+    // Get fixed screen information
+    if (ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo)) {
+        printf("Error reading fixed information.\n");
+    }
+    if (vinfo.bits_per_pixel != 16 && vinfo.bits_per_pixel != 24 && vinfo.bits_per_pixel != 32) {
+        printf("Error: %dbpp is not supported\n", vinfo.bits_per_pixel);
+        close(fbfd);
+        fbfd = -1;
+        return -1;
+    }
+    // fbPutRow and fbGetRow write and read B G R [X], e.g. not R G B of the Pi firmware
+    if (vinfo.bits_per_pixel != 16 &&
+        (vinfo.red.offset != 16 || vinfo.green.offset != 8 || vinfo.blue.offset != 0))
     {
-        for (r=0; r<width; ++r)
-        {
-            BMP_GetPixelRGB(bmp, r, c, &red, &green, &blue);
-            LCD_SetPoint(x+r, y+c, RGB565CONVERT(red, green, blue));
-        }
+        printf("Error: %dbpp with red at %d, green at %d, blue at %d is not supported\n",
+               vinfo.bits_per_pixel, vinfo.red.offset, vinfo.green.offset, vinfo.blue.offset);
+        close(fbfd);
+        fbfd = -1;
+        return -1;
     }
 
+    // map fb to user mem
+    screensize = finfo.line_length * vinfo.yres;
+    fbp = (char*)mmap(0,
+              screensize,
+              PROT_READ | PROT_WRITE,
+              MAP_SHARED,
+              fbfd,
+              0);
+    if (fbp == MAP_FAILED) {
+        printf("Error: cannot map framebuffer device\n");
+        fbp = 0;
+        close(fbfd);
+        fbfd = -1;
+        return -1;
+    }
+    FbWidth = vinfo.xres;
+    FbHeight = vinfo.yres;
+    FbBpp = vinfo.bits_per_pixel;
+    FbLine = finfo.line_length;
     return 0;
 }
 
+static void fbdevClose(void)
+{
+    if (fbp != MAP_FAILED) munmap(fbp, screensize);
+    fbp = 0;
+    if (ioctl(fbfd, FBIOPUT_VSCREENINFO, &orig_vinfo)) {
+        printf("Error re-setting variable information\n");
+    }
+    close(fbfd);
+    fbfd = -1;
+}
 
-/******************************************************************************
-* Function Name  : LCD_SetPoint
-* Description    : Drawn at a specified point coordinates
-* Input          : - Xpos: Row Coordinate
-*                  - Ypos: Line Coordinate
+
+/*******************************************************************************
+* Function Name  : memOpen, memClose
+* Description    : Display backend for a framebuffer in memory
+* Input          : - frameb: mem:WxH or mem:WxHxBPP
 * Output         : None
+* Return         : 0 ok, -1 error
+* Attention      : Starts black. For tests and benchmarks without a display
+*******************************************************************************/
+static int memOpen(char *frameb)
+{
+    int w, h, bpp = 16;
+
+    if (sscanf(frameb, "mem:%dx%dx%d", &w, &h, &bpp) < 2 || w < 1 || h < 1 || w > 4096 || h > 4096 ||
+        (bpp != 16 && bpp != 24 && bpp != 32))
+    {
+        printf("Error: %s is not mem:WxH[x16|x24|x32]\n", frameb);
+        return -1;
+    }
+    FbWidth = w;
+    FbHeight = h;
+    FbBpp = bpp;
+    // lines 4 byte aligned like most framebuffers
+    FbLine = (w * bpp / 8 + 3) & ~3;
+    if ((fbp = (char*)calloc(h, FbLine)) == NULL) {
+        printf("Error: cannot allocate framebuffer\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void memClose(void)
+{
+    free(fbp);
+    fbp = 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : fbGetRow
+* Description    : Sub for LCD_Init, read a framebuffer line as RGB565
+* Input          : - y: line
+* Output         : - dst: FbWidth pixels
 * Return         : None
 * Attention      : None
 *******************************************************************************/
-void LCD_SetPoint( unsigned short x, unsigned short y, unsigned short point)
+static void fbGetRow(unsigned short *dst, int y)
+{
+    const unsigned char *src = (const unsigned char*)fbp + y * FbLine;
+
+    if (FbBpp == 16)
+        memcpy(dst, src, FbWidth * 2);
+    else
+        RGB565_ConvertRow(dst, src, FbWidth, FbBpp / 8, 0, y, 0);
+}
+
+
+/*******************************************************************************
+* Function Name  : fbPutRow
+* Description    : Sub for LCD_Flush, copy part of a back buffer line
+* Input          : - y: line
+*                  - x0, x1: first and last pixel
+* Output         : None
+* Return         : None
+* Attention      : 24 and 32 bpp repeat the top bits of each channel, white
+*                  stays 255 255 255
+*******************************************************************************/
+static void fbPutRow(int y, int x0, int x1)
 {
-    if( x >= vinfo.xres || y >= vinfo.yres )
+    const unsigned short *src = BackBuffer.pixels + y * BackBuffer.stride + x0;
+    unsigned char *dst;
+    int n, c, bytes = FbBpp / 8;
+
+    if (FbBpp == 16)
     {
+        memcpy(fbp + y * FbLine + x0 * 2, src, (x1 - x0 + 1) * 2);
         return;
-    } else {
-        // calculate the pixel's byte offset inside the buffer
-        // note: x * 2 as every pixel is 2 consecutive bytes
-        unsigned int pix_offset = x * 2 + y * finfo.line_length;
+    }
+    dst = (unsigned char*)fbp + y * FbLine + x0 * bytes;
+    for (n = x0; n <= x1; n++, dst += bytes)
+    {
+        c = *src++;
+        dst[0] = ((c & 0x1F) << 3) | ((c & 0x1F) >> 2);
+        dst[1] = ((c >> 3) & 0xFC) | ((c >> 9) & 0x03);
+        dst[2] = ((c >> 8) & 0xF8) | (c >> 13);
+        if (bytes == 4) dst[3] = 0xFF;
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : fbRGBRow
+* Description    : Sub for LCD_Snapshot, read a framebuffer line as R G B
+* Input          : - y: line
+* Output         : - rgb: FbWidth * 3 bytes
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void fbRGBRow(unsigned char *rgb, int y)
+{
+    const unsigned char *src = (const unsigned char*)fbp + y * FbLine;
+    int n, c, bytes = FbBpp / 8;
+
+    for (n = 0; n < FbWidth; n++, src += bytes, rgb += 3)
+    {
+        if (FbBpp == 16)
+        {
+            c = src[0] | (src[1] << 8);
+            rgb[0] = ((c >> 8) & 0xF8) | (c >> 13);
+            rgb[1] = ((c >> 3) & 0xFC) | ((c >> 9) & 0x03);
+            rgb[2] = ((c & 0x1F) << 3) | ((c & 0x1F) >> 2);
+        } else {
+            rgb[0] = src[2];
+            rgb[1] = src[1];
+            rgb[2] = src[0];
+        }
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_Snapshot
+* Description    : Write what the display shows to an image file
+* Input          : - file: filename full qualified path, .png for PNG, any
+*                    other name for binary PPM
+* Output         : None
+* Return         : 0 ok, -1 error
+* Attention      : LCD_Flush is called first. The PNG is not compressed so it
+*                  needs no library, tools read both formats
+*******************************************************************************/
+int LCD_Snapshot(char *file)
+{
+    FILE *fp;
+    unsigned char *data, *rgb, hdr[13];
+    unsigned long size, n, m, k, adler_a = 1, adler_b = 0;
+    int y, len = strlen(file), png, row;
+
+    LCD_Flush();
+    if (fbp == 0 || fbp == MAP_FAILED) return -1;
+    png = len > 4 && strcmp(file + len - 4, ".png") == 0;
+    row = FbWidth * 3;
+
+    // PNG: zlib header, stored deflate blocks of up to 65535 bytes with
+    // a filter byte before each line, the Adler-32 of the lines at the end
+    size = png ? (unsigned long)(row + 1) * FbHeight : (unsigned long)row * FbHeight;
+    data = (unsigned char*)malloc(png ? 2 + size + (size / 65535 + 1) * 5 + 4 : size);
+    rgb = (unsigned char*)malloc(size);
+    if (data == NULL || rgb == NULL || (fp = fopen(file, "wb")) == NULL)
+    {
+        printf("Error: cannot create %s\n", file);
+        free(data);
+        free(rgb);
+        return -1;
+    }
+    for (y = 0; y < FbHeight; y++)
+    {
+        if (png)
+        {
+            rgb[y * (row + 1)] = 0;
+            fbRGBRow(rgb + y * (row + 1) + 1, y);
+        } else {
+            fbRGBRow(rgb + y * row, y);
+        }
+    }
 
-        // now this is about the same as 'fbp[pix_offset] = value'
-        // but a bit more complicated for RGB565
-        //unsigned short c = ((r / 8) << 11) + ((g / 4) << 5) + (b / 8);
-        //unsigned short c = ((r / 8) * 2048) + ((g / 4) * 32) + (b / 8);
-        // write 'two bytes at once'
-        //*((unsigned short*)(fbp + pix_offset)) = c;
-        *((unsigned short*)(fbp + pix_offset)) = point;
+    if (!png)
+    {
+        fprintf(fp, "P6\n%d %d\n255\n", FbWidth, FbHeight);
+        fwrite(rgb, 1, size, fp);
+    } else {
+        fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp);
+        hdr[0] = FbWidth >> 24;
+        hdr[1] = FbWidth >> 16;
+        hdr[2] = FbWidth >> 8;
+        hdr[3] = FbWidth;
+        hdr[4] = FbHeight >> 24;
+        hdr[5] = FbHeight >> 16;
+        hdr[6] = FbHeight >> 8;
+        hdr[7] = FbHeight;
+        hdr[8] = 8;     // bits per channel
+        hdr[9] = 2;     // RGB
+        hdr[10] = hdr[11] = hdr[12] = 0;
+        pngChunk(fp, "IHDR", hdr, 13);
+
+        data[0] = 0x78;
+        data[1] = 0x01;
+        m = 2;
+        for (n = 0; n < size; n += k)
+        {
+            k = size - n > 65535 ? 65535 : size - n;
+            data[m++] = n + k == size;
+            put16(data + m, k);
+            put16(data + m + 2, ~k);
+            memcpy(data + m + 4, rgb + n, k);
+            m += 4 + k;
+        }
+        for (n = 0; n < size; n++)
+        {
+            adler_a = (adler_a + rgb[n]) % 65521;
+            adler_b = (adler_b + adler_a) % 65521;
+        }
+        n = (adler_b << 16) | adler_a;
+        data[m++] = n >> 24;
+        data[m++] = n >> 16;
+        data[m++] = n >> 8;
+        data[m++] = n;
+        pngChunk(fp, "IDAT", data, m);
+        pngChunk(fp, "IEND", data, 0);
+    }
+    free(data);
+    free(rgb);
+    if (ferror(fp) | fclose(fp))
+    {
+        printf("Error writing %s\n", file);
+        return -1;
     }
+    return 0;
 }
 
 
 /*******************************************************************************
-* Function Name  : DelayMicrosecondsNoSleep
-* Description    : Delay n microseconds
-* Input          : delay_us: specifies the n microseconds
+* Function Name  : pngChunk
+* Description    : Sub for LCD_Snapshot, write a PNG chunk
+* Input          : - fp: the file
+*                  - type: 4 letters
+*                  - data, len: the data
 * Output         : None
 * Return         : None
-* Attention      : None
+* Attention      : Big endian length and CRC-32 of type and data
 *******************************************************************************/
-void DelayMicrosecondsNoSleep (int delay_us)
+static void pngChunk(FILE *fp, const char *type, const unsigned char *data, unsigned long len)
 {
-    long int start_time;
-    long int time_difference;
-    struct timespec gettime_now;
+    static unsigned long crcTable[256];
+    unsigned long crc, c, n;
+    unsigned char b[4];
+    int k;
 
-    clock_gettime(CLOCK_REALTIME, &gettime_now);
-    start_time = gettime_now.tv_nsec;		 //Get nS value
+    if (crcTable[1] == 0)
+    {
+        for (n = 0; n < 256; n++)
+        {
+            for (c = n, k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+            crcTable[n] = c;
+        }
+    }
+    b[0] = len >> 24;
+    b[1] = len >> 16;
+    b[2] = len >> 8;
+    b[3] = len;
+    fwrite(b, 1, 4, fp);
+    fwrite(type, 1, 4, fp);
+    fwrite(data, 1, len, fp);
+
+    crc = 0xFFFFFFFFUL;
+    for (n = 0; n < 4; n++)
+        crc = crcTable[(crc ^ (unsigned char)type[n]) & 0xFF] ^ (crc >> 8);
+    for (n = 0; n < len; n++)
+        crc = crcTable[(crc ^ data[n]) & 0xFF] ^ (crc >> 8);
+    crc ^= 0xFFFFFFFFUL;
+    b[0] = crc >> 24;
+    b[1] = crc >> 16;
+    b[2] = crc >> 8;
+    b[3] = crc;
+    fwrite(b, 1, 4, fp);
+}
 
-    while (1)
+
+
+/*******************************************************************************
+* Function Name  : TP_Button
+* Description    : Return te button pressed
+* Input          : None
+* Output         : None
+* Return         : Button pressed -1 if no button pressed
+* Attention      : Presses are queued, call until -1 to get all of them
+*******************************************************************************/
+int TP_Button()
+{
+    int i;
+
+    if (PressCount == 0) return -1;
+
+    i = PressQueue[PressFirst];
+    PressFirst = (PressFirst + 1) % PRESS_QUEUE;
+    PressCount--;
+    return i;
+}
+
+
+/*******************************************************************************
+* Function Name  : LOOP_Init
+* Description    : Create the event loop on the device opened by TP_Init
+* Input          : None
+* Output         : None
+* Return         : 0 ok, -1 error
+* Attention      : Call after TP_Init and TP_Cal
+*******************************************************************************/
+int LOOP_Init(void)
+{
+    struct epoll_event e;
+    int fds[3], n;
+
+    LoopFd = epoll_create1(EPOLL_CLOEXEC);
+    LoopTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    LoopWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (LoopFd == -1 || LoopTimerFd == -1 || LoopWakeFd == -1) {
+        printf("Error: cannot create event loop\n");
+        return -1;
+    }
+
+    fds[0] = fd;
+    fds[1] = LoopTimerFd;
+    fds[2] = LoopWakeFd;
+    for (n = 0; n < 3; n++)
     {
-        clock_gettime(CLOCK_REALTIME, &gettime_now);
-        time_difference = gettime_now.tv_nsec - start_time;
-        if (time_difference < 0)
-	    time_difference += 1000000000;	 //(Rolls over every 1 second)
-	if (time_difference > (delay_us * 1000)) //Delay for # nS
-	    break;
+        memset(&e, 0, sizeof(e));
+        e.events = EPOLLIN;
+        e.data.fd = fds[n];
+        if (epoll_ctl(LoopFd, EPOLL_CTL_ADD, fds[n], &e)) {
+            printf("Error: cannot watch fd %d\n", fds[n]);
+            return -1;
+        }
     }
+    tpFilterReset();
+    GestState = GEST_UP;
+    GestCount = 0;
+    return 0;
 }
 
 
 /*******************************************************************************
-* Function Name  : GetASCIICode
-* Description    : get ASCII code data
-* Input          : - ASCII: Input ASCII code
-* Output         : - *pBuffer: Store data pointer
+* Function Name  : LOOP_Run
+* Description    : Sleep in epoll_wait and call the touch, timer, wake-up
+*                  and gesture handlers, then paint the damaged widgets as one recorded
+*                  frame and flush
+* Input          : None
+* Output         : None
+* Return         : 0 after LOOP_Quit, -1 error
+* Attention      : No CPU is used while nothing happens
+*******************************************************************************/
+int LOOP_Run(void)
+{
+    struct epoll_event ready[4];
+    struct timespec now;
+    uint64_t v;
+    Coordinate *p;
+    Gesture g;
+    long lat;
+    int n, r, touched;
+
+    LCD_BeginFrame();
+    UI_Paint();
+    LCD_EndFrame();
+    LCD_Flush();
+    LoopRunning = 1;
+    while (LoopRunning)
+    {
+        if ((n = epoll_wait(LoopFd, ready, 4, -1)) == -1) {
+            if (errno == EINTR) continue;
+            printf("Error: epoll_wait\n");
+            return -1;
+        }
+        touched = 0;
+        for (r = 0; r < n; r++)
+        {
+            if (ready[r].data.fd == fd) {
+                if ((ready[r].events & EPOLLIN) && (Inp->finite || !(ready[r].events & (EPOLLERR | EPOLLHUP)))) {
+                    touched = 1;
+                    p = TP_Sample();
+                    if (TouchEnded) LoopRunning = 0;
+                    else if (p != 0 && LoopTouch) LoopTouch(p);
+                } else if (Inp->finite) {
+                    // the end of a replay
+                    LoopRunning = 0;
+                } else {
+                    printf("Error: pointing device gone\n");
+                    return -1;
+                }
+            } else if (ready[r].data.fd == LoopTimerFd) {
+                if (read(LoopTimerFd, &v, sizeof(v)) == sizeof(v)) timerExpire();
+            } else if (ready[r].data.fd == LoopWakeFd) {
+                if (read(LoopWakeFd, &v, sizeof(v)) == sizeof(v) && LoopWake) LoopWake();
+            }
+        }
+        // of the touch events and the long press timer
+        while (TP_GetGesture(&g))
+            if (LoopRunning && LoopGesture) LoopGesture(&g);
+        LCD_BeginFrame();
+        UI_Paint();
+        LCD_EndFrame();
+        LCD_Flush();
+
+        // from the last event read to the frame on screen
+        if (touched)
+        {
+            clock_gettime(TouchClock, &now);
+            lat = (now.tv_sec - TouchTime.tv_sec) * 1000000L + now.tv_nsec / 1000 - TouchTime.tv_usec;
+            if (lat >= 0 && lat < LATENCY_MAX_US)
+            {
+                LatencyCount++;
+                LatencySum += lat;
+                if (lat > LatencyMax) LatencyMax = lat;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : LOOP_Quit
+* Description    : Make LOOP_Run return after the current handlers
+* Input          : None
+* Output         : None
 * Return         : None
-* Attention	 	 : None
+* Attention      : From a handler, other threads use LOOP_Wake too
 *******************************************************************************/
-void GetASCIICode(unsigned char* pBuffer,unsigned char ASCII)
+void LOOP_Quit(void)
 {
-    memcpy(pBuffer,AsciiLib[(ASCII - 32)] ,16);
+    LoopRunning = 0;
 }
 
 
 /*******************************************************************************
-* Function Name  : LCD_Clear
-* Description    : Fill the screen as the specified color
-* Input          : - Color: Screen Color
+* Function Name  : LOOP_Wake
+* Description    : Wake LOOP_Run and call the LOOP_OnWake handler
+* Input          : None
 * Output         : None
 * Return         : None
-* Attention	 	 : None
+* Attention      : Safe from other threads and signal handlers, wakes
+*                  before the handler runs are merged into one call
+*******************************************************************************/
+void LOOP_Wake(void)
+{
+    uint64_t one = 1;
+
+    if (write(LoopWakeFd, &one, sizeof(one)) != sizeof(one)) {
+        // counter full, a wake-up is already pending
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : LOOP_OnTouch, LOOP_OnWake, LOOP_OnGesture
+* Description    : Set the handlers called by LOOP_Run
+* Input          : - fn: the handler, 0 for none
+* Output         : None
+* Return         : None
+* Attention      : The touch handler gets every filtered point, the
+*                  gesture handler every gesture in order
+*******************************************************************************/
+void LOOP_OnTouch(void (*fn)(Coordinate *))
+{
+    LoopTouch = fn;
+}
+
+void LOOP_OnWake(void (*fn)(void))
+{
+    LoopWake = fn;
+}
+
+void LOOP_OnGesture(void (*fn)(Gesture *))
+{
+    LoopGesture = fn;
+}
+
+
+/*******************************************************************************
+* Function Name  : LOOP_TouchStats
+* Description    : Report how fast LOOP_Run answers the pointing device
+* Input          : None
+* Output         : - count: frames painted after touch input
+*                  - avg_us, max_us: microseconds from the last event read
+*                    to the end of LCD_Flush
+* Return         : None
+* Attention      : With replay-fast: events queue up, count over the run
+*                  time is the throughput
+*******************************************************************************/
+void LOOP_TouchStats(unsigned long *count, long *avg_us, long *max_us)
+{
+    *count = LatencyCount;
+    *avg_us = LatencyCount ? LatencySum / LatencyCount : 0;
+    *max_us = LatencyMax;
+}
+
+
+/*******************************************************************************
+* Function Name  : loopNow
+* Description    : Sub for the loop timers
+* Input          : None
+* Output         : None
+* Return         : CLOCK_MONOTONIC in milliseconds
+* Attention      : None
+*******************************************************************************/
+static long long loopNow(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+
+/*******************************************************************************
+* Function Name  : timerUp, timerDown
+* Description    : Sub for the loop timers, restore the heap order after
+*                  Timers[n] got an earlier or a later due time
+* Input          : - n: heap index
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void timerUp(int n)
+{
+    LoopTimer t = Timers[n];
+
+    while (n > 0 && Timers[(n - 1) / 2].due > t.due)
+    {
+        Timers[n] = Timers[(n - 1) / 2];
+        TimerIndex[(Timers[n].id - 1) % MAX_TIMERS] = n;
+        n = (n - 1) / 2;
+    }
+    Timers[n] = t;
+    TimerIndex[(t.id - 1) % MAX_TIMERS] = n;
+}
+
+static void timerDown(int n)
+{
+    LoopTimer t = Timers[n];
+    int c;
+
+    while ((c = 2 * n + 1) < TimerCount)
+    {
+        if (c + 1 < TimerCount && Timers[c + 1].due < Timers[c].due) c++;
+        if (Timers[c].due >= t.due) break;
+        Timers[n] = Timers[c];
+        TimerIndex[(Timers[n].id - 1) % MAX_TIMERS] = n;
+        n = c;
+    }
+    Timers[n] = t;
+    TimerIndex[(t.id - 1) % MAX_TIMERS] = n;
+}
+
+
+/*******************************************************************************
+* Function Name  : timerRemove
+* Description    : Sub for the loop timers, drop Timers[n]
+* Input          : - n: heap index
+* Output         : None
+* Return         : None
+* Attention      : Does not re-arm LoopTimerFd, the slot of its id is free
+*******************************************************************************/
+static void timerRemove(int n)
+{
+    TimerFree[TimerFreeCount++] = (Timers[n].id - 1) % MAX_TIMERS;
+    if (--TimerCount == n) return;
+    Timers[n] = Timers[TimerCount];
+    if (n > 0 && Timers[n].due < Timers[(n - 1) / 2].due)
+        timerUp(n);
+    else
+        timerDown(n);
+}
+
+
+/*******************************************************************************
+* Function Name  : timerArm
+* Description    : Sub for the loop timers, set LoopTimerFd to the first due
+*                  time or stop it when there are no timers
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void timerArm(void)
+{
+    struct itimerspec t;
+
+    memset(&t, 0, sizeof(t));
+    if (TimerCount > 0)
+    {
+        t.it_value.tv_sec = Timers[0].due / 1000;
+        t.it_value.tv_nsec = (Timers[0].due % 1000) * 1000000;
+    }
+    timerfd_settime(LoopTimerFd, TFD_TIMER_ABSTIME, &t, NULL);
+}
+
+
+/*******************************************************************************
+* Function Name  : timerExpire
+* Description    : Sub for LOOP_Run, call every timer that is due
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : Handlers may add and cancel timers
+*******************************************************************************/
+static void timerExpire(void)
+{
+    long long now = loopNow();
+    LoopTimer t;
+
+    while (TimerCount > 0 && Timers[0].due <= now)
+    {
+        t = Timers[0];
+        if (t.interval > 0)
+        {
+            // next period, skip the ones already missed
+            Timers[0].due += t.interval;
+            if (Timers[0].due <= now) Timers[0].due = now + t.interval;
+            timerDown(0);
+        } else {
+            timerRemove(0);
+        }
+        t.fn(t.arg);
+    }
+    timerArm();
+}
+
+
+/*******************************************************************************
+* Function Name  : LOOP_AddTimer
+* Description    : Call a function from LOOP_Run after a delay
+* Input          : - ms: delay in milliseconds
+*                  - interval: repeat period in milliseconds, 0 for once
+*                  - fn: the function
+*                  - arg: passed to fn
+* Output         : None
+* Return         : timer id for LOOP_CancelTimer, -1 if MAX_TIMERS are pending
+* Attention      : Timers are kept in a min-heap, add and cancel are O(log n)
+*******************************************************************************/
+int LOOP_AddTimer(long ms, long interval, void (*fn)(void *), void *arg)
+{
+    LoopTimer *t;
+    int id, slot;
+
+    if (TimerCount == MAX_TIMERS || LoopTimerFd == -1) return -1;
+
+    slot = TimerFreeCount > 0 ? TimerFree[--TimerFreeCount] : TimerSlots++;
+    t = &Timers[TimerCount++];
+    t->due = loopNow() + ms;
+    t->interval = interval;
+    t->fn = fn;
+    t->arg = arg;
+    // a new id for the slot, an old id no longer matches
+    t->id = id = TimerSeq * MAX_TIMERS + slot + 1;
+    TimerSeq = TimerSeq >= INT_MAX / MAX_TIMERS - 1 ? 0 : TimerSeq + 1;
+    timerUp(TimerCount - 1);
+    if (Timers[0].id == id) timerArm();
+    return id;
+}
+
+
+/*******************************************************************************
+* Function Name  : LOOP_CancelTimer
+* Description    : Stop a timer from LOOP_AddTimer
+* Input          : - id: the timer, unknown or expired ids are ignored
+* Output         : None
+* Return         : None
+* Attention      : O(log n), the id leads to the heap index
+*******************************************************************************/
+void LOOP_CancelTimer(int id)
+{
+    int n;
+
+    if (id <= 0) return;
+    n = TimerIndex[(id - 1) % MAX_TIMERS];
+    if (n >= TimerCount || Timers[n].id != id) return;
+    timerRemove(n);
+    timerArm();
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_Button
+* Description    : Make button
+* Input          : - x0: point x from upper left corner
+*                  - y0: point y from upper left corner
+*                  - x1: height
+*                  - y1: width
+*                  - col: Line color
+*                  - fcol: fill color -1 means no fill
+*                  - xo: text x origin of button
+*                  - yo: text y origin of button
+*                  - text: the text
+*                  - buttn: number of button
+* Output         : None
+* Return         : None
+* Attention      : Any number of buttons, the table grows to the highest
+*                  buttn, an existing button with the same number is replaced;
+*                  the hit area is kept in screen coordinates
+******************************************************************************/
+void LCD_Button(unsigned short x0, unsigned short y0, unsigned short x1, unsigned short y1, unsigned short col, int fcol, unsigned short xo, unsigned short yo, char* text, unsigned short buttn)
+{
+    char *t;
+
+    LCD_DrawBox(x0, y0, x0 + x1, y0 + y1 , col, fcol);
+    LCD_Text(x0 + xo, y0 + yo, text, col, fcol);
+
+    if (buttn < ButtCount && Butt[buttn].widget) LCD_ButtonRemove(buttn);
+    if (buttonSlot(buttn) == NULL || (t = strdup(text)) == NULL) {
+        printf("Error: out of memory for button %u\n", buttn);
+        return;
+    }
+    free(Butt[buttn].text);
+    Butt[buttn].text = t;
+    Butt[buttn].exist = 1;
+    Butt[buttn].x0 = Ctx.ox + x0;
+    Butt[buttn].y0 = Ctx.oy + y0;
+    Butt[buttn].x1 = Ctx.ox + x0 + x1;
+    Butt[buttn].y1 = Ctx.oy + y0 + y1;
+    Butt[buttn].xo = Ctx.ox + x0 + xo;
+    Butt[buttn].yo = Ctx.oy + y0 + yo;
+    Butt[buttn].col = col;
+    Butt[buttn].fcol = fcol;
+    LOOP_CancelTimer(Butt[buttn].release);
+    Butt[buttn].release = 0;
+    if (Butt[buttn].due) PressLate--;
+    Butt[buttn].due = 0;
+    GridDirty = 1;
+}
+
+
+/*******************************************************************************
+* Function Name  : buttonSlot
+* Description    : Sub for LCD_Button and UI_SetButton, grow the button table
+* Input          : - buttn: number of button
+* Output         : None
+* Return         : the button, 0 out of memory
+* Attention      : New entries are zero
+*******************************************************************************/
+static Button *buttonSlot(unsigned short buttn)
+{
+    Button *b;
+
+    if (buttn >= ButtCount)
+    {
+        if ((b = (Button*)realloc(Butt, (buttn + 1) * sizeof(Button))) == NULL) return NULL;
+        memset(b + ButtCount, 0, (buttn + 1 - ButtCount) * sizeof(Button));
+        Butt = b;
+        ButtCount = buttn + 1;
+    }
+    return &Butt[buttn];
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_ButtonRemove
+* Description    : Stop a button from reacting to touches
+* Input          : - buttn: number of button
+* Output         : None
+* Return         : None
+* Attention      : What is on the screen stays
+*******************************************************************************/
+void LCD_ButtonRemove(unsigned short buttn)
+{
+    if (buttn >= ButtCount || !Butt[buttn].exist) return;
+
+    LOOP_CancelTimer(Butt[buttn].release);
+    if (Butt[buttn].due) PressLate--;
+    if (Butt[buttn].widget) Widgets[Butt[buttn].widget - 1].button = -1;
+    free(Butt[buttn].text);
+    memset(&Butt[buttn], 0, sizeof(Button));
+    GridDirty = 1;
+}
+
+
+/*******************************************************************************
+* Function Name  : buttonGrid
+* Description    : Sub for getDisplayPoint, list every button in the grid
+*                  cells it covers
+* Input          : None
+* Output         : None
+* Return         : 0 ok, -1 out of memory
+* Attention      : Lists are in button order, like the old linear scan
+*******************************************************************************/
+static int buttonGrid(void)
+{
+    int cols, rows, b, cx, cy, cx0, cy0, cx1, cy1, c, *p;
+
+    cols = (BackBuffer.width + BUTTON_CELL - 1) / BUTTON_CELL;
+    rows = (BackBuffer.height + BUTTON_CELL - 1) / BUTTON_CELL;
+    if (cols * rows != GridCols * GridRows)
+    {
+        if ((p = (int*)realloc(GridHead, cols * rows * sizeof(int))) == NULL) return -1;
+        GridHead = p;
+    }
+    GridCols = cols;
+    GridRows = rows;
+    for (c = 0; c < cols * rows; c++)
+        GridHead[c] = -1;
+
+    GridNodes = 0;
+    for (b = ButtCount - 1; b >= 0; b--)
+    {
+        if (!Butt[b].exist) continue;
+
+        // touches hit strictly inside the frame
+        cx0 = (Butt[b].x0 + 1) / BUTTON_CELL;
+        cy0 = (Butt[b].y0 + 1) / BUTTON_CELL;
+        cx1 = (Butt[b].x1 - 1) / BUTTON_CELL;
+        cy1 = (Butt[b].y1 - 1) / BUTTON_CELL;
+        if (Butt[b].x1 - 1 < Butt[b].x0 + 1 || Butt[b].y1 - 1 < Butt[b].y0 + 1) continue;
+        if (cx1 >= cols) cx1 = cols - 1;
+        if (cy1 >= rows) cy1 = rows - 1;
+
+        for (cy = cy0; cy <= cy1; cy++)
+        {
+            for (cx = cx0; cx <= cx1; cx++)
+            {
+                if (GridNodes == GridNodeMax)
+                {
+                    c = GridNodeMax ? GridNodeMax * 2 : 256;
+                    if ((p = (int*)realloc(GridNode, c * 2 * sizeof(int))) == NULL) return -1;
+                    GridNode = p;
+                    GridNodeMax = c;
+                }
+                c = cy * cols + cx;
+                GridNode[GridNodes * 2] = b;
+                GridNode[GridNodes * 2 + 1] = GridHead[c];
+                GridHead[c] = GridNodes++;
+            }
+        }
+    }
+    GridDirty = 0;
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : buttonPress
+* Description    : Sub for getDisplayPoint, highlight a button and queue it
+*                  for TP_Button, widgets at the next UI_Paint
+* Input          : - i: number of button
+* Output         : None
+* Return         : None
+* Attention      : The oldest press is dropped when PRESS_QUEUE are waiting.
+*                  Never blocks: without a free timer buttonLate releases it
+*******************************************************************************/
+static void buttonPress(int i)
+{
+    DrawContext c;
+
+    if (PressCount == PRESS_QUEUE) {
+        PressFirst = (PressFirst + 1) % PRESS_QUEUE;
+        PressCount--;
+    }
+    PressQueue[(PressFirst + PressCount++) % PRESS_QUEUE] = i;
+
+    if (Butt[i].widget) {
+        uiPressed(Butt[i].widget - 1, 1);
+    } else {
+        LCD_GetContext(&c);
+        LCD_SetOrigin(0, 0);
+        LCD_ResetClip();
+        LCD_DrawBox(Butt[i].x0, Butt[i].y0, Butt[i].x1, Butt[i].y1, Butt[i].fcol, Butt[i].col);
+        LCD_Text(Butt[i].xo, Butt[i].yo, Butt[i].text, Butt[i].fcol, Butt[i].col);
+        LCD_SetContext(&c);
+    }
+    // restored by a timer, input keeps flowing meanwhile
+    LOOP_CancelTimer(Butt[i].release);
+    if ((Butt[i].release = LOOP_AddTimer(BUTTON_RELEASE_MS, 0, buttonRelease, (void*)(long)i)) == -1) {
+        // no LOOP_Init or MAX_TIMERS pending: the next UI_Paint, TP_Sample
+        // or getDisplayPoint after the deadline restores it
+        Butt[i].release = 0;
+        if (!Butt[i].due) PressLate++;
+        Butt[i].due = loopNow() + BUTTON_RELEASE_MS;
+    } else if (Butt[i].due) {
+        Butt[i].due = 0;
+        PressLate--;
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : buttonLate
+* Description    : Sub for UI_Paint, TP_Sample and getDisplayPoint, release
+*                  the pressed buttons that had no timer once their time is up
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : Returns at once while no such button is pressed
+*******************************************************************************/
+static void buttonLate(void)
+{
+    long long now;
+    int i;
+
+    if (PressLate == 0) return;
+    now = loopNow();
+    for (i = 0; i < ButtCount; i++)
+    {
+        if (Butt[i].due && Butt[i].due <= now) buttonRelease((void*)(long)i);
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : buttonRelease
+* Description    : Sub for getDisplayPoint, draw a pressed button back in
+*                  its normal colors, widgets at the next UI_Paint
+* Input          : - arg: number of button
+* Output         : None
+* Return         : None
+* Attention      : Runs from the LOOP_AddTimer timer or buttonLate
+*******************************************************************************/
+static void buttonRelease(void *arg)
+{
+    Button *b = &Butt[(long)arg];
+    DrawContext c;
+
+    b->release = 0;
+    if (b->due) {
+        b->due = 0;
+        PressLate--;
+    }
+    if (b->widget) {
+        uiPressed(b->widget - 1, 0);
+    } else {
+        LCD_GetContext(&c);
+        LCD_SetOrigin(0, 0);
+        LCD_ResetClip();
+        LCD_DrawBox(b->x0, b->y0, b->x1, b->y1, b->col, b->fcol);
+        LCD_Text(b->xo, b->yo, b->text, b->col, b->fcol);
+        LCD_SetContext(&c);
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_Init
+* Description    : Start a new widget scene, widget 0 is the whole screen
+* Input          : - bg: screen background color
+* Output         : None
+* Return         : 0 ok, -1 out of memory
+* Attention      : Widgets and buttons of a previous scene are removed, the
+*                  whole screen is painted by the next UI_Paint
+*******************************************************************************/
+int UI_Init(unsigned short bg)
+{
+    int i;
+
+    for (i = 0; i < ButtCount; i++)
+    {
+        if (Butt[i].widget) LCD_ButtonRemove(i);
+    }
+    for (i = 0; i < WidgetCount; i++)
+    {
+        LOOP_CancelTimer(Widgets[i].timer);
+        free(Widgets[i].text);
+        free(Widgets[i].lines);
+    }
+    free(Widgets);
+    Widgets = 0;
+    WidgetCount = 0;
+    DamageCount = 0;
+
+    if ((Widgets = (Widget*)calloc(1, sizeof(Widget))) == NULL) return -1;
+    WidgetCount = 1;
+    Widgets[0].type = UI_PANEL;
+    Widgets[0].x1 = BackBuffer.width - 1;
+    Widgets[0].y1 = BackBuffer.height - 1;
+    Widgets[0].fill = bg;
+    Widgets[0].visible = 1;
+    Widgets[0].button = -1;
+    Widgets[0].parent = Widgets[0].child = Widgets[0].last = Widgets[0].next = -1;
+    uiDamage(0);
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_Add
+* Description    : Add a widget on top of the other children of parent
+* Input          : - parent: widget, 0 for the screen
+*                  - type: UI_PANEL, UI_BUTTON, UI_LABEL, UI_IMAGE,
+*                          UI_PROGRESS or UI_LIST
+*                  - x0, y0: upper left corner on screen
+*                  - x1, y1: lower right corner (inclusive)
+* Output         : None
+* Return         : widget, -1 error
+* Attention      : White on the parent background, children are clipped to
+*                  the parent bounds
+*******************************************************************************/
+int UI_Add(int parent, int type, int x0, int y0, int x1, int y1)
+{
+    Widget *w;
+    int id;
+
+    if (parent < 0 || parent >= WidgetCount || Widgets[parent].type == 0) return -1;
+
+    for (id = 1; id < WidgetCount; id++)
+    {
+        if (Widgets[id].type == 0) break;
+    }
+    if (id == WidgetCount)
+    {
+        if ((w = (Widget*)realloc(Widgets, (WidgetCount + 1) * sizeof(Widget))) == NULL) return -1;
+        Widgets = w;
+        WidgetCount++;
+    }
+
+    w = &Widgets[id];
+    memset(w, 0, sizeof(Widget));
+    w->type = type;
+    w->x0 = x0;
+    w->y0 = y0;
+    w->x1 = x1;
+    w->y1 = y1;
+    w->col = White;
+    w->fill = -1;
+    w->max = 100;
+    w->value = type == UI_LIST ? -1 : 0;
+    w->visible = 1;
+    w->button = -1;
+    w->child = w->last = w->next = -1;
+    w->parent = parent;
+    if (Widgets[parent].last == -1)
+        Widgets[parent].child = id;
+    else
+        Widgets[Widgets[parent].last].next = id;
+    Widgets[parent].last = id;
+    uiDamage(id);
+    return id;
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_Remove
+* Description    : Remove a widget and its children
+* Input          : - id: widget
+* Output         : None
+* Return         : None
+* Attention      : Their area is painted again by the next UI_Paint
+*******************************************************************************/
+void UI_Remove(int id)
+{
+    Widget *p;
+    int c;
+
+    if (id <= 0 || id >= WidgetCount || Widgets[id].type == 0) return;
+
+    while (Widgets[id].child != -1)
+        UI_Remove(Widgets[id].child);
+
+    uiDamage(id);
+    UI_SetButton(id, -1);
+    p = &Widgets[Widgets[id].parent];
+    if (p->child == id)
+    {
+        p->child = Widgets[id].next;
+        c = -1;
+    } else {
+        for (c = p->child; Widgets[c].next != id; c = Widgets[c].next);
+        Widgets[c].next = Widgets[id].next;
+    }
+    if (p->last == id) p->last = c;
+    LOOP_CancelTimer(Widgets[id].timer);
+    free(Widgets[id].text);
+    free(Widgets[id].lines);
+    memset(&Widgets[id], 0, sizeof(Widget));
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_SetText
+* Description    : Set the text of a button or label, the file of an image
+*                  or the items of a list, one per line
+* Input          : - id: widget
+*                  - text: the text, copied
+* Output         : None
+* Return         : None
+* Attention      : The same text does not repaint
+*******************************************************************************/
+void UI_SetText(int id, const char *text)
+{
+    char *t;
+    int *lines = 0, n = 0;
+
+    if (id < 0 || id >= WidgetCount || Widgets[id].type == 0) return;
+    if (Widgets[id].text && strcmp(Widgets[id].text, text) == 0) return;
+
+    if (Widgets[id].type == UI_LIST && (n = uiListIndex(text, &lines)) == -1) return;
+    if ((t = strdup(text)) == NULL)
+    {
+        free(lines);
+        return;
+    }
+    free(Widgets[id].text);
+    Widgets[id].text = t;
+    free(Widgets[id].lines);
+    Widgets[id].lines = lines;
+    Widgets[id].items = n;
+    uiDamage(id);
+    // fewer items may end above the bottom
+    if (Widgets[id].type == UI_LIST) uiScroll(id, 0);
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_SetValue
+* Description    : Set the value of a progress bar or the selected list item
+* Input          : - id: widget
+*                  - value: 0..100 for progress bars, item or -1 for lists
+* Output         : None
+* Return         : None
+* Attention      : Progress values are limited to 0..100
+*******************************************************************************/
+void UI_SetValue(int id, int value)
+{
+    if (id < 0 || id >= WidgetCount || Widgets[id].type == 0) return;
+
+    if (Widgets[id].type == UI_PROGRESS)
+    {
+        if (value < 0) value = 0;
+        if (value > Widgets[id].max) value = Widgets[id].max;
+    }
+    if (Widgets[id].value == value) return;
+    Widgets[id].value = value;
+    uiDamage(id);
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_GetValue
+* Description    : Value of a progress bar or the selected list item
+* Input          : - id: widget
+* Output         : None
+* Return         : the value, 0 for an unknown widget
+* Attention      : None
+*******************************************************************************/
+int UI_GetValue(int id)
+{
+    if (id < 0 || id >= WidgetCount || Widgets[id].type == 0) return 0;
+    return Widgets[id].value;
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_SetColors
+* Description    : Set the colors of a widget
+* Input          : - id: widget
+*                  - col: text, frame and bar color
+*                  - fill: background color, -1 shows the parent
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+void UI_SetColors(int id, unsigned short col, int fill)
+{
+    if (id < 0 || id >= WidgetCount || Widgets[id].type == 0) return;
+    if (Widgets[id].col == col && Widgets[id].fill == fill) return;
+
+    Widgets[id].col = col;
+    Widgets[id].fill = fill;
+    uiDamage(id);
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_SetVisible
+* Description    : Show or hide a widget and its children
+* Input          : - id: widget
+*                  - on: 1 shows, 0 hides
+* Output         : None
+* Return         : None
+* Attention      : Hidden buttons do not react to touches
+*******************************************************************************/
+void UI_SetVisible(int id, int on)
+{
+    if (id < 0 || id >= WidgetCount || Widgets[id].type == 0) return;
+    if (Widgets[id].visible == (on != 0)) return;
+
+    Widgets[id].visible = on != 0;
+    uiDamage(id);
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_SetBounds
+* Description    : Move or resize a widget
+* Input          : - id: widget
+*                  - x0, y0: upper left corner on screen
+*                  - x1, y1: lower right corner (inclusive)
+* Output         : None
+* Return         : None
+* Attention      : Children keep their place
+*******************************************************************************/
+void UI_SetBounds(int id, int x0, int y0, int x1, int y1)
+{
+    Widget *w;
+
+    if (id < 0 || id >= WidgetCount || Widgets[id].type == 0) return;
+
+    w = &Widgets[id];
+    uiDamage(id);
+    w->x0 = x0;
+    w->y0 = y0;
+    w->x1 = x1;
+    w->y1 = y1;
+    uiDamage(id);
+    if (w->button != -1) UI_SetButton(id, w->button);
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_SetButton
+* Description    : Report touches on a widget through TP_Button
+* Input          : - id: widget
+*                  - buttn: number of button, -1 for none
+* Output         : None
+* Return         : None
+* Attention      : Shares the numbers of LCD_Button, UI_BUTTON widgets are
+*                  painted pressed until the release animation ends
+*******************************************************************************/
+void UI_SetButton(int id, int buttn)
+{
+    Widget *w;
+
+    if (id < 0 || id >= WidgetCount || Widgets[id].type == 0) return;
+
+    w = &Widgets[id];
+    if (w->button != -1 && w->button < ButtCount && Butt[w->button].widget == id + 1)
+        LCD_ButtonRemove(w->button);
+    w->button = -1;
+    if (w->pressed)
+    {
+        w->pressed = 0;
+        uiDamage(id);
+    }
+    if (buttn < 0 || buttn > 0xFFFF) return;
+
+    // registers the hit area, the widget draws itself
+    LCD_ButtonRemove(buttn);
+    if (buttonSlot(buttn) == NULL) return;
+    Butt[buttn].exist = 1;
+    Butt[buttn].x0 = w->x0;
+    Butt[buttn].y0 = w->y0;
+    Butt[buttn].x1 = w->x1;
+    Butt[buttn].y1 = w->y1;
+    Butt[buttn].widget = id + 1;
+    w->button = buttn;
+    GridDirty = 1;
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_Damage
+* Description    : Paint an area of the scene again with the next UI_Paint
+* Input          : - x0, y0: upper left corner
+*                  - x1, y1: lower right corner (inclusive)
+* Output         : None
+* Return         : None
+* Attention      : For areas drawn over without the widgets
+*******************************************************************************/
+void UI_Damage(int x0, int y0, int x1, int y1)
+{
+    Rect r;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= BackBuffer.width) x1 = BackBuffer.width - 1;
+    if (y1 >= BackBuffer.height) y1 = BackBuffer.height - 1;
+    if (x0 > x1 || y0 > y1 || WidgetCount == 0) return;
+
+    r.x0 = x0;
+    r.y0 = y0;
+    r.x1 = x1;
+    r.y1 = y1;
+    rectListAdd(Damage, &DamageCount, r);
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_Paint
+* Description    : Redraw the damaged areas of the scene
+* Input          : None
+* Output         : None
+* Return         : number of pixels painted
+* Attention      : Every widget over a damaged area is drawn in tree order,
+*                  clipped to the area and to its parent; LCD_Flush shows it.
+*                  The caller's clip and origin are kept
+*******************************************************************************/
+long UI_Paint(void)
+{
+    long pixels = 0;
+    int n;
+    DrawContext c;
+
+    buttonLate();
+    LCD_GetContext(&c);
+    LCD_SetOrigin(0, 0);
+    for (n = 0; n < DamageCount; n++)
+    {
+        uiPaint(0, &Damage[n]);
+        pixels += rectArea(&Damage[n]);
+    }
+    DamageCount = 0;
+    LCD_SetContext(&c);
+    return pixels;
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_Scroll
+* Description    : Scroll a list by some pixels
+* Input          : - id: list widget
+*                  - dy: pixels, positive shows the items further down
+* Output         : None
+* Return         : pixels scrolled, less at the ends of the list
+* Attention      : Stops a UI_Fling. The rows still shown are moved in the
+*                  back buffer, the next UI_Paint draws only the rows
+*                  scrolled in
+*******************************************************************************/
+int UI_Scroll(int id, int dy)
+{
+    if (id < 0 || id >= WidgetCount || Widgets[id].type != UI_LIST) return 0;
+
+    UI_Fling(id, 0);
+    return uiScroll(id, dy);
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_Fling
+* Description    : Keep a list scrolling after the finger left, slower
+*                  by UI_FLING_DECEL until it stops
+* Input          : - id: list widget
+*                  - velocity: pixels per second, positive shows the items
+*                    further down, 0 stops
+* Output         : None
+* Return         : None
+* Attention      : Steps every UI_FLING_MS from a LOOP_AddTimer timer, it
+*                  stops at the ends of the list
+*******************************************************************************/
+void UI_Fling(int id, int velocity)
+{
+    Widget *w;
+
+    if (id < 0 || id >= WidgetCount || Widgets[id].type != UI_LIST) return;
+
+    w = &Widgets[id];
+    LOOP_CancelTimer(w->timer);
+    w->timer = 0;
+    w->velocity = velocity;
+    w->carry = 0;
+    if (velocity == 0) return;
+
+    w->tick = loopNow();
+    if ((w->timer = LOOP_AddTimer(UI_FLING_MS, UI_FLING_MS, uiFling, (void*)(long)id)) == -1)
+    {
+        w->timer = 0;
+        w->velocity = 0;
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : UI_ListItem
+* Description    : Item of a list at a point on screen
+* Input          : - id: list widget
+*                  - x, y: the point
+* Output         : None
+* Return         : item, -1 outside the list or below the last item
+* Attention      : None
+*******************************************************************************/
+int UI_ListItem(int id, int x, int y)
+{
+    Widget *w;
+    int n;
+
+    if (id < 0 || id >= WidgetCount || Widgets[id].type != UI_LIST) return -1;
+
+    w = &Widgets[id];
+    if (x < w->x0 || x > w->x1 || y < w->y0 || y > w->y1) return -1;
+    n = (y - w->y0 + w->scroll) / UI_LIST_ROW;
+    return n < w->items ? n : -1;
+}
+
+
+/*******************************************************************************
+* Function Name  : uiDamage
+* Description    : Sub for the UI, repaint the bounds of a widget
+* Input          : - id: widget
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void uiDamage(int id)
+{
+    UI_Damage(Widgets[id].x0, Widgets[id].y0, Widgets[id].x1, Widgets[id].y1);
+}
+
+
+/*******************************************************************************
+* Function Name  : uiPressed
+* Description    : Sub for buttonPress and buttonRelease
+* Input          : - id: widget
+*                  - on: pressed state
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void uiPressed(int id, int on)
+{
+    if (Widgets[id].pressed == on) return;
+
+    Widgets[id].pressed = on;
+    if (Widgets[id].type == UI_BUTTON) uiDamage(id);
+}
+
+
+/*******************************************************************************
+* Function Name  : uiShown
+* Description    : Sub for getDisplayPoint
+* Input          : - id: widget
+* Output         : None
+* Return         : 1 if the widget and all its parents are visible
+* Attention      : None
+*******************************************************************************/
+static int uiShown(int id)
+{
+    for (; id != -1; id = Widgets[id].parent)
+    {
+        if (!Widgets[id].visible) return 0;
+    }
+    return 1;
+}
+
+
+/*******************************************************************************
+* Function Name  : uiScroll
+* Description    : Sub for UI_Scroll and uiFling, move the list content
+* Input          : - id: list widget
+*                  - dy: pixels, positive shows the items further down
+* Output         : None
+* Return         : pixels scrolled
+* Attention      : The shown part of the list is moved in the back buffer
+*                  and only the rows scrolled in are damaged. The whole list
+*                  is painted again while a display list is recorded, or
+*                  when other widgets cover it
+*******************************************************************************/
+static int uiScroll(int id, int dy)
+{
+    Widget *w = &Widgets[id];
+    DrawContext c;
+    Rect r, s, old[MAX_DIRTY];
+    int max, n, count, y, p;
+
+    max = w->items * UI_LIST_ROW - (w->y1 - w->y0 + 1);
+    if (max < 0) max = 0;
+    if (w->scroll + dy > max) dy = max - w->scroll;
+    if (w->scroll + dy < 0) dy = -w->scroll;
+    if (dy == 0) return 0;
+    w->scroll += dy;
+
+    // the part shown: inside the screen and every parent
+    r.x0 = w->x0 > 0 ? w->x0 : 0;
+    r.y0 = w->y0 > 0 ? w->y0 : 0;
+    r.x1 = w->x1 < BackBuffer.width - 1 ? w->x1 : BackBuffer.width - 1;
+    r.y1 = w->y1 < BackBuffer.height - 1 ? w->y1 : BackBuffer.height - 1;
+    for (p = w->parent; p != -1; p = Widgets[p].parent)
+    {
+        if (r.x0 < Widgets[p].x0) r.x0 = Widgets[p].x0;
+        if (r.y0 < Widgets[p].y0) r.y0 = Widgets[p].y0;
+        if (r.x1 > Widgets[p].x1) r.x1 = Widgets[p].x1;
+        if (r.y1 > Widgets[p].y1) r.y1 = Widgets[p].y1;
+    }
+    if (r.x0 > r.x1 || r.y0 > r.y1 || !uiShown(id)) return dy;
+    if (Rec || abs(dy) > r.y1 - r.y0 || uiCovered(id, &r))
+    {
+        uiDamage(id);
+        return dy;
+    }
+
+    // pixels not painted yet move with the content; adding merges areas
+    count = DamageCount;
+    memcpy(old, Damage, count * sizeof(Rect));
+    for (n = 0; n < count; n++)
+    {
+        s.x0 = old[n].x0 > r.x0 ? old[n].x0 : r.x0;
+        s.y0 = (old[n].y0 > r.y0 ? old[n].y0 : r.y0) - dy;
+        s.x1 = old[n].x1 < r.x1 ? old[n].x1 : r.x1;
+        s.y1 = (old[n].y1 < r.y1 ? old[n].y1 : r.y1) - dy;
+        if (s.y0 < r.y0) s.y0 = r.y0;
+        if (s.y1 > r.y1) s.y1 = r.y1;
+        if (s.x0 <= s.x1 && s.y0 <= s.y1) UI_Damage(s.x0, s.y0, s.x1, s.y1);
+    }
+
+    // full rows are one block, else row by row in the direction of the move
+    if (r.x0 == 0 && r.x1 == BackBuffer.width - 1 && BackBuffer.stride == BackBuffer.width)
+    {
+        if (dy > 0)
+            memmove(BackBuffer.pixels + r.y0 * BackBuffer.stride, BackBuffer.pixels + (r.y0 + dy) * BackBuffer.stride,
+                    (r.y1 - r.y0 + 1 - dy) * BackBuffer.stride * 2);
+        else
+            memmove(BackBuffer.pixels + (r.y0 - dy) * BackBuffer.stride, BackBuffer.pixels + r.y0 * BackBuffer.stride,
+                    (r.y1 - r.y0 + 1 + dy) * BackBuffer.stride * 2);
+    }
+    else if (dy > 0)
+    {
+        for (y = r.y0; y <= r.y1 - dy; y++)
+            memcpy(BackBuffer.pixels + y * BackBuffer.stride + r.x0,
+                   BackBuffer.pixels + (y + dy) * BackBuffer.stride + r.x0, (r.x1 - r.x0 + 1) * 2);
+    }
+    else
+    {
+        for (y = r.y1; y >= r.y0 - dy; y--)
+            memcpy(BackBuffer.pixels + y * BackBuffer.stride + r.x0,
+                   BackBuffer.pixels + (y + dy) * BackBuffer.stride + r.x0, (r.x1 - r.x0 + 1) * 2);
+    }
+
+    LCD_GetContext(&c);
+    LCD_ResetClip();
+    markDirty(r.x0, r.y0, r.x1, r.y1);
+    LCD_SetContext(&c);
+    if (dy > 0)
+        UI_Damage(r.x0, r.y1 - dy + 1, r.x1, r.y1);
+    else
+        UI_Damage(r.x0, r.y0, r.x1, r.y0 - dy - 1);
+    return dy;
+}
+
+
+/*******************************************************************************
+* Function Name  : uiFling
+* Description    : Sub for UI_Fling, one step of a flung list
+* Input          : - arg: list widget
+* Output         : None
+* Return         : None
+* Attention      : Runs from the LOOP_AddTimer timer, the distance is from
+*                  the time since the last step
+*******************************************************************************/
+static void uiFling(void *arg)
+{
+    Widget *w = &Widgets[(long)arg];
+    long long now = loopNow();
+    int dt, dv, step;
+
+    dt = now - w->tick;
+    w->tick = now;
+    // pixels * 1000 left over from the steps before
+    w->carry += w->velocity * dt;
+    step = w->carry / 1000;
+    w->carry -= step * 1000;
+
+    dv = UI_FLING_DECEL * dt / 1000;
+    if (abs(w->velocity) <= dv)
+        w->velocity = 0;
+    else
+        w->velocity -= w->velocity > 0 ? dv : -dv;
+
+    if ((step != 0 && uiScroll((long)arg, step) != step) || w->velocity == 0)
+        UI_Fling((long)arg, 0);
+}
+
+
+/*******************************************************************************
+* Function Name  : uiListIndex
+* Description    : Sub for UI_SetText, find the items of a list
+* Input          : - text: items, one per line
+* Output         : - lines: offset of every item in text, 0 for none
+* Return         : number of items, -1 out of memory
+* Attention      : Scrolling and painting start at an item without walking
+*                  the text before it
+*******************************************************************************/
+static int uiListIndex(const char *text, int **lines)
+{
+    const char *t;
+    int n = 0;
+
+    *lines = 0;
+    for (t = text; *t; n++)
+    {
+        if ((t = strchr(t, '\n')) == NULL) {
+            n++;
+            break;
+        }
+        t++;
+    }
+    if (n == 0) return 0;
+    if ((*lines = (int*)malloc(n * sizeof(int))) == NULL) return -1;
+
+    for (t = text, n = 0; *t; n++)
+    {
+        (*lines)[n] = t - text;
+        if ((t = strchr(t, '\n')) == NULL) return n + 1;
+        t++;
+    }
+    return n;
+}
+
+
+/*******************************************************************************
+* Function Name  : uiCovered
+* Description    : Sub for uiScroll
+* Input          : - id: widget
+*                  - r: part of it
+* Output         : None
+* Return         : 1 if a child or a widget painted later overlaps r
+* Attention      : None
+*******************************************************************************/
+static int uiCovered(int id, const Rect *r)
+{
+    Widget *o;
+    int c, s;
+
+    if (Widgets[id].child != -1) return 1;
+    for (c = id; c != -1; c = Widgets[c].parent)
+    {
+        for (s = Widgets[c].next; s != -1; s = Widgets[s].next)
+        {
+            o = &Widgets[s];
+            if (o->visible && o->x0 <= r->x1 && o->x1 >= r->x0 && o->y0 <= r->y1 && o->y1 >= r->y0) return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : uiPaint
+* Description    : Sub for UI_Paint, draw a widget and its children
+* Input          : - id: widget
+*                  - area: damaged area left by the parent
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void uiPaint(int id, const Rect *area)
+{
+    Widget *w = &Widgets[id];
+    Rect r;
+    int c;
+
+    if (!w->visible) return;
+
+    r.x0 = w->x0 > area->x0 ? w->x0 : area->x0;
+    r.y0 = w->y0 > area->y0 ? w->y0 : area->y0;
+    r.x1 = w->x1 < area->x1 ? w->x1 : area->x1;
+    r.y1 = w->y1 < area->y1 ? w->y1 : area->y1;
+    if (r.x0 > r.x1 || r.y0 > r.y1) return;
+
+    LCD_SetClip(r.x0, r.y0, r.x1, r.y1);
+    uiDraw(id);
+    for (c = w->child; c != -1; c = Widgets[c].next)
+        uiPaint(c, &r);
+}
+
+
+/*******************************************************************************
+* Function Name  : uiDraw
+* Description    : Sub for uiPaint, draw one widget
+* Input          : - id: widget
+* Output         : None
+* Return         : None
+* Attention      : The clip area is already set
+*******************************************************************************/
+static void uiDraw(int id)
+{
+    Widget *w = &Widgets[id];
+    unsigned short fg, bg;
+    char line[64];
+    const char *t, *e;
+    int p, x, y, n;
+
+    // background: own fill or the first parent that has one
+    for (p = id; Widgets[p].fill == -1 && Widgets[p].parent != -1; p = Widgets[p].parent);
+    bg = Widgets[p].fill == -1 ? Black : Widgets[p].fill;
+    fg = w->col;
+
+    switch (w->type) {
+    case UI_PANEL:
+        if (w->fill != -1) LCD_FillRect(w->x0, w->y0, w->x1, w->y1, bg);
+        break;
+    case UI_BUTTON:
+        if (w->pressed)
+        {
+            fg = bg;
+            bg = w->col;
+        }
+        LCD_DrawBox(w->x0, w->y0, w->x1, w->y1, fg, bg);
+        if (w->text)
+        {
+            x = w->x0 + (w->x1 - w->x0 + 1 - 8 * (int)strlen(w->text)) / 2;
+            y = w->y0 + (w->y1 - w->y0 + 1 - 16) / 2;
+            LCD_Text(x > w->x0 ? x : w->x0 + 1, y > w->y0 ? y : w->y0 + 1, w->text, fg, bg);
+        }
+        break;
+    case UI_LABEL:
+        LCD_FillRect(w->x0, w->y0, w->x1, w->y1, bg);
+        y = w->y0 + (w->y1 - w->y0 + 1 - 16) / 2;
+        if (w->text) LCD_Text(w->x0, y > w->y0 ? y : w->y0, w->text, fg, bg);
+        break;
+    case UI_IMAGE:
+        if (w->fill != -1) LCD_FillRect(w->x0, w->y0, w->x1, w->y1, bg);
+        if (w->text) LCD_PutImage(w->x0, w->y0, w->text);
+        break;
+    case UI_PROGRESS:
+        LCD_DrawBox(w->x0, w->y0, w->x1, w->y1, fg, bg);
+        x = w->x0 + (w->x1 - w->x0 - 1) * w->value / (w->max > 0 ? w->max : 1);
+        if (x > w->x0) LCD_FillRect(w->x0 + 1, w->y0 + 1, x, w->y1 - 1, fg);
+        break;
+    case UI_LIST:
+        LCD_FillRect(w->x0, w->y0, w->x1, w->y1, bg);
+        // only the rows inside the clip area, e.g. the strip scrolled in
+        n = w->scroll / UI_LIST_ROW;
+        y = w->y0 - w->scroll % UI_LIST_ROW;
+        if (Ctx.clip.y0 > y) {
+            n += (Ctx.clip.y0 - y) / UI_LIST_ROW;
+            y += (Ctx.clip.y0 - y) / UI_LIST_ROW * UI_LIST_ROW;
+        }
+        for (; n < w->items && y <= Ctx.clip.y1; n++, y += UI_LIST_ROW)
+        {
+            t = w->text + w->lines[n];
+            if ((e = strchr(t, '\n')) == NULL) e = t + strlen(t);
+            p = e - t < (int)sizeof(line) - 1 ? e - t : (int)sizeof(line) - 1;
+            memcpy(line, t, p);
+            line[p] = 0;
+            if (n == w->value)
+            {
+                LCD_FillRect(w->x0, y, w->x1, y + UI_LIST_ROW - 1, fg);
+                LCD_Text(w->x0 + 2, y + (UI_LIST_ROW - 16) / 2, line, bg, fg);
+            } else {
+                LCD_Text(w->x0 + 2, y + (UI_LIST_ROW - 16) / 2, line, fg, bg);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : surfaceAlloc
+* Description    : Allocate an RGB565 surface
+* Input          : - width, height: size in pixels
+* Output         : - s: the surface
+* Return         : 0 ok, -1 out of memory
+* Attention      : Rows start on 32 byte boundaries for the SIMD copies
+*******************************************************************************/
+static int surfaceAlloc(Surface *s, int width, int height)
+{
+    void *p;
+
+    s->width = width;
+    s->height = height;
+    s->stride = (width + 15) & ~15;
+    s->alpha = 0;
+    if (posix_memalign(&p, 32, (size_t)s->stride * height * sizeof(unsigned short) + 32))
+    {
+        s->pixels = 0;
+        return -1;
+    }
+    s->pixels = (unsigned short*)p;
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : surfaceAlphaAlloc
+* Description    : Give a surface a per-pixel alpha plane
+* Input          : - s: surface from surfaceAlloc
+* Output         : - s: alpha, all opaque
+* Return         : 0 ok, -1 out of memory
+* Attention      : None
+*******************************************************************************/
+static int surfaceAlphaAlloc(Surface *s)
+{
+    if ((s->alpha = (unsigned char*)malloc((size_t)s->stride * s->height + 16)) == NULL) return -1;
+    memset(s->alpha, 255, (size_t)s->stride * s->height);
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : surfaceFree
+* Description    : Release the memory of a surface from surfaceAlloc
+* Input          : - s: the surface
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void surfaceFree(Surface *s)
+{
+    free(s->pixels);
+    free(s->alpha);
+    s->pixels = 0;
+    s->alpha = 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : surfaceBytes
+* Description    : Memory used by a surface
+* Input          : - s: the surface
+* Output         : None
+* Return         : bytes
+* Attention      : None
+*******************************************************************************/
+static long surfaceBytes(const Surface *s)
+{
+    return (long)s->stride * s->height * (s->alpha ? 3 : 2);
+}
+
+
+/*******************************************************************************
+* Function Name  : keyRow
+* Description    : Sub for blitSurface, copy pixels except the key color
+* Input          : - src: pixels
+*                  - n: number of pixels
+*                  - key: transparent color
+* Output         : - dst: pixels
+* Return         : None
+* Attention      : 8 pixels per compare and select with NEON or SSE2
+*******************************************************************************/
+static void keyRow(unsigned short *dst, const unsigned short *src, int n, unsigned short key)
+{
+    int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint16x8_t k = vdupq_n_u16(key), s, m;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        s = vld1q_u16(src + i);
+        m = vceqq_u16(s, k);
+        vst1q_u16(dst + i, vbslq_u16(m, vld1q_u16(dst + i), s));
+    }
+#elif defined(__SSE2__)
+    __m128i k = _mm_set1_epi16((short)key), s, m;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        s = _mm_loadu_si128((const __m128i*)(src + i));
+        m = _mm_cmpeq_epi16(s, k);
+        s = _mm_or_si128(_mm_and_si128(m, _mm_loadu_si128((const __m128i*)(dst + i))), _mm_andnot_si128(m, s));
+        _mm_storeu_si128((__m128i*)(dst + i), s);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (src[i] != key) dst[i] = src[i];
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : blendRow
+* Description    : Sub for blitSurface, blend pixels over the screen
+* Input          : - src: pixels
+*                  - alpha: coverage of every pixel, 0 for none
+*                  - n: number of pixels
+*                  - a: coverage of the whole row, 0..255
+*                  - key: transparent color, -1 for none
+* Output         : - dst: pixels
+* Return         : None
+* Attention      : The weights are cut to 5 bits like blend565. NEON and
+*                  SSE2 blend 8 pixels per step with the channels in 16 bit
+*                  lanes, the scalar rest uses the 0x07E0F81F split
+*******************************************************************************/
+static void blendRow(unsigned short *dst, const unsigned short *src, const unsigned char *alpha, int n, int a, int key)
+{
+    int i = 0, w;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint16x8_t s, d, wt, m5 = vdupq_n_u16(31), m6 = vdupq_n_u16(63);
+    int16x8_t ws, sc, dc, r, g, b;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        s = vld1q_u16(src + i);
+        d = vld1q_u16(dst + i);
+        if (alpha)
+            wt = vshrq_n_u16(vmulq_u16(vmovl_u8(vld1_u8(alpha + i)), vdupq_n_u16(a + 1)), 8);
+        else
+            wt = vdupq_n_u16(a);
+        wt = vshrq_n_u16(vaddq_u16(wt, vdupq_n_u16(4)), 3);
+        if (key >= 0) wt = vbicq_u16(wt, vceqq_u16(s, vdupq_n_u16(key)));
+        ws = vreinterpretq_s16_u16(wt);
+
+        sc = vreinterpretq_s16_u16(vshrq_n_u16(s, 11));
+        dc = vreinterpretq_s16_u16(vshrq_n_u16(d, 11));
+        r = vaddq_s16(dc, vshrq_n_s16(vmulq_s16(vsubq_s16(sc, dc), ws), 5));
+        sc = vreinterpretq_s16_u16(vandq_u16(vshrq_n_u16(s, 5), m6));
+        dc = vreinterpretq_s16_u16(vandq_u16(vshrq_n_u16(d, 5), m6));
+        g = vaddq_s16(dc, vshrq_n_s16(vmulq_s16(vsubq_s16(sc, dc), ws), 5));
+        sc = vreinterpretq_s16_u16(vandq_u16(s, m5));
+        dc = vreinterpretq_s16_u16(vandq_u16(d, m5));
+        b = vaddq_s16(dc, vshrq_n_s16(vmulq_s16(vsubq_s16(sc, dc), ws), 5));
+        d = vorrq_u16(vshlq_n_u16(vreinterpretq_u16_s16(r), 11),
+                      vorrq_u16(vshlq_n_u16(vreinterpretq_u16_s16(g), 5), vreinterpretq_u16_s16(b)));
+        vst1q_u16(dst + i, d);
+    }
+#elif defined(__SSE2__)
+    __m128i s, d, wt, sc, dc, r, g, b, zero = _mm_setzero_si128();
+    __m128i m5 = _mm_set1_epi16(31), m6 = _mm_set1_epi16(63);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        s = _mm_loadu_si128((const __m128i*)(src + i));
+        d = _mm_loadu_si128((const __m128i*)(dst + i));
+        if (alpha)
+            wt = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(alpha + i)), zero),
+                                                _mm_set1_epi16(a + 1)), 8);
+        else
+            wt = _mm_set1_epi16(a);
+        wt = _mm_srli_epi16(_mm_add_epi16(wt, _mm_set1_epi16(4)), 3);
+        if (key >= 0) wt = _mm_andnot_si128(_mm_cmpeq_epi16(s, _mm_set1_epi16((short)key)), wt);
+
+        sc = _mm_srli_epi16(s, 11);
+        dc = _mm_srli_epi16(d, 11);
+        r = _mm_add_epi16(dc, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(sc, dc), wt), 5));
+        sc = _mm_and_si128(_mm_srli_epi16(s, 5), m6);
+        dc = _mm_and_si128(_mm_srli_epi16(d, 5), m6);
+        g = _mm_add_epi16(dc, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(sc, dc), wt), 5));
+        sc = _mm_and_si128(s, m5);
+        dc = _mm_and_si128(d, m5);
+        b = _mm_add_epi16(dc, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(sc, dc), wt), 5));
+        d = _mm_or_si128(_mm_slli_epi16(r, 11), _mm_or_si128(_mm_slli_epi16(g, 5), b));
+        _mm_storeu_si128((__m128i*)(dst + i), d);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (key >= 0 && src[i] == key) continue;
+        w = alpha ? (alpha[i] * (a + 1)) >> 8 : a;
+        w = (w + 4) >> 3;
+        if (w > 0) dst[i] = w >= 32 ? src[i] : blend565(dst[i], src[i], w);
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : blitSurface
+* Description    : Sub for the blits, put a surface on the screen
+* Input          : - x: upper left corner
+*                  - y: upper left corner
+*                  - s: the surface
+*                  - key: transparent color, -1 for none
+*                  - a: coverage of the whole surface, 0..255
+* Output         : None
+* Return         : None
+* Attention      : Clipped once to the clip area, then row by row: copied,
+*                  keyed, or blended when the surface has alpha or a < 255
+*******************************************************************************/
+static void blitSurface(int x, int y, const Surface *s, int key, int a)
+{
+    int r0, r1, c0, c1, r;
+    unsigned short *dst;
+    const unsigned short *src;
+    const unsigned char *al;
+    DrawCmd *c;
+
+    if (a <= 0) return;
+    if (a > 255) a = 255;
+    if (Rec && (c = cmdAdd(CMD_BLIT, x, y, x + s->width - 1, y + s->height - 1)) != NULL)
+    {
+        c->a[0] = x;
+        c->a[1] = y;
+        c->a[2] = key;
+        c->a[3] = a;
+        c->surf = s;
+        return;
+    }
+    x += Ctx.ox;
+    y += Ctx.oy;
+    r0 = y < Ctx.clip.y0 ? Ctx.clip.y0 - y : 0;
+    r1 = y + s->height > Ctx.clip.y1 + 1 ? Ctx.clip.y1 + 1 - y : s->height;
+    c0 = x < Ctx.clip.x0 ? Ctx.clip.x0 - x : 0;
+    c1 = x + s->width > Ctx.clip.x1 + 1 ? Ctx.clip.x1 + 1 - x : s->width;
+    if (r0 >= r1 || c0 >= c1) return;
+
+    dst = BackBuffer.pixels + (y + r0) * BackBuffer.stride + x + c0;
+    src = s->pixels + r0 * s->stride + c0;
+    al = s->alpha ? s->alpha + r0 * s->stride + c0 : 0;
+    for (r = r0; r < r1; r++)
+    {
+        if (al || a < 255)
+            blendRow(dst, src, al, c1 - c0, a, key);
+        else if (key >= 0)
+            keyRow(dst, src, c1 - c0, key);
+        else
+            memcpy(dst, src, (c1 - c0) * sizeof(unsigned short));
+        dst += BackBuffer.stride;
+        src += s->stride;
+        if (al) al += s->stride;
+    }
+    markDirty(x + c0, y + r0, x + c1 - 1, y + r1 - 1);
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_Blit
+* Description    : Copy a surface to the screen
+* Input          : - x: upper left corner
+*                  - y: upper left corner
+*                  - s: the surface
+* Output         : None
+* Return         : None
+* Attention      : Clipped once to the clip area, then copied row by row;
+*                  blended when the surface has an alpha plane
+*******************************************************************************/
+void LCD_Blit(int x, int y, Surface *s)
+{
+    blitSurface(x, y, s, -1, 255);
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_BlitAlpha
+* Description    : Blend a surface over the screen
+* Input          : - x: upper left corner
+*                  - y: upper left corner
+*                  - s: the surface
+*                  - alpha: 0 transparent .. 255 opaque
+* Output         : None
+* Return         : None
+* Attention      : Multiplied with the alpha plane of the surface if it has
+*                  one; what is on the screen is not read back per pixel
+*******************************************************************************/
+void LCD_BlitAlpha(int x, int y, Surface *s, int alpha)
+{
+    blitSurface(x, y, s, -1, alpha);
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_BlitKeyed
+* Description    : Copy a surface to the screen, except the transparent color
+* Input          : - x: upper left corner
+*                  - y: upper left corner
+*                  - s: the surface
+*                  - key: transparent color
+* Output         : None
+* Return         : None
+* Attention      : Clipped once to the clip area
+*******************************************************************************/
+void LCD_BlitKeyed(int x, int y, Surface *s, unsigned short key)
+{
+    blitSurface(x, y, s, key, 255);
+}
+
+
+/*******************************************************************************
+* Function Name  : le16, le32
+* Description    : Sub for bmpOpen, little endian header fields
+* Input          : - p: field
+* Output         : None
+* Return         : value
+* Attention      : None
+*******************************************************************************/
+static unsigned int le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+/*******************************************************************************
+* Function Name  : bmpOpen
+* Description    : Sub for LCD_PutImage, read the BMP headers
+* Input          : - file: filename full qualified path
+* Output         : - b: image description, palette converted to RGB565
+* Return         : 0 ok, -1 error
+* Attention      : Uncompressed 8 (indexed), 24 and 32 bits, as qdbmp; 32
+*                  bits with BGRA bit fields keep their alpha channel
+*******************************************************************************/
+static int bmpOpen(const char *file, BmpStream *b)
+{
+    unsigned char hdr[54], pal[256 * 4], masks[16];
+    int infosize, colors, n;
+    unsigned int compression;
+
+    if ((b->fp = fopen(file, "rb")) == NULL)
+    {
+        printf("Error: cannot open image %s\n", file);
+        return -1;
+    }
+    if (fread(hdr, 1, sizeof(hdr), b->fp) != sizeof(hdr) || hdr[0] != 'B' || hdr[1] != 'M')
+    {
+        printf("Error: %s is not a BMP image\n", file);
+        fclose(b->fp);
+        return -1;
+    }
+
+    b->offset = le32(hdr + 10);
+    infosize = le32(hdr + 14);
+    b->width = (int)le32(hdr + 18);
+    b->height = (int)le32(hdr + 22);
+    b->bpp = le16(hdr + 28);
+    b->bottomup = b->height > 0;
+    if (b->height < 0) b->height = -b->height;
+
+    // BI_BITFIELDS, BI_ALPHABITFIELDS: the masks follow the 40 byte header
+    // or are part of a larger one, the alpha mask only in the second case
+    compression = le32(hdr + 30);
+    b->alpha = 0;
+    if ((compression == 3 || compression == 6) && b->bpp == 32 &&
+        fread(masks, 1, sizeof(masks), b->fp) == sizeof(masks) &&
+        le32(masks) == 0x00FF0000 && le32(masks + 4) == 0x0000FF00 && le32(masks + 8) == 0x000000FF)
+    {
+        b->alpha = (infosize >= 56 || compression == 6) && le32(masks + 12) == 0xFF000000;
+        compression = 0;
+    }
+
+    if (infosize < 40 || le16(hdr + 26) != 1 || compression != 0 ||
+        (b->bpp != 8 && b->bpp != 24 && b->bpp != 32) ||
+        b->width <= 0 || b->width > 32767 || b->height == 0 || b->height > 32767)
+    {
+        printf("Error: %s is not a supported BMP variant\n", file);
+        fclose(b->fp);
+        return -1;
+    }
+    b->rowbytes = ((long)b->width * b->bpp / 8 + 3) & ~3L;
+
+    if (b->bpp == 8)
+    {
+        colors = le32(hdr + 46);
+        if (colors <= 0 || colors > 256) colors = 256;
+        memset(b->palette, 0, sizeof(b->palette));
+        if (fseek(b->fp, 14 + infosize, SEEK_SET) || fread(pal, 4, colors, b->fp) != (size_t)colors)
+        {
+            printf("Error: %s has no palette\n", file);
+            fclose(b->fp);
+            return -1;
+        }
+        for (n = 0; n < colors; n++)
+            b->palette[n] = RGB565CONVERT(pal[n * 4 + 2], pal[n * 4 + 1], pal[n * 4]);
+        memset(b->bgra, 0, sizeof(b->bgra));
+        memcpy(b->bgra, pal, colors * 4);
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : rawPutImage
+* Description    : Sub for LCD_PutImage, show a pre-converted .565 image
+* Input          : - x: upper left corner
+*                  - y: upper left corner
+*                  - file: filename full qualified path
+*                  - alpha: 0 transparent .. 255 opaque
+* Output         : None
+* Return         : 0 ok, 1 not a .565 file, -1 error
+* Attention      : The file is mapped and blitted as it is, see rgb565.h
+*******************************************************************************/
+static int rawPutImage(int x, int y, const char *file, int alpha)
+{
+    int f, r = -1;
+    struct stat st;
+    unsigned char *map, *h;
+    unsigned long long offset, size;
+    Surface s;
+
+    if ((f = open(file, O_RDONLY)) == -1) return 1;
+    if (fstat(f, &st) || st.st_size < RAW565_HEADER_SIZE)
+    {
+        close(f);
+        return 1;
+    }
+    map = (unsigned char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, f, 0);
+    close(f);
+    if (map == MAP_FAILED) return 1;
+
+    h = map;
+    if (memcmp(h, RAW565_MAGIC, 4) != 0)
+    {
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    s.width = le16(h + 8);
+    s.height = le16(h + 10);
+    s.stride = le16(h + 12);
+    s.alpha = 0;
+    // 64 bit sizes, a 32 bit long can overflow or wrap past the end
+    offset = le32(h + 16);
+    size = (unsigned long long)s.stride * s.height * 2;
+    if (le16(h + 4) != RAW565_VERSION || s.stride < s.width || (offset & 1) ||
+        offset < RAW565_HEADER_SIZE || offset > (unsigned long long)st.st_size ||
+        size > (unsigned long long)st.st_size - offset)
+    {
+        printf("Error: %s is not a supported .565 image\n", file);
+    } else {
+        s.pixels = (unsigned short*)(map + offset);
+        blitSurface(x, y, &s, le16(h + 6) & RAW565_HAS_KEY ? (int)le16(h + 14) : -1, alpha);
+        r = 0;
+    }
+    munmap(map, st.st_size);
+    return r;
+}
+
+
+/*******************************************************************************
+* Function Name  : bmpConvertRow
+* Description    : Sub for bmpRead, convert file pixels to RGB565
+* Input          : - b: image
+*                  - src: first pixel in the file row
+*                  - n: pixels
+*                  - x: column of the first pixel, for the dither pattern
+*                  - y: line, for the dither pattern
+* Output         : - dst: RGB565 pixels
+* Return         : None
+* Attention      : Dithered when LCD_SetDither is on
+*******************************************************************************/
+static void bmpConvertRow(const BmpStream *b, unsigned short *dst, const unsigned char *src, int n, int x, int y)
+{
+    unsigned char quad[64 * 4];
+    int i, k, m;
+
+    switch (b->bpp)
+    {
+    case 8:
+        if (!ImageDither)
+        {
+            for (i = 0; i < n; i++)
+                dst[i] = b->palette[src[i]];
+            break;
+        }
+        // expand through the palette and dither as 32 bits
+        for (i = 0; i < n; i += m)
+        {
+            m = n - i < 64 ? n - i : 64;
+            for (k = 0; k < m; k++)
+                memcpy(quad + k * 4, b->bgra + src[i + k] * 4, 4);
+            RGB565_ConvertRow(dst + i, quad, m, 4, x + i, y, 1);
+        }
+        break;
+    case 24:
+    case 32:
+        RGB565_ConvertRow(dst, src, n, b->bpp / 8, x, y, ImageDither);
+        break;
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_SetDither
+* Description    : Choose how images are reduced to 16 bits
+* Input          : - on: 1 for 4x4 ordered dithering, 0 truncates
+* Output         : None
+* Return         : None
+* Attention      : Drops the decoded images so they are converted again
+*******************************************************************************/
+void LCD_SetDither(int on)
+{
+    if (ImageDither == on) return;
+    ImageDither = on;
+    imageCacheTrim(0);
+}
+
+
+/*******************************************************************************
+* Function Name  : bmpRead
+* Description    : Sub for LCD_PutImage, stream the rows into a surface
+* Input          : - b: image from bmpOpen
+*                  - x: upper left corner in dst
+*                  - y: upper left corner in dst
+*                  - clip: area of dst to write, 0 for all of it
+*                  - alpha: 0 transparent .. 255 opaque
+* Output         : - dst: the surface, its alpha plane from a 32 bit alpha
+*                    channel
+* Return         : 0 ok, -1 read error
+* Attention      : Only the rows inside the area are read, one row buffer is
+*                  used; blended into a dst without alpha plane when the
+*                  image has alpha or alpha is below 255
+*******************************************************************************/
+static int bmpRead(BmpStream *b, Surface *dst, int x, int y, const Rect *clip, int alpha)
+{
+    unsigned char *row, *al = 0;
+    unsigned short *line = 0, *d;
+    int r, r0, r1, c0, c1, first, last, fr, i, blend;
+    Rect all;
+
+    if (clip == NULL)
+    {
+        all.x0 = all.y0 = 0;
+        all.x1 = dst->width - 1;
+        all.y1 = dst->height - 1;
+        clip = &all;
+    }
+    r0 = y < clip->y0 ? clip->y0 - y : 0;
+    r1 = y + b->height > clip->y1 + 1 ? clip->y1 + 1 - y : b->height;
+    c0 = x < clip->x0 ? clip->x0 - x : 0;
+    c1 = x + b->width > clip->x1 + 1 ? clip->x1 + 1 - x : b->width;
+    if (r0 >= r1 || c0 >= c1) return 0;
+
+    blend = dst->alpha == NULL && (b->alpha || alpha < 255);
+    row = (unsigned char*)malloc(b->rowbytes + b->width * 3 + 16);
+    if (row == NULL)
+    {
+        printf("Error: cannot allocate image row\n");
+        return -1;
+    }
+    // converted row and its alpha after the file row
+    line = (unsigned short*)(row + ((b->rowbytes + 1) & ~1L));
+    al = (unsigned char*)(line + b->width);
+
+    // rows r0..r1-1 are one run in the file whatever the order
+    first = b->bottomup ? b->height - r1 : r0;
+    last = b->bottomup ? b->height - 1 - r0 : r1 - 1;
+    if (fseek(b->fp, b->offset + first * b->rowbytes, SEEK_SET))
+    {
+        free(row);
+        return -1;
+    }
+    for (fr = first; fr <= last; fr++)
+    {
+        if (fread(row, 1, b->rowbytes, b->fp) != (size_t)b->rowbytes)
+        {
+            printf("Error: image file is truncated\n");
+            free(row);
+            return -1;
+        }
+        r = b->bottomup ? b->height - 1 - fr : fr;
+        d = dst->pixels + (y + r) * dst->stride + x + c0;
+        bmpConvertRow(b, blend ? line : d, row + (long)c0 * b->bpp / 8, c1 - c0, x + c0, y + r);
+        if (b->alpha)
+        {
+            for (i = 0; i < c1 - c0; i++)
+                al[i] = row[(c0 + i) * 4 + 3];
+            if (dst->alpha) memcpy(dst->alpha + (y + r) * dst->stride + x + c0, al, c1 - c0);
+        }
+        if (blend) blendRow(d, line, b->alpha ? al : 0, c1 - c0, alpha, -1);
+    }
+    free(row);
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : imageCacheTrim
+* Description    : Sub for the image cache, drop the least recently used
+*                  images until limit bytes are left
+* Input          : - limit: bytes
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void imageCacheTrim(long limit)
+{
+    ImageEntry **link, *e;
+
+    while (ImageCacheBytes > limit && ImageCache != NULL)
+    {
+        for (link = &ImageCache; (*link)->next != NULL; link = &(*link)->next);
+        e = *link;
+        *link = NULL;
+        ImageCacheBytes -= surfaceBytes(&e->surf);
+        surfaceFree(&e->surf);
+        free(e->path);
+        free(e);
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_ImageCacheInit
+* Description    : Set the memory kept for decoded LCD_PutImage files
+* Input          : - bytes: limit, 0 disables the cache
+* Output         : None
+* Return         : 0
+* Attention      : Images over the limit are dropped, oldest first
+*******************************************************************************/
+int LCD_ImageCacheInit(long bytes)
+{
+    ImageCacheLimit = bytes > 0 ? bytes : 0;
+    imageCacheTrim(ImageCacheLimit);
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_PutImage
+* Description    : Show BMP
+* Input          : x upper left corner image start
+*                  y upper left corner image start
+*                  file filename full qualified path
+* Output         : None
+* Return         : 0 ok, -1 the image cannot be read
+* Attention      : The image must be 8, 24 or 32 bits RGB (sub will convert to 16 bits)
+*                  or a .565 file from bmp2raw, which is blitted without decoding
+*                  It is decoded once and kept while the file is unchanged,
+*                  images over the cache limit are streamed to the screen.
+*                  The alpha channel of 32 bit BMP files is blended
+*******************************************************************************/
+int LCD_PutImage(int x, int y, char* file)
+{
+    return LCD_PutImageAlpha(x, y, file, 255);
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_PutImageAlpha
+* Description    : Show BMP over what is on the screen
+* Input          : x upper left corner image start
+*                  y upper left corner image start
+*                  file filename full qualified path
+*                  alpha 0 transparent .. 255 opaque
+* Output         : None
+* Return         : 0 ok, -1 the image cannot be read
+* Attention      : As LCD_PutImage, alpha is multiplied with the alpha
+*                  channel of the image. Recorded in a display list by
+*                  name, the file is read when the list is drawn
+*******************************************************************************/
+int LCD_PutImageAlpha(int x, int y, char* file, int alpha)
+{
+    struct stat st;
+    ImageEntry *e;
+    DrawCmd *c;
+
+    if (stat(file, &st))
+    {
+        printf("Error: cannot open image %s\n", file);
+        return -1;
+    }
+
+    // recorded by name, listRun finds it in the cache when it is drawn
+    if (Rec && (c = cmdAdd(CMD_IMAGE, Ctx.clip.x0 - Ctx.ox, Ctx.clip.y0 - Ctx.oy,
+                           Ctx.clip.x1 - Ctx.ox, Ctx.clip.y1 - Ctx.oy)) != NULL)
+    {
+        c->a[0] = x;
+        c->a[1] = y;
+        c->a[3] = alpha;
+        if ((c->a[2] = listText(Rec, file)) < 0) c->op = 0;
+        return 0;
+    }
+    if ((e = imageFind(file, st.st_mtime)) != NULL)
+    {
+        blitSurface(x, y, &e->surf, -1, alpha);
+        return 0;
+    }
+    return imageLoad(x, y, file, alpha, st.st_mtime);
+}
+
+
+/*******************************************************************************
+* Function Name  : imageFind
+* Description    : Sub for LCD_PutImage, look an image up in the cache
+* Input          : file filename full qualified path
+*                  mtime modification time of the file
+* Output         : None
+* Return         : the entry, NULL not cached or the file changed
+* Attention      : A found entry becomes the most recently used
+*******************************************************************************/
+static ImageEntry *imageFind(const char *file, time_t mtime)
+{
+    ImageEntry **link, *e;
+
+    for (link = &ImageCache; *link != NULL; link = &(*link)->next)
+    {
+        e = *link;
+        if (strcmp(e->path, file) == 0)
+        {
+            if (e->mtime != mtime) return NULL;
+            *link = e->next;
+            e->next = ImageCache;
+            ImageCache = e;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+* Function Name  : imageLoad
+* Description    : Sub for LCD_PutImage, show an image that is not cached
+* Input          : x upper left corner image start
+*                  y upper left corner image start
+*                  file filename full qualified path
+*                  alpha 0 transparent .. 255 opaque
+*                  mtime modification time of the file
+* Output         : None
+* Return         : 0 ok, -1 the image cannot be read
+* Attention      : A .565 file is mapped, a BMP decoded and kept in the image
+*                  cache or streamed when it is too big
+*******************************************************************************/
+static int imageLoad(int x, int y, char *file, int alpha, time_t mtime)
+{
+    ImageEntry **link, *e;
+    Surface s;
+    BmpStream b;
+    int r;
+
+    // the file changed, drop the old decode
+    for (link = &ImageCache; *link != NULL; link = &(*link)->next)
+    {
+        e = *link;
+        if (strcmp(e->path, file) == 0)
+        {
+            *link = e->next;
+            ImageCacheBytes -= surfaceBytes(&e->surf);
+            surfaceFree(&e->surf);
+            free(e->path);
+            free(e);
+            break;
+        }
+    }
+
+    if ((r = rawPutImage(x, y, file, alpha)) != 1) return r;
+    if (bmpOpen(file, &b)) return -1;
+
+    // too big to keep: straight from the file into the back buffer
+    s.stride = (b.width + 15) & ~15;
+    s.height = b.height;
+    s.pixels = 0;
+    s.alpha = 0;
+    if ((long)s.stride * s.height * (b.alpha ? 3 : 2) > ImageCacheLimit || surfaceAlloc(&s, b.width, b.height) ||
+        (b.alpha && surfaceAlphaAlloc(&s)))
+    {
+        surfaceFree(&s);
+        if (alpha <= 0)
+        {
+            fclose(b.fp);
+            return 0;
+        }
+        x += Ctx.ox;
+        y += Ctx.oy;
+        r = bmpRead(&b, &BackBuffer, x, y, &Ctx.clip, alpha > 255 ? 255 : alpha);
+        fclose(b.fp);
+        markDirty(x, y, x + b.width - 1, y + b.height - 1);
+        return r;
+    }
+    r = bmpRead(&b, &s, 0, 0, NULL, 255);
+    fclose(b.fp);
+    if (r)
+    {
+        surfaceFree(&s);
+        return -1;
+    }
+    blitSurface(x, y, &s, -1, alpha);
+
+    if ((e = (ImageEntry*)malloc(sizeof(ImageEntry))) == NULL)
+    {
+        surfaceFree(&s);
+        return 0;
+    }
+    if ((e->path = strdup(file)) == NULL)
+    {
+        surfaceFree(&s);
+        free(e);
+        return 0;
+    }
+    imageCacheTrim(ImageCacheLimit - surfaceBytes(&s));
+    e->mtime = mtime;
+    e->surf = s;
+    e->next = ImageCache;
+    ImageCache = e;
+    ImageCacheBytes += surfaceBytes(&s);
+    return 0;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_SetPoint
+* Description    : Drawn at a specified point coordinates
+* Input          : - Xpos: Row Coordinate
+*                  - Ypos: Line Coordinate
+* Output         : None
+* Return         : None
+* Attention      : Nothing is drawn outside the clip area
+*******************************************************************************/
+void LCD_SetPoint( int x, int y, unsigned short point)
+{
+    DrawCmd *c;
+
+    if (Rec && (c = cmdAdd(CMD_POINT, x, y, x, y)) != NULL)
+    {
+        c->a[0] = x;
+        c->a[1] = y;
+        c->col = point;
+        return;
+    }
+    x += Ctx.ox;
+    y += Ctx.oy;
+    if( x < Ctx.clip.x0 || x > Ctx.clip.x1 || y < Ctx.clip.y0 || y > Ctx.clip.y1 )
+    {
+        return;
+    } else {
+        BackBuffer.pixels[y * BackBuffer.stride + x] = point;
+        markDirty(x, y, x, y);
+    }
+}
+
+
+/******************************************************************************
+* Function Name  : setPixel
+* Description    : Sub for the primitives, LCD_SetPoint without damage tracking
+* Input          : - x: Row Coordinate
+*                  - y: Line Coordinate
+*                  - point: color
+* Output         : None
+* Return         : None
+* Attention      : Screen coordinates, for shapes only partly inside the clip
+*                  area; the caller marks its whole area with markDirty once
+*******************************************************************************/
+static inline void setPixel(int x, int y, unsigned short point)
+{
+    if( x >= Ctx.clip.x0 && x <= Ctx.clip.x1 && y >= Ctx.clip.y0 && y <= Ctx.clip.y1 )
+        BackBuffer.pixels[y * BackBuffer.stride + x] = point;
+}
+
+
+/******************************************************************************
+* Function Name  : blend565
+* Description    : Mix two RGB565 colors
+* Input          : - dst: color under
+*                  - src: color over
+*                  - a: weight of src, 0..32
+* Output         : None
+* Return         : the mix
+* Attention      : Green is moved to the high half (0x07E0F81F) so all three
+*                  channels are blended with one multiply
+*******************************************************************************/
+static inline unsigned short blend565(unsigned short dst, unsigned short src, int a)
+{
+    uint32_t d = (dst | ((uint32_t)dst << 16)) & 0x07E0F81F;
+    uint32_t s = (src | ((uint32_t)src << 16)) & 0x07E0F81F;
+
+    d = (d + (((s - d) * a) >> 5)) & 0x07E0F81F;
+    return (unsigned short)(d | (d >> 16));
+}
+
+
+/******************************************************************************
+* Function Name  : blendPixel
+* Description    : Sub for the anti-aliased primitives, setPixel with coverage
+* Input          : - x: Row Coordinate
+*                  - y: Line Coordinate
+*                  - col: color
+*                  - a: coverage, 0..32
+* Output         : None
+* Return         : None
+* Attention      : Screen coordinates, no damage tracking
+*******************************************************************************/
+static inline void blendPixel(int x, int y, unsigned short col, int a)
+{
+    unsigned short *p;
+
+    if (a <= 0 || x < Ctx.clip.x0 || x > Ctx.clip.x1 || y < Ctx.clip.y0 || y > Ctx.clip.y1) return;
+    p = BackBuffer.pixels + y * BackBuffer.stride + x;
+    *p = a >= 32 ? col : blend565(*p, col, a);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_SetAntialias
+* Description    : Choose smooth or hard edges for lines, circles and text
+* Input          : - on: 1 anti-aliased, 0 aliased
+* Output         : None
+* Return         : None
+* Attention      : Straight lines, boxes and fills are the same in both
+*                  modes; anti-aliased text is blended into its background
+*                  color, not into what is on the screen
+*******************************************************************************/
+void LCD_SetAntialias(int on)
+{
+    Antialias = on;
+    GlyphRowValid = 0;
+}
+
+
+/******************************************************************************
+* Function Name  : rectTouch
+* Description    : Sub for LCD_Invalidate
+* Input          : - a, b: areas
+* Output         : None
+* Return         : 1 if the areas overlap or are next to each other
+*******************************************************************************/
+static int rectTouch(const Rect *a, const Rect *b)
+{
+    return a->x0 <= b->x1 + 1 && b->x0 <= a->x1 + 1 &&
+           a->y0 <= b->y1 + 1 && b->y0 <= a->y1 + 1;
+}
+
+
+/******************************************************************************
+* Function Name  : rectUnion
+* Description    : Sub for LCD_Invalidate, grow a to cover b too
+* Input          : - a, b: areas
+* Output         : a
+* Return         : None
+*******************************************************************************/
+static void rectUnion(Rect *a, const Rect *b)
+{
+    if (b->x0 < a->x0) a->x0 = b->x0;
+    if (b->y0 < a->y0) a->y0 = b->y0;
+    if (b->x1 > a->x1) a->x1 = b->x1;
+    if (b->y1 > a->y1) a->y1 = b->y1;
+}
+
+
+/******************************************************************************
+* Function Name  : rectArea
+* Description    : Sub for LCD_Invalidate
+* Input          : - a: area
+* Output         : None
+* Return         : number of pixels
+*******************************************************************************/
+static long rectArea(const Rect *a)
+{
+    return (long)(a->x1 - a->x0 + 1) * (a->y1 - a->y0 + 1);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_Invalidate
+* Description    : Mark an area of the back buffer as changed
+* Input          : - x0: upper left corner
+*                  - y0: upper left corner
+*                  - x1: lower right corner (inclusive)
+*                  - y1: lower right corner (inclusive)
+* Output         : None
+* Return         : None
+* Attention      : Coordinates are relative to the origin
+*******************************************************************************/
+void LCD_Invalidate(int x0, int y0, int x1, int y1)
+{
+    markDirty(x0 + Ctx.ox, y0 + Ctx.oy, x1 + Ctx.ox, y1 + Ctx.oy);
+}
+
+
+/******************************************************************************
+* Function Name  : markDirty
+* Description    : Sub for the primitives, LCD_Invalidate in screen coordinates
+* Input          : - x0, y0: upper left corner
+*                  - x1, y1: lower right corner (inclusive)
+* Output         : None
+* Return         : None
+* Attention      : Cut to the clip area, nothing outside it was drawn
+*******************************************************************************/
+static void markDirty(int x0, int y0, int x1, int y1)
+{
+    Rect r;
+
+    // a tile worker draws commands that were marked when recorded
+    if (TileWorker) return;
+    if (x0 < Ctx.clip.x0) x0 = Ctx.clip.x0;
+    if (y0 < Ctx.clip.y0) y0 = Ctx.clip.y0;
+    if (x1 > Ctx.clip.x1) x1 = Ctx.clip.x1;
+    if (y1 > Ctx.clip.y1) y1 = Ctx.clip.y1;
+    if (x0 > x1 || y0 > y1) return;
+
+    r.x0 = x0;
+    r.y0 = y0;
+    r.x1 = x1;
+    r.y1 = y1;
+    rectListAdd(Dirty, &DirtyCount, r);
+}
+
+
+/******************************************************************************
+* Function Name  : rectListAdd
+* Description    : Sub for LCD_Invalidate and the UI damage, add an area to a
+*                  list of at most MAX_DIRTY areas
+* Input          : - list: the areas
+*                  - count: number of areas
+*                  - r: new area
+* Output         : list, count
+* Return         : None
+* Attention      : Touching areas are merged, when the list is full the area
+*                  is merged with the one whose bounding box grows the least
+*******************************************************************************/
+static void rectListAdd(Rect *list, int *count, Rect r)
+{
+    Rect u;
+    int n, best;
+    long cost, bestcost;
+
+    while (1)
+    {
+        // a grown area can touch one it did not touch before: rescan
+        for (n = 0; n < *count; n++)
+        {
+            if (rectTouch(&r, &list[n])) break;
+        }
+        if (n == *count)
+        {
+            if (*count < MAX_DIRTY) break;
+
+            best = 0;
+            bestcost = -1;
+            for (n = 0; n < *count; n++)
+            {
+                u = r;
+                rectUnion(&u, &list[n]);
+                cost = rectArea(&u) - rectArea(&list[n]);
+                if (bestcost < 0 || cost < bestcost)
+                {
+                    bestcost = cost;
+                    best = n;
+                }
+            }
+            n = best;
+        }
+        rectUnion(&r, &list[n]);
+        list[n] = list[--*count];
+    }
+    list[(*count)++] = r;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_Flush
+* Description    : Copy the changed areas of the back buffer to the framebuffer
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : Call once per frame, areas are copied top to bottom so every
+*                  framebuffer page is written in a single pass; a recorded
+*                  frame is drawn first
+*******************************************************************************/
+void LCD_Flush(void)
+{
+    int n, m, y;
+    Rect t;
+
+    frameDraw();
+    if (fbp == 0 || fbp == MAP_FAILED)
+    {
+        DirtyCount = 0;
+        return;
+    }
+
+    // insertion sort on first line, the list is short
+    for (n = 1; n < DirtyCount; n++)
+    {
+        t = Dirty[n];
+        for (m = n; m > 0 && Dirty[m - 1].y0 > t.y0; m--)
+            Dirty[m] = Dirty[m - 1];
+        Dirty[m] = t;
+    }
+
+    for (n = 0; n < DirtyCount; n++)
+    {
+        for (y = Dirty[n].y0; y <= Dirty[n].y1; y++)
+            fbPutRow(y, Dirty[n].x0, Dirty[n].x1);
+    }
+    DirtyCount = 0;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_BeginFrame
+* Description    : Record the drawing of a frame instead of doing it
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : The primitives add commands to a display list until
+*                  LCD_EndFrame; surfaces given to the blits must stay
+*                  valid until then. LCD_GetPoint and LCD_Flush draw what
+*                  is recorded first
+******************************************************************************/
+void LCD_BeginFrame(void)
+{
+    listReset(&Frame);
+    Rec = &Frame;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_EndFrame
+* Description    : Draw the commands recorded since LCD_BeginFrame
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : As LCD_ListDraw, the pixels are the same as drawn
+*                  directly. LCD_Flush shows the frame
+******************************************************************************/
+void LCD_EndFrame(void)
+{
+    if (Rec != &Frame) return;
+    Rec = NULL;
+    frameDraw();
+}
+
+
+/******************************************************************************
+* Function Name  : frameDraw
+* Description    : Sub for LCD_EndFrame, draw the recorded frame so far
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : Recording goes on
+******************************************************************************/
+static void frameDraw(void)
+{
+    if (Frame.lost) printf("Error: out of memory, %d draw commands lost\n", Frame.lost);
+    listRun(&Frame);
+    listReset(&Frame);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_SetThreads
+* Description    : Choose how many threads draw the tiles of a display list
+* Input          : - n: threads, the caller included, 1..MAX_THREADS
+* Output         : None
+* Return         : 0 ok, -1 a worker cannot be started (fewer are used)
+* Attention      : 1 draws on the caller only. Not while a list is drawn
+******************************************************************************/
+int LCD_SetThreads(int n)
+{
+    int t;
+
+    if (n < 1) n = 1;
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    if (n == Threads) return 0;
+
+    pthread_mutex_lock(&PoolLock);
+    PoolQuit = 1;
+    pthread_cond_broadcast(&PoolStart);
+    pthread_mutex_unlock(&PoolLock);
+    for (t = 1; t < Threads; t++)
+        pthread_join(Workers[t], NULL);
+    PoolQuit = 0;
+
+    // Workers[0] is the caller
+    for (Threads = 1; Threads < n; Threads++)
+    {
+        if (pthread_create(&Workers[Threads], NULL, tileWorker, (void*)(intptr_t)PoolGen))
+        {
+            printf("Error: cannot start tile worker\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+* Function Name  : tileWorker
+* Description    : Sub for LCD_SetThreads, a worker thread
+* Input          : - arg: PoolGen when it was started
+* Output         : None
+* Return         : NULL
+* Attention      : Sleeps until listTiles starts a round, then draws tiles
+*                  until none is left
+******************************************************************************/
+static void *tileWorker(void *arg)
+{
+    int gen = (intptr_t)arg;
+
+    TileWorker = 1;
+    pthread_mutex_lock(&PoolLock);
+    while (1)
+    {
+        while (PoolGen == gen && !PoolQuit)
+            pthread_cond_wait(&PoolStart, &PoolLock);
+        if (PoolQuit) break;
+        gen = PoolGen;
+        pthread_mutex_unlock(&PoolLock);
+        tileDrain();
+        pthread_mutex_lock(&PoolLock);
+        if (--PoolBusy == 0) pthread_cond_signal(&PoolDone);
+    }
+    pthread_mutex_unlock(&PoolLock);
+    free(CircleSpan);
+    return NULL;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_ListNew, LCD_ListFree
+* Description    : Make an empty display list, free a list
+* Input          : - l: the list
+* Output         : None
+* Return         : the list, NULL out of memory
+* Attention      : None
+******************************************************************************/
+DisplayList *LCD_ListNew(void)
+{
+    return (DisplayList*)calloc(1, sizeof(DisplayList));
+}
+
+void LCD_ListFree(DisplayList *l)
+{
+    if (l == NULL) return;
+    if (Rec == l) LCD_ListEnd();
+    listReset(l);
+    free(l->cmds);
+    free(l->text);
+    free(l);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_ListBegin
+* Description    : Record drawing commands into a display list
+* Input          : - l: the list, emptied first
+* Output         : None
+* Return         : None
+* Attention      : Until LCD_ListEnd the primitives add commands to the
+*                  list and draw nothing. A command keeps the clip area,
+*                  origin and anti-aliasing mode, blits keep the surface
+*                  pointer and images the file name. The memory of the
+*                  list is kept, recording it again every frame allocates
+*                  nothing
+******************************************************************************/
+void LCD_ListBegin(DisplayList *l)
+{
+    listReset(l);
+    RecOuter = Rec;
+    Rec = l;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_ListEnd
+* Description    : Stop recording a display list
+* Input          : None
+* Output         : None
+* Return         : 0 ok, -1 commands were lost for lack of memory
+* Attention      : A frame recorded around the list goes on
+******************************************************************************/
+int LCD_ListEnd(void)
+{
+    DisplayList *l = Rec;
+
+    if (l == NULL || l == &Frame) return -1;
+    Rec = RecOuter;
+    RecOuter = NULL;
+    return l->lost ? -1 : 0;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_ListDraw
+* Description    : Draw a display list
+* Input          : - l: the list
+* Output         : None
+* Return         : None
+* Attention      : In one pass over the screen: the commands are binned
+*                  into TILE_SIZE tiles and every tile is drawn with the
+*                  commands over it in recorded order, on the LCD_SetThreads
+*                  threads. The pixels are the same as drawn directly. A
+*                  list can be drawn any number of times; while a frame or
+*                  another list is recorded its commands are added to it
+******************************************************************************/
+void LCD_ListDraw(DisplayList *l)
+{
+    if (Rec)
+        listAppend(Rec, l);
+    else
+        listRun(l);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_ListSave
+* Description    : Write a display list to a file
+* Input          : - l: the list
+*                  - file: filename full qualified path
+* Output         : None
+* Return         : 0 ok, -1 error
+* Attention      : Little endian: a LIST_HEADER_SIZE header, LIST_CMD_SIZE
+*                  bytes per command, the strings, then width, height,
+*                  alpha flag, pad and the pixels of every blit
+******************************************************************************/
+int LCD_ListSave(DisplayList *l, char *file)
+{
+    FILE *fp;
+    unsigned char b[LIST_CMD_SIZE], *row;
+    const DrawCmd *c;
+    const Surface *s;
+    int n, x, y, err = 0;
+
+    if ((fp = fopen(file, "wb")) == NULL)
+    {
+        printf("Error: cannot create %s\n", file);
+        return -1;
+    }
+    memcpy(b, LIST_MAGIC, 4);
+    put16(b + 4, LIST_VERSION);
+    put16(b + 6, 0);
+    put32(b + 8, l->count);
+    put32(b + 12, l->textUsed);
+    fwrite(b, 1, LIST_HEADER_SIZE, fp);
+
+    for (n = 0; n < l->count; n++)
+    {
+        c = &l->cmds[n];
+        b[0] = c->op;
+        b[1] = c->aa;
+        put16(b + 2, c->col);
+        put16(b + 4, c->bcol);
+        put16(b + 6, c->ctx.clip.x0);
+        put16(b + 8, c->ctx.clip.y0);
+        put16(b + 10, c->ctx.clip.x1);
+        put16(b + 12, c->ctx.clip.y1);
+        put16(b + 14, c->ctx.ox);
+        put16(b + 16, c->ctx.oy);
+        put16(b + 18, c->bounds.x0);
+        put16(b + 20, c->bounds.y0);
+        put16(b + 22, c->bounds.x1);
+        put16(b + 24, c->bounds.y1);
+        for (x = 0; x < 6; x++)
+            put32(b + 26 + x * 4, c->a[x]);
+        fwrite(b, 1, LIST_CMD_SIZE, fp);
+    }
+    fwrite(l->text, 1, l->textUsed, fp);
+
+    for (n = 0; n < l->count && !err; n++)
+    {
+        if (l->cmds[n].op != CMD_BLIT) continue;
+        s = l->cmds[n].surf;
+        put16(b, s->width);
+        put16(b + 2, s->height);
+        put16(b + 4, s->alpha != NULL);
+        put16(b + 6, 0);
+        fwrite(b, 1, 8, fp);
+        if ((row = (unsigned char*)malloc(s->width * 2 + 1)) == NULL)
+        {
+            err = 1;
+            break;
+        }
+        for (y = 0; y < s->height; y++)
+        {
+            for (x = 0; x < s->width; x++)
+                put16(row + x * 2, s->pixels[y * s->stride + x]);
+            fwrite(row, 2, s->width, fp);
+        }
+        free(row);
+        for (y = 0; s->alpha && y < s->height; y++)
+            fwrite(s->alpha + y * s->stride, 1, s->width, fp);
+    }
+
+    if (ferror(fp)) err = 1;
+    if (fclose(fp) != 0 || err)
+    {
+        printf("Error writing %s\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_ListLoad
+* Description    : Read a display list written by LCD_ListSave
+* Input          : - file: filename full qualified path
+* Output         : None
+* Return         : the list, NULL error
+* Attention      : After LCD_Init, clip areas are cut to the screen; the
+*                  list owns the blit pixels, LCD_ListFree frees them
+******************************************************************************/
+DisplayList *LCD_ListLoad(char *file)
+{
+    FILE *fp;
+    DisplayList *l;
+    DrawCmd *c;
+    Surface *s;
+    unsigned char b[LIST_CMD_SIZE], *row = NULL;
+    long count, text;
+    int n, x, y, blits = 0, err = 1;
+
+    if ((fp = fopen(file, "rb")) == NULL)
+    {
+        printf("Error: cannot open %s\n", file);
+        return NULL;
+    }
+    if ((l = LCD_ListNew()) == NULL || fread(b, 1, LIST_HEADER_SIZE, fp) != LIST_HEADER_SIZE ||
+        memcmp(b, LIST_MAGIC, 4) != 0 || le16(b + 4) != LIST_VERSION)
+        goto done;
+    count = le32(b + 8);
+    text = le32(b + 12);
+    if (count > (1 << 24) || text > (1 << 26)) goto done;
+    l->cmds = (DrawCmd*)malloc((count + 1) * sizeof(DrawCmd));
+    l->text = (char*)malloc(text + 1);
+    if (l->cmds == NULL || l->text == NULL) goto done;
+    l->max = count + 1;
+    l->textMax = text + 1;
+
+    for (n = 0; n < count; n++)
+    {
+        if (fread(b, 1, LIST_CMD_SIZE, fp) != LIST_CMD_SIZE) goto done;
+        c = &l->cmds[l->count++];
+        c->op = b[0];
+        c->aa = b[1];
+        c->col = le16(b + 2);
+        c->bcol = le16(b + 4);
+        c->ctx.clip.x0 = (short)le16(b + 6);
+        c->ctx.clip.y0 = (short)le16(b + 8);
+        c->ctx.clip.x1 = (short)le16(b + 10);
+        c->ctx.clip.y1 = (short)le16(b + 12);
+        c->ctx.ox = (short)le16(b + 14);
+        c->ctx.oy = (short)le16(b + 16);
+        c->bounds.x0 = (short)le16(b + 18);
+        c->bounds.y0 = (short)le16(b + 20);
+        c->bounds.x1 = (short)le16(b + 22);
+        c->bounds.y1 = (short)le16(b + 24);
+        for (x = 0; x < 6; x++)
+            c->a[x] = (int)le32(b + 26 + x * 4);
+        c->surf = NULL;
+        if (c->op > CMD_IMAGE) goto done;
+        if ((c->op == CMD_TEXT || c->op == CMD_IMAGE) && (c->a[2] < 0 || c->a[2] >= text)) goto done;
+        if (c->op == CMD_BLIT) blits++;
+
+        // another screen size: nothing outside this one
+        if (c->ctx.clip.x1 >= BackBuffer.width) c->ctx.clip.x1 = BackBuffer.width - 1;
+        if (c->ctx.clip.y1 >= BackBuffer.height) c->ctx.clip.y1 = BackBuffer.height - 1;
+        if (c->ctx.clip.x0 < 0) c->ctx.clip.x0 = 0;
+        if (c->ctx.clip.y0 < 0) c->ctx.clip.y0 = 0;
+        if (c->bounds.x0 < c->ctx.clip.x0) c->bounds.x0 = c->ctx.clip.x0;
+        if (c->bounds.y0 < c->ctx.clip.y0) c->bounds.y0 = c->ctx.clip.y0;
+        if (c->bounds.x1 > c->ctx.clip.x1) c->bounds.x1 = c->ctx.clip.x1;
+        if (c->bounds.y1 > c->ctx.clip.y1) c->bounds.y1 = c->ctx.clip.y1;
+    }
+    if (fread(l->text, 1, text, fp) != (size_t)text) goto done;
+    l->text[text] = 0;
+    l->textUsed = text;
+
+    if (blits && (l->owned = (Surface*)calloc(blits, sizeof(Surface))) == NULL) goto done;
+    for (n = 0; n < l->count; n++)
+    {
+        c = &l->cmds[n];
+        if (c->op != CMD_BLIT) continue;
+        if (fread(b, 1, 8, fp) != 8) goto done;
+        s = &l->owned[l->ownedCount];
+        if (surfaceAlloc(s, le16(b), le16(b + 2))) goto done;
+        l->ownedCount++;
+        if (le16(b + 4) && surfaceAlphaAlloc(s)) goto done;
+        free(row);
+        if ((row = (unsigned char*)malloc(s->width * 2 + 1)) == NULL) goto done;
+        for (y = 0; y < s->height; y++)
+        {
+            if (fread(row, 2, s->width, fp) != s->width) goto done;
+            for (x = 0; x < s->width; x++)
+                s->pixels[y * s->stride + x] = le16(row + x * 2);
+        }
+        for (y = 0; s->alpha && y < s->height; y++)
+        {
+            if (fread(s->alpha + y * s->stride, 1, s->width, fp) != s->width) goto done;
+        }
+        c->surf = s;
+    }
+    err = 0;
+
+done:
+    free(row);
+    fclose(fp);
+    if (err)
+    {
+        printf("Error: %s is not a display list\n", file);
+        LCD_ListFree(l);
+        return NULL;
+    }
+    return l;
+}
+
+
+/******************************************************************************
+* Function Name  : put16, put32
+* Description    : Sub for LCD_ListSave, store little endian fields
+* Input          : - v: value
+* Output         : - p: field
+* Return         : None
+* Attention      : None
+******************************************************************************/
+static void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+
+/******************************************************************************
+* Function Name  : listAdd
+* Description    : Sub for the display lists, a new command at the end
+* Input          : - l: the list
+* Output         : None
+* Return         : the command, NULL out of memory
+* Attention      : The array doubles and is kept by listReset
+******************************************************************************/
+static DrawCmd *listAdd(DisplayList *l)
+{
+    DrawCmd *c;
+    int n;
+
+    if (l->count == l->max)
+    {
+        n = l->max ? l->max * 2 : 256;
+        if ((c = (DrawCmd*)realloc(l->cmds, n * sizeof(DrawCmd))) == NULL) return NULL;
+        l->cmds = c;
+        l->max = n;
+    }
+    return &l->cmds[l->count++];
+}
+
+
+/******************************************************************************
+* Function Name  : listText
+* Description    : Sub for the display lists, keep a string for a command
+* Input          : - l: the list
+*                  - s: the string
+* Output         : None
+* Return         : offset in the strings of the list, -1 out of memory
+* Attention      : Counted as lost when there is no memory
+******************************************************************************/
+static int listText(DisplayList *l, const char *s)
+{
+    char *t;
+    int n = strlen(s) + 1, m;
+
+    if (l->textUsed + n > l->textMax)
+    {
+        for (m = l->textMax ? l->textMax : 1024; m < l->textUsed + n; m *= 2);
+        if ((t = (char*)realloc(l->text, m)) == NULL)
+        {
+            l->lost++;
+            return -1;
+        }
+        l->text = t;
+        l->textMax = m;
+    }
+    memcpy(l->text + l->textUsed, s, n);
+    l->textUsed += n;
+    return l->textUsed - n;
+}
+
+
+/******************************************************************************
+* Function Name  : listReset
+* Description    : Sub for the display lists, make a list empty
+* Input          : - l: the list
+* Output         : None
+* Return         : None
+* Attention      : Frees the pixels a loaded list owns, keeps the arrays
+******************************************************************************/
+static void listReset(DisplayList *l)
+{
+    int n;
+
+    for (n = 0; n < l->ownedCount; n++)
+        surfaceFree(&l->owned[n]);
+    free(l->owned);
+    l->owned = NULL;
+    l->ownedCount = 0;
+    l->count = 0;
+    l->textUsed = 0;
+    l->lost = 0;
+}
+
+
+/******************************************************************************
+* Function Name  : listAppend
+* Description    : Sub for LCD_ListDraw, copy the commands of a list
+* Input          : - src: the list
+* Output         : - dst: the list recorded
+* Return         : None
+* Attention      : Blits share the surfaces of src
+******************************************************************************/
+static void listAppend(DisplayList *dst, const DisplayList *src)
+{
+    DrawCmd *c;
+    int n;
+
+    for (n = 0; n < src->count; n++)
+    {
+        if ((c = listAdd(dst)) == NULL)
+        {
+            dst->lost++;
+            continue;
+        }
+        *c = src->cmds[n];
+        if ((c->op == CMD_TEXT || c->op == CMD_IMAGE) && (c->a[2] = listText(dst, src->text + c->a[2])) < 0)
+            c->op = 0;
+    }
+}
+
+
+/******************************************************************************
+* Function Name  : cmdAdd
+* Description    : Sub for the primitives, record a command in Rec
+* Input          : - op: CMD_CLEAR .. CMD_IMAGE
+*                  - x0, y0: upper left corner of the area it can change
+*                  - x1, y1: lower right corner (inclusive)
+* Output         : None
+* Return         : the command for the caller to fill in, NULL nothing is
+*                  visible and the caller may draw directly
+* Attention      : Relative to the origin, cut to the clip area. Out of
+*                  memory the command is filled in and lost
+******************************************************************************/
+static DrawCmd *cmdAdd(int op, int x0, int y0, int x1, int y1)
+{
+    DrawCmd *c;
+
+    x0 += Ctx.ox;
+    y0 += Ctx.oy;
+    x1 += Ctx.ox;
+    y1 += Ctx.oy;
+    if (x0 < Ctx.clip.x0) x0 = Ctx.clip.x0;
+    if (y0 < Ctx.clip.y0) y0 = Ctx.clip.y0;
+    if (x1 > Ctx.clip.x1) x1 = Ctx.clip.x1;
+    if (y1 > Ctx.clip.y1) y1 = Ctx.clip.y1;
+    if (x0 > x1 || y0 > y1) return NULL;
+
+    if ((c = listAdd(Rec)) == NULL)
+    {
+        Rec->lost++;
+        return &CmdLost;
+    }
+    c->op = op;
+    c->aa = Antialias;
+    c->ctx = Ctx;
+    c->bounds.x0 = x0;
+    c->bounds.y0 = y0;
+    c->bounds.x1 = x1;
+    c->bounds.y1 = y1;
+    c->surf = NULL;
+    return c;
+}
+
+
+/******************************************************************************
+* Function Name  : cmdArea
+* Description    : Sub for listTiles, the screen area a command changes
+* Input          : - c: the command
+* Output         : - r: the area
+* Return         : 1, 0 nothing is drawn
+* Attention      : An image is known once imageResolve found it
+******************************************************************************/
+static int cmdArea(const DrawCmd *c, Rect *r)
+{
+    int x, y;
+
+    *r = c->bounds;
+    if (c->op == 0) return 0;
+    if (c->op != CMD_IMAGE) return 1;
+    if (c->surf == NULL) return 0;
+
+    x = c->a[0] + c->ctx.ox;
+    y = c->a[1] + c->ctx.oy;
+    if (x > r->x0) r->x0 = x;
+    if (y > r->y0) r->y0 = y;
+    if (x + c->surf->width - 1 < r->x1) r->x1 = x + c->surf->width - 1;
+    if (y + c->surf->height - 1 < r->y1) r->y1 = y + c->surf->height - 1;
+    return r->x0 <= r->x1 && r->y0 <= r->y1;
+}
+
+
+/******************************************************************************
+* Function Name  : imageResolve
+* Description    : Sub for listRun, find the image of a CMD_IMAGE command
+* Input          : - l: the list
+*                  - c: the command
+* Output         : None
+* Return         : 1 it can be drawn with the others, 0 it is not cached
+* Attention      : Nothing leaves the cache until the commands are drawn
+******************************************************************************/
+static int imageResolve(DisplayList *l, DrawCmd *c)
+{
+    struct stat st;
+    ImageEntry *e;
+
+    c->surf = NULL;
+    if (stat(l->text + c->a[2], &st) || (e = imageFind(l->text + c->a[2], st.st_mtime)) == NULL) return 0;
+    c->surf = &e->surf;
+    return 1;
+}
+
+
+/******************************************************************************
+* Function Name  : listRun
+* Description    : Sub for LCD_ListDraw, draw a display list
+* Input          : - l: the list
+* Output         : None
+* Return         : None
+* Attention      : Images that are not in the cache split the list: the
+*                  commands before are drawn, then the image is put
+*                  directly, which caches it for the next time
+******************************************************************************/
+static void listRun(DisplayList *l)
+{
+    DisplayList *rec = Rec;
+    DrawContext ctx = Ctx;
+    int aa = Antialias, first = 0, n;
+    DrawCmd *c;
+
+    Rec = NULL;
+    for (n = 0; n <= l->count; n++)
+    {
+        c = &l->cmds[n];
+        if (n < l->count && (c->op != CMD_IMAGE || imageResolve(l, c))) continue;
+        listTiles(l, first, n);
+        if (n < l->count)
+        {
+            Ctx = c->ctx;
+            LCD_PutImageAlpha(c->a[0], c->a[1], l->text + c->a[2], c->a[3]);
+        }
+        first = n + 1;
+    }
+    Ctx = ctx;
+    Antialias = aa;
+    GlyphRowValid = 0;
+    Rec = rec;
+}
+
+
+/******************************************************************************
+* Function Name  : listTiles
+* Description    : Sub for listRun, draw a run of commands tile by tile
+* Input          : - l: the list
+*                  - first: first command
+*                  - end: command after the last
+* Output         : None
+* Return         : None
+* Attention      : Every command is listed in the tiles under its area, in
+*                  recorded order; a pixel is in one tile only so the tiles
+*                  can be drawn in any order by any thread. With one thread
+*                  the commands are drawn in order. The areas are marked
+*                  dirty here
+******************************************************************************/
+static void listTiles(DisplayList *l, int first, int end)
+{
+    const DrawCmd *c;
+    Rect r;
+    int *p = NULL, n, t, tx, ty, tiles, total = 0;
+
+    if (first >= end) return;
+    TileCmds = l->cmds;
+    TileText = l->text;
+    TileCols = (BackBuffer.width + TILE_SIZE - 1) / TILE_SIZE;
+    TileRows = (BackBuffer.height + TILE_SIZE - 1) / TILE_SIZE;
+    tiles = TileCols * TileRows;
+
+    // count the commands of every tile, then list them
+    if (Threads > 1 && (p = (int*)realloc(TileFirst, tiles * sizeof(int))) != NULL)
+    {
+        TileFirst = p;
+        memset(TileFirst, 0, tiles * sizeof(int));
+        for (n = first; n < end; n++)
+        {
+            c = &l->cmds[n];
+            if (!cmdArea(c, &r)) continue;
+            rectListAdd(Dirty, &DirtyCount, r);
+            if (c->aa) glyphAlphaInit();
+            for (ty = r.y0 / TILE_SIZE; ty <= r.y1 / TILE_SIZE; ty++)
+                for (tx = r.x0 / TILE_SIZE; tx <= r.x1 / TILE_SIZE; tx++)
+                    TileFirst[ty * TileCols + tx]++;
+        }
+        for (t = 0; t < tiles; t++)
+        {
+            n = TileFirst[t];
+            TileFirst[t] = total;
+            total += n;
+        }
+        if (total > TileListMax && (p = (int*)realloc(TileList, total * sizeof(int))) != NULL)
+        {
+            TileList = p;
+            TileListMax = total;
+        }
+    }
+
+    if (p == NULL)
+    {
+        // one thread or no memory for the tiles: in order, the whole
+        // command at once is faster than once per tile on one core
+        TileWorker = 1;
+        for (n = first; n < end; n++)
+        {
+            c = &l->cmds[n];
+            if (!cmdArea(c, &r)) continue;
+            rectListAdd(Dirty, &DirtyCount, r);
+            Ctx = c->ctx;
+            if (Antialias != c->aa)
+            {
+                Antialias = c->aa;
+                GlyphRowValid = 0;
+            }
+            cmdRun(c);
+        }
+        TileWorker = 0;
+        return;
+    }
+
+    // TileFirst[t] ends as the end of tile t, the start of t + 1
+    for (n = first; n < end; n++)
+    {
+        if (!cmdArea(&l->cmds[n], &r)) continue;
+        for (ty = r.y0 / TILE_SIZE; ty <= r.y1 / TILE_SIZE; ty++)
+            for (tx = r.x0 / TILE_SIZE; tx <= r.x1 / TILE_SIZE; tx++)
+                TileList[TileFirst[ty * TileCols + tx]++] = n;
+    }
+
+    pthread_mutex_lock(&PoolLock);
+    TileNext = 0;
+    PoolBusy = Threads - 1;
+    PoolGen++;
+    pthread_cond_broadcast(&PoolStart);
+    pthread_mutex_unlock(&PoolLock);
+    TileWorker = 1;
+    tileDrain();
+    TileWorker = 0;
+    pthread_mutex_lock(&PoolLock);
+    while (PoolBusy > 0)
+        pthread_cond_wait(&PoolDone, &PoolLock);
+    pthread_mutex_unlock(&PoolLock);
+}
+
+
+/******************************************************************************
+* Function Name  : tileDrain
+* Description    : Sub for listTiles and the workers, draw tiles until every
+*                  tile is taken
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : A command gets its recorded context cut to the tile
+******************************************************************************/
+static void tileDrain(void)
+{
+    int t, n;
+    Rect tile;
+    const DrawCmd *c;
+
+    while ((t = __sync_fetch_and_add(&TileNext, 1)) < TileCols * TileRows)
+    {
+        tile.x0 = t % TileCols * TILE_SIZE;
+        tile.y0 = t / TileCols * TILE_SIZE;
+        tile.x1 = tile.x0 + TILE_SIZE - 1;
+        tile.y1 = tile.y0 + TILE_SIZE - 1;
+        for (n = t ? TileFirst[t - 1] : 0; n < TileFirst[t]; n++)
+        {
+            c = &TileCmds[TileList[n]];
+            Ctx = c->ctx;
+            if (Ctx.clip.x0 < tile.x0) Ctx.clip.x0 = tile.x0;
+            if (Ctx.clip.y0 < tile.y0) Ctx.clip.y0 = tile.y0;
+            if (Ctx.clip.x1 > tile.x1) Ctx.clip.x1 = tile.x1;
+            if (Ctx.clip.y1 > tile.y1) Ctx.clip.y1 = tile.y1;
+            if (Antialias != c->aa)
+            {
+                Antialias = c->aa;
+                GlyphRowValid = 0;
+            }
+            cmdRun(c);
+        }
+    }
+}
+
+
+/******************************************************************************
+* Function Name  : cmdRun
+* Description    : Sub for tileDrain, draw a recorded command
+* Input          : - c: the command
+* Output         : None
+* Return         : None
+* Attention      : In the current context, not recording
+******************************************************************************/
+static void cmdRun(const DrawCmd *c)
+{
+    const int *a = c->a;
+
+    switch (c->op) {
+    case CMD_CLEAR:
+        LCD_Clear(c->col);
+        break;
+    case CMD_POINT:
+        LCD_SetPoint(a[0], a[1], c->col);
+        break;
+    case CMD_HLINE:
+        LCD_HLine(a[0], a[1], a[2], c->col);
+        break;
+    case CMD_VLINE:
+        LCD_VLine(a[0], a[1], a[2], c->col);
+        break;
+    case CMD_FILL:
+        LCD_FillRect(a[0], a[1], a[2], a[3], c->col);
+        break;
+    case CMD_LINE:
+        LCD_DrawLine(a[0], a[1], a[2], a[3], c->col);
+        break;
+    case CMD_CIRCLE:
+        LCD_DrawCircle(a[0], a[1], a[2], c->col);
+        break;
+    case CMD_CIRCLEFILL:
+        LCD_DrawCircleFill(a[0], a[1], a[2], c->bcol, c->col);
+        break;
+    case CMD_ROUNDBOX:
+        LCD_DrawRoundBox(a[0], a[1], a[2], a[3], a[4], c->col, a[5]);
+        break;
+    case CMD_ARC:
+        LCD_DrawArc(a[0], a[1], a[2], a[3], a[4], c->col);
+        break;
+    case CMD_CHAR:
+        PutChar(a[0], a[1], a[2], c->col, c->bcol);
+        break;
+    case CMD_TEXT:
+        LCD_Text(a[0], a[1], TileText + a[2], c->col, c->bcol);
+        break;
+    case CMD_BLIT:
+        blitSurface(a[0], a[1], c->surf, a[2], a[3]);
+        break;
+    case CMD_IMAGE:
+        blitSurface(a[0], a[1], c->surf, -1, a[3]);
+        break;
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : DelayMicrosecondsNoSleep
+* Description    : Delay n microseconds
+* Input          : delay_us: specifies the n microseconds
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+void DelayMicrosecondsNoSleep (int delay_us)
+{
+    long int start_time;
+    long int time_difference;
+    struct timespec gettime_now;
+
+    clock_gettime(CLOCK_REALTIME, &gettime_now);
+    start_time = gettime_now.tv_nsec;		 //Get nS value
+
+    while (1)
+    {
+        clock_gettime(CLOCK_REALTIME, &gettime_now);
+        time_difference = gettime_now.tv_nsec - start_time;
+        if (time_difference < 0)
+	    time_difference += 1000000000;	 //(Rolls over every 1 second)
+	if (time_difference > (delay_us * 1000)) //Delay for # nS
+	    break;
+    }
+}
+
+
+/*******************************************************************************
+* Function Name  : GetASCIICode
+* Description    : get ASCII code data
+* Input          : - ASCII: Input ASCII code
+* Output         : - *pBuffer: Store data pointer
+* Return         : None
+* Attention	 	 : None
+*******************************************************************************/
+void GetASCIICode(unsigned char* pBuffer,unsigned char ASCII)
+{
+    memcpy(pBuffer,AsciiLib[(ASCII - 32)] ,16);
+}
+
+
+/*******************************************************************************
+* Function Name  : LCD_Clear
+* Description    : Fill the screen as the specified color
+* Input          : - Color: Screen Color
+* Output         : None
+* Return         : None
+* Attention	 	 : Only the clip area when LCD_SetClip limits it
+*******************************************************************************/
+void LCD_Clear(unsigned short Color)
+{
+    Rect r;
+    DrawCmd *c;
+
+    if (Rec && (c = cmdAdd(CMD_CLEAR, Ctx.clip.x0 - Ctx.ox, Ctx.clip.y0 - Ctx.oy,
+                                 Ctx.clip.x1 - Ctx.ox, Ctx.clip.y1 - Ctx.oy)) != NULL)
+    {
+        c->col = Color;
+        return;
+    }
+    if (fillRect16(&BackBuffer, Ctx.clip.x0, Ctx.clip.y0, Ctx.clip.x1, Ctx.clip.y1, Color, &r))
+        markDirty(r.x0, r.y0, r.x1, r.y1);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_GetPoint
+* Description    : Get color value for the specified coordinates
+* Input          : - Xpos: Row Coordinate
+*                  - Xpos: Line Coordinate
+* Output         : None
+* Return         : Screen Color - -1 out of coordinate
+* Attention	 	 : A recorded frame is drawn first
+*******************************************************************************/
+short LCD_GetPoint( int x, int y)
+{
+    frameDraw();
+    x += Ctx.ox;
+    y += Ctx.oy;
+    if( x < 0 || y < 0 || x >= BackBuffer.width || y >= BackBuffer.height )
+    {
+        return -1;
+    } else {
+        // read back what was drawn, not what was flushed
+        return BackBuffer.pixels[y * BackBuffer.stride + x];
+    }
+}
+
+
+/******************************************************************************
+* Function Name  : PutChar
+* Description    : Lcd screen displays a character
+* Input          : - Xpos: Horizontal coordinate
+*                  - Ypos: Vertical coordinate
+*				   - ASCI: Displayed character
+*				   - charColor: Character color
+*				   - bkColor: Background color
+* Output         : None
+* Return         : None
+* Attention	 	 : None
+*******************************************************************************/
+void PutChar(int Xpos, int Ypos, unsigned char ASCI, unsigned short charColor, unsigned short bkColor )
+{
+    DrawCmd *c;
+
+    if (Rec && (c = cmdAdd(CMD_CHAR, Xpos, Ypos, Xpos + 7, Ypos + 15)) != NULL)
+    {
+        c->a[0] = Xpos;
+        c->a[1] = Ypos;
+        c->a[2] = ASCI;
+        c->col = charColor;
+        c->bcol = bkColor;
+        return;
+    }
+    Xpos += Ctx.ox;
+    Ypos += Ctx.oy;
+    setGlyphColors(charColor, bkColor);
+    putGlyph(Xpos, Ypos, ASCI);
+    markDirty(Xpos, Ypos, Xpos + 7, Ypos + 15);
+}
+
+
+/******************************************************************************
+* Function Name  : setGlyphColors
+* Description    : Sub for PutChar, expand the nibble table for a color pair
+* Input          : - charColor: Character color
+*                  - bkColor: Background color
+* Output         : None
+* Return         : None
+* Attention      : Kept until the next color pair, so a string costs one call
+*******************************************************************************/
+static void setGlyphColors(unsigned short charColor, unsigned short bkColor)
+{
+    int n, j;
+
+    if (GlyphRowValid && GlyphFg == charColor && GlyphBg == bkColor) return;
+
+    for (n = 0; n < 16; n++)
+    {
+        for (j = 0; j < 4; j++)
+            GlyphRow[n][j] = (n & (8 >> j)) ? charColor : bkColor;
+        GlyphRamp[n] = blend565(bkColor, charColor, (n * 32 + 7) / 15);
+    }
+    GlyphAA = Antialias && glyphAlphaInit() == 0;
+    GlyphFg = charColor;
+    GlyphBg = bkColor;
+    GlyphRowValid = 1;
+}
+
+
+/******************************************************************************
+* Function Name  : fontBit
+* Description    : Sub for glyphAlphaInit, one pixel of an AsciiLib glyph
+* Input          : - b: font rows
+*                  - x, y: pixel, may be outside the 8x16 cell
+* Output         : None
+* Return         : 1 set, 0 empty or outside
+* Attention      : None
+******************************************************************************/
+static int fontBit(const unsigned char *b, int x, int y)
+{
+    return x >= 0 && x < 8 && y >= 0 && y < 16 && (b[y] & (0x80 >> x));
+}
+
+
+/******************************************************************************
+* Function Name  : glyphAlphaInit
+* Description    : Sub for setGlyphColors, make the 4 bit grayscale font
+* Input          : None
+* Output         : None
+* Return         : 0 ok, -1 out of memory
+* Attention      : Built once from AsciiLib: set pixels are 15, an empty
+*                  pixel in the corner of a step (set neighbours above or
+*                  below and left or right) gets 5, one-pixel gaps stay 0
+******************************************************************************/
+static int glyphAlphaInit(void)
+{
+    int c, x, y, a, n, s, w, e;
+    const unsigned char *b;
+    unsigned char *d;
+
+    if (GlyphAlpha) return 0;
+    if ((GlyphAlpha = (unsigned char*)malloc(95 * 16 * 8)) == NULL) return -1;
+
+    for (c = 0; c < 95; c++)
+    {
+        b = AsciiLib[c];
+        d = GlyphAlpha + c * 16 * 8;
+        for (y = 0; y < 16; y++)
+        {
+            for (x = 0; x < 8; x++)
+            {
+                if (fontBit(b, x, y))
+                {
+                    a = 15;
+                } else {
+                    n = fontBit(b, x, y - 1);
+                    s = fontBit(b, x, y + 1);
+                    w = fontBit(b, x - 1, y);
+                    e = fontBit(b, x + 1, y);
+                    // a step corner gets a third, gaps between strokes none
+                    a = (n && s) || (w && e) ? 0 : ((n || s) && (w || e)) * 5;
+                }
+                *d++ = a;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+* Function Name  : expandGlyph
+* Description    : Sub for putGlyph, render a character in the current colors
+* Input          : - c: character, ' '..'~'
+* Output         : - dst: 8x16 pixels
+* Return         : None
+* Attention      : Through GlyphRamp in anti-aliased mode, the background is
+*                  part of the blend so nothing is read back
+******************************************************************************/
+static void expandGlyph(unsigned short *dst, unsigned char c)
+{
+    const unsigned char *bits = AsciiLib[c - 32];
+    int i;
+
+    if (GlyphAA)
+    {
+        bits = GlyphAlpha + (c - 32) * 16 * 8;
+        for (i = 0; i < 16 * 8; i++)
+            dst[i] = GlyphRamp[bits[i]];
+        return;
+    }
+    for (i = 0; i < 16; i++)
+    {
+        memcpy(dst, GlyphRow[bits[i] >> 4], 8);
+        memcpy(dst + 4, GlyphRow[bits[i] & 15], 8);
+        dst += 8;
+    }
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_GlyphCacheInit
+* Description    : Size the glyph cache
+* Input          : - tiles: glyphs kept, 0 disables the cache
+* Output         : None
+* Return         : 0 ok, -1 out of memory (cache disabled)
+* Attention      : Drops every cached glyph and resets the counters
+*******************************************************************************/
+int LCD_GlyphCacheInit(int tiles)
+{
+    int n;
+
+    free(GlyphCache);
+    free(GlyphBucket);
+    GlyphCache = 0;
+    GlyphBucket = 0;
+    GlyphCacheSize = tiles > 0 ? tiles : 0;
+    GlyphCacheUsed = 0;
+    GlyphNewest = GlyphOldest = -1;
+    GlyphHits = GlyphMisses = 0;
+    if (GlyphCacheSize == 0) return 0;
+
+    for (GlyphBuckets = 1; GlyphBuckets < GlyphCacheSize; GlyphBuckets <<= 1);
+    GlyphCache = (GlyphTile*)malloc(GlyphCacheSize * sizeof(GlyphTile));
+    GlyphBucket = (int*)malloc(GlyphBuckets * sizeof(int));
+    if (GlyphCache == NULL || GlyphBucket == NULL)
+    {
+        printf("Error: cannot allocate glyph cache\n");
+        LCD_GlyphCacheInit(0);
+        return -1;
+    }
+    for (n = 0; n < GlyphBuckets; n++)
+        GlyphBucket[n] = -1;
+    return 0;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_GlyphCacheStats
+* Description    : Report how well the glyph cache is sized
+* Input          : None
+* Output         : - hits: glyphs copied from the cache
+*                  - misses: glyphs rendered from the font
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+void LCD_GlyphCacheStats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = GlyphHits;
+    *misses = GlyphMisses;
+}
+
+
+/******************************************************************************
+* Function Name  : glyphUnlink
+* Description    : Sub for glyphLookup, take a tile out of the LRU list
+* Input          : - n: tile
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void glyphUnlink(int n)
+{
+    GlyphTile *t = &GlyphCache[n];
+
+    if (t->newer >= 0) GlyphCache[t->newer].older = t->older;
+    else GlyphNewest = t->older;
+    if (t->older >= 0) GlyphCache[t->older].newer = t->newer;
+    else GlyphOldest = t->newer;
+}
+
+
+/******************************************************************************
+* Function Name  : glyphPushFront
+* Description    : Sub for glyphLookup, make a tile the most recently used
+* Input          : - n: tile
+* Output         : None
+* Return         : None
+* Attention      : None
+*******************************************************************************/
+static void glyphPushFront(int n)
+{
+    GlyphTile *t = &GlyphCache[n];
+
+    t->newer = -1;
+    t->older = GlyphNewest;
+    if (GlyphNewest >= 0) GlyphCache[GlyphNewest].newer = n;
+    GlyphNewest = n;
+    if (GlyphOldest < 0) GlyphOldest = n;
+}
+
+
+/******************************************************************************
+* Function Name  : glyphHash
+* Description    : Sub for glyphLookup
+* Input          : - c: character
+*                  - fg: Character color
+*                  - bg: Background color
+* Output         : None
+* Return         : hash bucket
+* Attention      : None
+*******************************************************************************/
+static unsigned int glyphHash(unsigned char c, unsigned short fg, unsigned short bg)
+{
+    unsigned int h = c * 0x9E3779B1u ^ fg * 0x85EBCA77u ^ bg * 0xC2B2AE3Du;
+
+    return (h ^ (h >> 15)) & (GlyphBuckets - 1);
+}
+
+
+/******************************************************************************
+* Function Name  : glyphLookup
+* Description    : Sub for putGlyph, find or render a glyph in the cache
+* Input          : - c: character
+* Output         : None
+* Return         : 8x16 pixels in the current colors, 0 if the cache is off
+* Attention      : On a miss the least recently used glyph is replaced; not
+*                  used while several threads draw tiles
+*******************************************************************************/
+static const unsigned short *glyphLookup(unsigned char c)
+{
+    unsigned int h;
+    int n, *link;
+    GlyphTile *t;
+
+    if (TileWorker && Threads > 1) return 0;
+    if (GlyphCache == NULL)
+    {
+        if (GlyphCacheSize == 0 || LCD_GlyphCacheInit(GlyphCacheSize)) return 0;
+    }
+
+    h = glyphHash(c, GlyphFg, GlyphBg);
+    for (n = GlyphBucket[h]; n >= 0; n = GlyphCache[n].chain)
+    {
+        t = &GlyphCache[n];
+        if (t->ch == c && t->fg == GlyphFg && t->bg == GlyphBg && t->aa == GlyphAA)
+        {
+            if (n != GlyphNewest)
+            {
+                glyphUnlink(n);
+                glyphPushFront(n);
+            }
+            GlyphHits++;
+            return t->pix;
+        }
+    }
+
+    GlyphMisses++;
+    if (GlyphCacheUsed < GlyphCacheSize)
+    {
+        n = GlyphCacheUsed++;
+    } else {
+        n = GlyphOldest;
+        glyphUnlink(n);
+        t = &GlyphCache[n];
+        link = &GlyphBucket[glyphHash(t->ch, t->fg, t->bg)];
+        while (*link != n)
+            link = &GlyphCache[*link].chain;
+        *link = t->chain;
+    }
+    t = &GlyphCache[n];
+    t->ch = c;
+    t->fg = GlyphFg;
+    t->bg = GlyphBg;
+    t->aa = GlyphAA;
+    t->chain = GlyphBucket[h];
+    GlyphBucket[h] = n;
+    expandGlyph(t->pix, c);
+    glyphPushFront(n);
+    return t->pix;
+}
+
+
+/******************************************************************************
+* Function Name  : putGlyph
+* Description    : Sub for PutChar and LCD_Text, blit one 8x16 character
+* Input          : - x: Horizontal coordinate
+*                  - y: Vertical coordinate
+*                  - c: Displayed character, outside ' '..'~' shows blank
+* Output         : None
+* Return         : None
+* Attention      : Colors from setGlyphColors, clipped once per glyph, no
+*                  LCD_Invalidate
+*******************************************************************************/
+static void putGlyph(int x, int y, unsigned char c)
+{
+    const unsigned short *src;
+    unsigned short *p, tile[16 * 8];
+    int i, r0, r1, c0, c1;
+
+    if (c < 32 || c > 126) c = ' ';
+
+    r0 = y < Ctx.clip.y0 ? Ctx.clip.y0 - y : 0;
+    r1 = y + 16 > Ctx.clip.y1 + 1 ? Ctx.clip.y1 + 1 - y : 16;
+    c0 = x < Ctx.clip.x0 ? Ctx.clip.x0 - x : 0;
+    c1 = x + 8 > Ctx.clip.x1 + 1 ? Ctx.clip.x1 + 1 - x : 8;
+    if (r0 >= r1 || c0 >= c1) return;
+
+    src = glyphLookup(c);
+    if (src == NULL)
+    {
+        expandGlyph(tile, c);
+        src = tile;
+    }
+
+    p = BackBuffer.pixels + (y + r0) * BackBuffer.stride + x;
+    src += r0 * 8;
+    if (c0 == 0 && c1 == 8)
+    {
+        for (i = r0; i < r1; i++)
+        {
+            memcpy(p, src, 16);
+            p += BackBuffer.stride;
+            src += 8;
+        }
+    } else {
+        for (i = r0; i < r1; i++)
+        {
+            memcpy(p + c0, src + c0, (c1 - c0) * 2);
+            p += BackBuffer.stride;
+            src += 8;
+        }
+    }
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_Text
+* Description    : Displays the string
+* Input          : - Xpos: Horizontal coordinate
+*                  - Ypos: Vertical coordinate
+*		   - str: Displayed string
+*		   - charColor: Character color
+*		   - bkColor: Background color
+* Output         : None
+* Return         : None
+* Attention      : Wraps at the right edge of the screen, one markDirty per line
+*******************************************************************************/
+void LCD_Text(int Xpos, int Ypos, char *str, unsigned short Color, unsigned short bkColor)
+{
+    int x0, x, y, n, bx0, by0, bx1, by1;
+    DrawCmd *c;
+
+    if (Rec && *str != 0)
+    {
+        // the glyphs it will put, wrapped the same way
+        x = bx0 = bx1 = Xpos + Ctx.ox;
+        y = by0 = by1 = Ypos + Ctx.oy;
+        for (n = 0; str[n] != 0; n++)
+        {
+            if (x < bx0) bx0 = x;
+            if (x > bx1) bx1 = x;
+            if (y < by0) by0 = y;
+            if (y > by1) by1 = y;
+            if (x < BackBuffer.width - 8)
+            {
+                x += 8;
+                continue;
+            }
+            y = y < BackBuffer.height - 16 ? y + 16 : 0;
+            x = 0;
+        }
+        if ((c = cmdAdd(CMD_TEXT, bx0 - Ctx.ox, by0 - Ctx.oy, bx1 + 7 - Ctx.ox, by1 + 15 - Ctx.oy)) != NULL)
+        {
+            c->a[0] = Xpos;
+            c->a[1] = Ypos;
+            if ((c->a[2] = listText(Rec, str)) < 0) c->op = 0;
+            c->col = Color;
+            c->bcol = bkColor;
+            return;
+        }
+    }
+    Xpos += Ctx.ox;
+    Ypos += Ctx.oy;
+    x0 = Xpos;
+    setGlyphColors(Color, bkColor);
+    while ( *str != 0 )
+    {
+        putGlyph( Xpos, Ypos, *str++ );
+        if( Xpos < BackBuffer.width - 8 )
+        {
+            Xpos += 8;
+            continue;
+        }
+        markDirty(x0, Ypos, Xpos + 7, Ypos + 15);
+        if ( Ypos < BackBuffer.height - 16 )
+        {
+            Ypos += 16;
+        }
+        else
+        {
+            Ypos = 0;
+        }
+        Xpos = x0 = 0;
+    }
+    if (Xpos > x0) markDirty(x0, Ypos, Xpos - 1, Ypos + 15);
+}
+
+
+/******************************************************************************
+* Function Name  : sgn
+* Description    : return the sign of number
+* Input          : - nu: the number
+* Output         : None
+* Return         : 1 if > 0; -1 if < 0; 0 of = 0
+* Attention      : None
+*******************************************************************************/
+int sgn(int nu)
+{
+    if (nu > 0) return 1;
+    if (nu < 0) return -1;
+    if (nu == 0) return 0;
+
+    return 0;
+}
+
+
+/******************************************************************************
+* Function Name  : outCode
+* Description    : Sub for clipLine, where a point is against an area
+* Input          : - x, y: the point
+*                  - l, t, r, b: left, top, right and bottom of the area
+* Output         : None
+* Return         : 1 left, 2 right, 4 above, 8 below, 0 inside
+*******************************************************************************/
+static int outCode(double x, double y, double l, double t, double r, double b)
+{
+    return (x < l) | (x > r) << 1 | (y < t) << 2 | (y > b) << 3;
+}
+
+
+/******************************************************************************
+* Function Name  : clipLine
+* Description    : Sub for LCD_DrawLine, Cohen-Sutherland line clipping
+* Input          : - x1, y1: A point
+*                  - x2, y2: B point
+* Output         : the points moved onto the clip area, A stays the A side
+* Return         : 0 if nothing of the line is inside
+* Attention      : The area is grown by half a pixel so every pixel Bresenham
+*                  rounds into it is kept
+*******************************************************************************/
+static int clipLine(double *x1, double *y1, double *x2, double *y2)
+{
+    double l = Ctx.clip.x0 - 0.5, t = Ctx.clip.y0 - 0.5;
+    double r = Ctx.clip.x1 + 0.5, b = Ctx.clip.y1 + 0.5;
+    double x = 0, y = 0;
+    int c1, c2, c;
+
+    c1 = outCode(*x1, *y1, l, t, r, b);
+    c2 = outCode(*x2, *y2, l, t, r, b);
+    while (c1 | c2)
+    {
+        if (c1 & c2) return 0;
+
+        c = c1 ? c1 : c2;
+        if (c & 8) {
+            x = *x1 + (*x2 - *x1) * (b - *y1) / (*y2 - *y1);
+            y = b;
+        } else if (c & 4) {
+            x = *x1 + (*x2 - *x1) * (t - *y1) / (*y2 - *y1);
+            y = t;
+        } else if (c & 2) {
+            y = *y1 + (*y2 - *y1) * (r - *x1) / (*x2 - *x1);
+            x = r;
+        } else {
+            y = *y1 + (*y2 - *y1) * (l - *x1) / (*x2 - *x1);
+            x = l;
+        }
+        if (c == c1) {
+            *x1 = x;
+            *y1 = y;
+            c1 = outCode(x, y, l, t, r, b);
+        } else {
+            *x2 = x;
+            *y2 = y;
+            c2 = outCode(x, y, l, t, r, b);
+        }
+    }
+    return 1;
+}
+
+
+/******************************************************************************
+* Function Name  : wuLine
+* Description    : Sub for LCD_DrawLine, Wu's anti-aliased line
+* Input          : - x1, y1: A point
+*                  - x2, y2: B point
+*                  - col: Line color
+* Output         : None
+* Return         : None
+* Attention      : Screen coordinates. 16.16 fixed point, every step blends
+*                  the two pixels across the line; the major axis is cut to
+*                  the clip area first
+*******************************************************************************/
+static void wuLine(int x1, int y1, int x2, int y2, unsigned short col)
+{
+    long long pos, g;
+    int t, n, a, b, f;
+
+    if (abs(x2 - x1) >= abs(y2 - y1))
+    {
+        if (x1 > x2)
+        {
+            t = x1; x1 = x2; x2 = t;
+            t = y1; y1 = y2; y2 = t;
+        }
+        g = (long long)(y2 - y1) * 65536 / (x2 - x1);
+        a = x1 > Ctx.clip.x0 ? x1 : Ctx.clip.x0;
+        b = x2 < Ctx.clip.x1 ? x2 : Ctx.clip.x1;
+        pos = (long long)y1 * 65536 + g * (a - x1);
+        for (n = a; n <= b; n++, pos += g)
+        {
+            f = (int)(pos >> 11) & 31;
+            blendPixel(n, (int)(pos >> 16), col, 32 - f);
+            blendPixel(n, (int)(pos >> 16) + 1, col, f);
+        }
+    } else {
+        if (y1 > y2)
+        {
+            t = x1; x1 = x2; x2 = t;
+            t = y1; y1 = y2; y2 = t;
+        }
+        g = (long long)(x2 - x1) * 65536 / (y2 - y1);
+        a = y1 > Ctx.clip.y0 ? y1 : Ctx.clip.y0;
+        b = y2 < Ctx.clip.y1 ? y2 : Ctx.clip.y1;
+        pos = (long long)x1 * 65536 + g * (a - y1);
+        for (n = a; n <= b; n++, pos += g)
+        {
+            f = (int)(pos >> 11) & 31;
+            blendPixel((int)(pos >> 16), n, col, 32 - f);
+            blendPixel((int)(pos >> 16) + 1, n, col, f);
+        }
+    }
+    markDirty(x1 < x2 ? x1 : x2, y1 < y2 ? y1 : y2, (x1 > x2 ? x1 : x2) + 1, (y1 > y2 ? y1 : y2) + 1);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_DrawLine
+* Description    : Bresenham's line algorithm
+* Input          : - x1: A point line coordinates
+*                  - y1: A point column coordinates
+*                  - x2: B point line coordinates
+*                  - y2: B point column coordinates
+*                  - col: Line color
+* Output         : None
+* Return         : None
+* Attention      : Clipped with clipLine first, the steps left inside are
+*                  drawn without tests and give the same pixels as unclipped;
+*                  Wu's line in anti-aliased mode
+*******************************************************************************/
+void LCD_DrawLine(int x1, int y1, int x2, int y2, unsigned short col)
+{
+    double cx1, cy1, cx2, cy2;
+    int adx, ady, sx, sy, major, minor, len, n0, n1, n, acc, x, y, ex, ey, step;
+    unsigned short *p;
+    DrawCmd *c;
+
+    // one pixel more for the second pixel of Wu's line
+    if (Rec && (c = cmdAdd(CMD_LINE, (x1 < x2 ? x1 : x2) - 1, (y1 < y2 ? y1 : y2) - 1,
+                                 (x1 > x2 ? x1 : x2) + 1, (y1 > y2 ? y1 : y2) + 1)) != NULL)
+    {
+        c->a[0] = x1;
+        c->a[1] = y1;
+        c->a[2] = x2;
+        c->a[3] = y2;
+        c->col = col;
+        return;
+    }
+    // straight lines are a single span
+    if (y1 == y2)
+    {
+        LCD_HLine(x1, x2, y1, col);
+        return;
+    }
+    if (x1 == x2)
+    {
+        LCD_VLine(x1, y1, y2, col);
+        return;
+    }
+
+    x1 += Ctx.ox;
+    y1 += Ctx.oy;
+    x2 += Ctx.ox;
+    y2 += Ctx.oy;
+    if (Antialias)
+    {
+        wuLine(x1, y1, x2, y2, col);
+        return;
+    }
+    cx1 = x1;
+    cy1 = y1;
+    cx2 = x2;
+    cy2 = y2;
+    if (!clipLine(&cx1, &cy1, &cx2, &cy2)) return;
+
+    adx = abs(x2 - x1);
+    ady = abs(y2 - y1);
+    sx = x2 > x1 ? 1 : -1;
+    sy = y2 > y1 ? 1 : -1;
+    major = adx >= ady ? adx : ady;
+    minor = adx >= ady ? ady : adx;
+
+    // steps along the major axis left by the clip, one more each side for
+    // rounding, then exact: the steps inside are one run
+    len = major;
+    n0 = (int)(adx >= ady ? fabs(cx1 - x1) : fabs(cy1 - y1)) - 1;
+    n1 = (int)(adx >= ady ? fabs(cx2 - x1) : fabs(cy2 - y1)) + 2;
+    if (n0 < 0) n0 = 0;
+    if (n1 > len) n1 = len;
+    for (; n0 <= n1; n0++)
+    {
+        step = (int)(((long long)(major >> 1) + (long long)n0 * minor) / major);
+        x = x1 + sx * (adx >= ady ? n0 : step);
+        y = y1 + sy * (adx >= ady ? step : n0);
+        if (x >= Ctx.clip.x0 && x <= Ctx.clip.x1 && y >= Ctx.clip.y0 && y <= Ctx.clip.y1) break;
+    }
+    for (; n1 >= n0; n1--)
+    {
+        step = (int)(((long long)(major >> 1) + (long long)n1 * minor) / major);
+        ex = x1 + sx * (adx >= ady ? n1 : step);
+        ey = y1 + sy * (adx >= ady ? step : n1);
+        if (ex >= Ctx.clip.x0 && ex <= Ctx.clip.x1 && ey >= Ctx.clip.y0 && ey <= Ctx.clip.y1) break;
+    }
+    if (n0 > n1) return;
+
+    acc = (int)(((long long)(major >> 1) + (long long)n0 * minor) % major);
+    p = BackBuffer.pixels + y * BackBuffer.stride + x;
+    *p = col;
+    if (adx >= ady) {
+        for (n = n0; n < n1; n++){
+            acc += minor;
+            if (acc >= major){
+                acc -= major;
+                p += sy * BackBuffer.stride;
+            }
+            p += sx;
+            *p = col;
+        }
+    } else {
+        for (n = n0; n < n1; n++){
+            acc += minor;
+            if (acc >= major){
+                acc -= major;
+                p += sx;
+            }
+            p += sy * BackBuffer.stride;
+            *p = col;
+        }
+    }
+    markDirty(x < ex ? x : ex, y < ey ? y : ey, x > ex ? x : ex, y > ey ? y : ey);
+}
+
+
+/******************************************************************************
+* Function Name  : fillSpan
+* Description    : Sub for the span fills, write n pixels of the same color
+* Input          : - dst: first pixel
+*                  - col: color
+*                  - n: number of pixels
+* Output         : None
+* Return         : None
+* Attention      : Once dst is aligned the pixels are written with NEON, AVX2
+*                  or SSE2 stores when compiled for them, else 4 at a time
+*******************************************************************************/
+static void fillSpan(unsigned short *dst, unsigned short col, int n)
+{
+    uint64_t pat = col * 0x0001000100010001ULL;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint16x8_t v = vdupq_n_u16(col);
+
+    while (n > 0 && ((uintptr_t)dst & 15))
+    {
+        *dst++ = col;
+        n--;
+    }
+    while (n >= 32)
+    {
+        vst1q_u16(dst, v);
+        vst1q_u16(dst + 8, v);
+        vst1q_u16(dst + 16, v);
+        vst1q_u16(dst + 24, v);
+        dst += 32;
+        n -= 32;
+    }
+    while (n >= 8)
+    {
+        vst1q_u16(dst, v);
+        dst += 8;
+        n -= 8;
+    }
+#elif defined(__AVX2__)
+    __m256i v = _mm256_set1_epi16((short)col);
+
+    while (n > 0 && ((uintptr_t)dst & 31))
+    {
+        *dst++ = col;
+        n--;
+    }
+    while (n >= 64)
+    {
+        _mm256_store_si256((__m256i*)dst, v);
+        _mm256_store_si256((__m256i*)(dst + 16), v);
+        _mm256_store_si256((__m256i*)(dst + 32), v);
+        _mm256_store_si256((__m256i*)(dst + 48), v);
+        dst += 64;
+        n -= 64;
+    }
+    while (n >= 16)
+    {
+        _mm256_store_si256((__m256i*)dst, v);
+        dst += 16;
+        n -= 16;
+    }
+#elif defined(__SSE2__)
+    __m128i v = _mm_set1_epi16((short)col);
+
+    while (n > 0 && ((uintptr_t)dst & 15))
+    {
+        *dst++ = col;
+        n--;
+    }
+    while (n >= 32)
+    {
+        _mm_store_si128((__m128i*)dst, v);
+        _mm_store_si128((__m128i*)(dst + 8), v);
+        _mm_store_si128((__m128i*)(dst + 16), v);
+        _mm_store_si128((__m128i*)(dst + 24), v);
+        dst += 32;
+        n -= 32;
+    }
+#else
+    while (n > 0 && ((uintptr_t)dst & 7))
+    {
+        *dst++ = col;
+        n--;
+    }
+    while (n >= 16)
+    {
+        memcpy(dst, &pat, 8);
+        memcpy(dst + 4, &pat, 8);
+        memcpy(dst + 8, &pat, 8);
+        memcpy(dst + 12, &pat, 8);
+        dst += 16;
+        n -= 16;
+    }
+#endif
+    while (n >= 4)
+    {
+        memcpy(dst, &pat, 8);
+        dst += 4;
+        n -= 4;
+    }
+    while (n-- > 0)
+        *dst++ = col;
+}
+
+
+/******************************************************************************
+* Function Name  : fillRect16
+* Description    : Sub for LCD_FillRect and LCD_ClearRect
+* Input          : - s: target surface
+*                  - x0, y0: upper left corner
+*                  - x1, y1: lower right corner (inclusive)
+*                  - col: color
+* Output         : None
+* Return         : 1 if something was filled, the clipped area is in r
+* Attention      : Rows that cover the whole stride are filled as one span
+*******************************************************************************/
+static int fillRect16(Surface *s, int x0, int y0, int x1, int y1, unsigned short col, Rect *r)
+{
+    int y, w;
+    unsigned short *p;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= s->width) x1 = s->width - 1;
+    if (y1 >= s->height) y1 = s->height - 1;
+    if (x0 > x1 || y0 > y1) return 0;
+
+    w = x1 - x0 + 1;
+    p = s->pixels + y0 * s->stride + x0;
+    if (w == s->stride)
+    {
+        fillSpan(p, col, w * (y1 - y0 + 1));
+    } else {
+        for (y = y0; y <= y1; y++)
+        {
+            fillSpan(p, col, w);
+            p += s->stride;
+        }
+    }
+    r->x0 = x0;
+    r->y0 = y0;
+    r->x1 = x1;
+    r->y1 = y1;
+    return 1;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_HLine
+* Description    : Draw a horizontal line
+* Input          : - x0: first column
+*                  - x1: last column
+*                  - y: line
+*                  - col: Line color
+* Output         : None
+* Return         : None
+* Attention      : Clipped once to the clip area, then filled as one span
+******************************************************************************/
+void LCD_HLine(int x0, int x1, int y, unsigned short col)
+{
+    int t;
+    DrawCmd *c;
+
+    if (Rec && (c = cmdAdd(CMD_HLINE, x0 < x1 ? x0 : x1, y, x0 > x1 ? x0 : x1, y)) != NULL)
+    {
+        c->a[0] = x0;
+        c->a[1] = x1;
+        c->a[2] = y;
+        c->col = col;
+        return;
+    }
+    if (x0 > x1)
+    {
+        t = x0;
+        x0 = x1;
+        x1 = t;
+    }
+    x0 += Ctx.ox;
+    x1 += Ctx.ox;
+    y += Ctx.oy;
+    if (y < Ctx.clip.y0 || y > Ctx.clip.y1) return;
+    if (x0 < Ctx.clip.x0) x0 = Ctx.clip.x0;
+    if (x1 > Ctx.clip.x1) x1 = Ctx.clip.x1;
+    if (x0 > x1) return;
+
+    fillSpan(BackBuffer.pixels + y * BackBuffer.stride + x0, col, x1 - x0 + 1);
+    markDirty(x0, y, x1, y);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_VLine
+* Description    : Draw a vertical line
+* Input          : - x: column
+*                  - y0: first line
+*                  - y1: last line
+*                  - col: Line color
+* Output         : None
+* Return         : None
+* Attention      : Clipped once to the clip area
+******************************************************************************/
+void LCD_VLine(int x, int y0, int y1, unsigned short col)
+{
+    int t;
+    unsigned short *p;
+    DrawCmd *c;
+
+    if (Rec && (c = cmdAdd(CMD_VLINE, x, y0 < y1 ? y0 : y1, x, y0 > y1 ? y0 : y1)) != NULL)
+    {
+        c->a[0] = x;
+        c->a[1] = y0;
+        c->a[2] = y1;
+        c->col = col;
+        return;
+    }
+    if (y0 > y1)
+    {
+        t = y0;
+        y0 = y1;
+        y1 = t;
+    }
+    x += Ctx.ox;
+    y0 += Ctx.oy;
+    y1 += Ctx.oy;
+    if (x < Ctx.clip.x0 || x > Ctx.clip.x1) return;
+    if (y0 < Ctx.clip.y0) y0 = Ctx.clip.y0;
+    if (y1 > Ctx.clip.y1) y1 = Ctx.clip.y1;
+    if (y0 > y1) return;
+
+    p = BackBuffer.pixels + y0 * BackBuffer.stride + x;
+    for (t = y0; t <= y1; t++)
+    {
+        *p = col;
+        p += BackBuffer.stride;
+    }
+    markDirty(x, y0, x, y1);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_FillRect
+* Description    : Fill a rectangle
+* Input          : - x0: upper left corner
+*                  - y0: upper left corner
+*                  - x1: lower right corner (inclusive)
+*                  - y1: lower right corner (inclusive)
+*                  - col: fill color
+* Output         : None
+* Return         : None
+* Attention      : Clipped once to the clip area, then filled row by row
+******************************************************************************/
+void LCD_FillRect(int x0, int y0, int x1, int y1, unsigned short col)
+{
+    Rect r;
+    DrawCmd *c;
+
+    if (Rec && (c = cmdAdd(CMD_FILL, x0, y0, x1, y1)) != NULL)
+    {
+        c->a[0] = x0;
+        c->a[1] = y0;
+        c->a[2] = x1;
+        c->a[3] = y1;
+        c->col = col;
+        return;
+    }
+    x0 += Ctx.ox;
+    y0 += Ctx.oy;
+    x1 += Ctx.ox;
+    y1 += Ctx.oy;
+    if (x0 < Ctx.clip.x0) x0 = Ctx.clip.x0;
+    if (y0 < Ctx.clip.y0) y0 = Ctx.clip.y0;
+    if (x1 > Ctx.clip.x1) x1 = Ctx.clip.x1;
+    if (y1 > Ctx.clip.y1) y1 = Ctx.clip.y1;
+    if (fillRect16(&BackBuffer, x0, y0, x1, y1, col, &r))
+        markDirty(r.x0, r.y0, r.x1, r.y1);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_ClearRect
+* Description    : Fill part of the screen as the specified color
+* Input          : - x0: upper left corner
+*                  - y0: upper left corner
+*                  - x1: lower right corner (inclusive)
+*                  - y1: lower right corner (inclusive)
+*                  - Color: Screen Color
+* Output         : None
+* Return         : None
+* Attention      : Partial LCD_Clear, same fill as LCD_FillRect
+******************************************************************************/
+void LCD_ClearRect(int x0, int y0, int x1, int y1, unsigned short Color)
+{
+    LCD_FillRect(x0, y0, x1, y1, Color);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_SetClip
+* Description    : Limit drawing to an area of the screen
+* Input          : - x0: upper left corner
+*                  - y0: upper left corner
+*                  - x1: lower right corner (inclusive)
+*                  - y1: lower right corner (inclusive)
+* Output         : None
+* Return         : None
+* Attention      : Relative to the origin, cut to the screen; an empty area
+*                  draws nothing until LCD_ResetClip
+******************************************************************************/
+void LCD_SetClip(int x0, int y0, int x1, int y1)
+{
+    x0 += Ctx.ox;
+    y0 += Ctx.oy;
+    x1 += Ctx.ox;
+    y1 += Ctx.oy;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= BackBuffer.width) x1 = BackBuffer.width - 1;
+    if (y1 >= BackBuffer.height) y1 = BackBuffer.height - 1;
+    if (x0 > x1 || y0 > y1)
+    {
+        // empty, x1 < x0 fails every test
+        x0 = y0 = 0;
+        x1 = y1 = -1;
+    }
+    Ctx.clip.x0 = x0;
+    Ctx.clip.y0 = y0;
+    Ctx.clip.x1 = x1;
+    Ctx.clip.y1 = y1;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_ResetClip
+* Description    : Allow drawing on the whole screen again
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : None
+******************************************************************************/
+void LCD_ResetClip(void)
+{
+    Ctx.clip.x0 = 0;
+    Ctx.clip.y0 = 0;
+    Ctx.clip.x1 = BackBuffer.width - 1;
+    Ctx.clip.y1 = BackBuffer.height - 1;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_SetOrigin
+* Description    : Move the coordinate origin of the primitives
+* Input          : - x, y: screen position of 0, 0
+* Output         : None
+* Return         : None
+* Attention      : The clip area stays where it is on the screen
+******************************************************************************/
+void LCD_SetOrigin(int x, int y)
+{
+    Ctx.ox = x;
+    Ctx.oy = y;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_GetContext, LCD_SetContext
+* Description    : Save and restore the clip area and origin
+* Input          : - c: context
+* Output         : - c: context
+* Return         : None
+* Attention      : For code that draws in a sub-region and must put the
+*                  caller's context back
+******************************************************************************/
+void LCD_GetContext(DrawContext *c)
+{
+    *c = Ctx;
+}
+
+void LCD_SetContext(const DrawContext *c)
+{
+    Ctx = *c;
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_DrawBox
+* Description    : Multiple line  makes box
+* Input          : - x1: A point line coordinates upper left corner
+*                  - y1: A point column coordinates
+*                  - x2: B point line coordinates lower right corner
+*                  - y2: B point column coordinates
+*                  - col: Line color
+* Output         : None
+* Return         : None
+******************************************************************************/
+void LCD_DrawBox(int x0, int y0, int x1, int y1 , unsigned short col, int fcol )
+{
+    LCD_HLine(x0, x1, y0, col);
+    LCD_VLine(x1, y0, y1, col);
+    LCD_VLine(x0, y0, y1, col);
+    LCD_HLine(x0, x1, y1, col);
+
+    if  (fcol!=-1)
+    {
+        LCD_FillRect(x0 + 1, y0 + 1, x1 - 1, y1 - 1, (unsigned short)fcol);
+    }
+}
+
+/******************************************************************************
+* Function Name  : circleSpans
+* Description    : Sub for the round primitives, half width of every row of a
+*                  midpoint circle into CircleSpan
+* Input          : - r: radius
+* Output         : None
+* Return         : 0 ok, -1 out of memory
+* Attention      : O(r) integer steps, the widths are the extent of the
+*                  outline so fills and outlines meet exactly
+******************************************************************************/
+static int circleSpans(int r)
+{
+    int x = 0, y = r, p = 1 - r;
+    int *w;
+
+    if (r == CircleSpanR) return 0;
+    if (r + 2 > CircleSpanMax)
+    {
+        if ((w = (int*)realloc(CircleSpan, (r + 2) * sizeof(int))) == NULL) return -1;
+        CircleSpan = w;
+        CircleSpanMax = r + 2;
+    }
+    w = CircleSpan;
+    for (x = 0; x < r + 2; x++)
+        w[x] = -1;
+
+    x = 0;
+    w[0] = r;
+    w[r] = 0;
+    while (x < y)
+    {
+        x++;
+
+        if (p < 0)
+            p = p + 2 * x + 1;
+        else
+        {
+            y--;
+            p = p + 2 * (x-y) + 1;
+        }
+        // both octants of the point, row x is y wide and row y x wide
+        if (w[x] < y) w[x] = y;
+        if (w[y] < x) w[y] = x;
+    }
+    CircleSpanR = r;
+    return 0;
+}
+
+
+/******************************************************************************
+* Function Name  : spanClip
+* Description    : Sub for the round primitives, one clipped horizontal span
+* Input          : - y: line
+*                  - x0, x1: first and last column
+*                  - col: color
+* Output         : None
+* Return         : None
+* Attention      : Screen coordinates, does not mark the area dirty
+******************************************************************************/
+static void spanClip(int y, int x0, int x1, unsigned short col)
+{
+    if (y < Ctx.clip.y0 || y > Ctx.clip.y1) return;
+    if (x0 < Ctx.clip.x0) x0 = Ctx.clip.x0;
+    if (x1 > Ctx.clip.x1) x1 = Ctx.clip.x1;
+    if (x0 > x1) return;
+    fillSpan(BackBuffer.pixels + y * BackBuffer.stride + x0, col, x1 - x0 + 1);
+}
+
+
+/******************************************************************************
+* Function Name  : roundShape
+* Description    : Sub for the round primitives, fill or outline a box with
+*                  round corners, a circle when the box is 2r wide and high
+* Input          : - x0, y0: upper left corner
+*                  - x1, y1: lower right corner
+*                  - r: corner radius, CircleSpan must hold it
+*                  - col: color
+*                  - outline: 1 draws the outline, 0 fills
+* Output         : None
+* Return         : None
+* Attention      : Screen coordinates. Every row is one span (two for the
+*                  outline sides), the corners are the quarters of CircleSpan
+******************************************************************************/
+static void roundShape(int x0, int y0, int x1, int y1, int r, unsigned short col, int outline)
+{
+    int cx0 = x0 + r, cy0 = y0 + r, cx1 = x1 - r, cy1 = y1 - r;
+    int *w = CircleSpan;
+    int dy, y, lo, ya, yb;
+
+    // corner rows above cy0 and below cy1
+    for (dy = 1; dy < r; dy++)
+    {
+        if (outline)
+        {
+            lo = w[dy + 1] + 1 < w[dy] ? w[dy + 1] + 1 : w[dy];
+            spanClip(cy0 - dy, cx0 - w[dy], cx0 - lo, col);
+            spanClip(cy0 - dy, cx1 + lo, cx1 + w[dy], col);
+            spanClip(cy1 + dy, cx0 - w[dy], cx0 - lo, col);
+            spanClip(cy1 + dy, cx1 + lo, cx1 + w[dy], col);
+        } else {
+            spanClip(cy0 - dy, cx0 - w[dy], cx1 + w[dy], col);
+            spanClip(cy1 + dy, cx0 - w[dy], cx1 + w[dy], col);
+        }
+    }
+
+    // straight sides from cy0 to cy1, cut to the clip area first
+    ya = cy0 > Ctx.clip.y0 ? cy0 : Ctx.clip.y0;
+    yb = cy1 < Ctx.clip.y1 ? cy1 : Ctx.clip.y1;
+    lo = w[1] + 1 < w[0] ? w[1] + 1 : w[0];
+    for (y = ya; y <= yb; y++)
+    {
+        if (outline)
+        {
+            spanClip(y, cx0 - w[0], cx0 - lo, col);
+            spanClip(y, cx1 + lo, cx1 + w[0], col);
+        } else {
+            spanClip(y, cx0 - w[0], cx1 + w[0], col);
+        }
+    }
+
+    // top and bottom rows are whole in both modes
+    if (r > 0 || outline)
+    {
+        spanClip(cy0 - r, cx0 - w[r], cx1 + w[r], col);
+        if (cy1 + r != cy0 - r) spanClip(cy1 + r, cx0 - w[r], cx1 + w[r], col);
+    }
+    markDirty(x0, y0, x1, y1);
+}
+
+
+/******************************************************************************
+* Function Name  : isqrt
+* Description    : Integer square root
+* Input          : - v: value
+* Output         : None
+* Return         : the root rounded down
+* Attention      : One bit per step, no floating point
+******************************************************************************/
+static unsigned long isqrt(unsigned long long v)
+{
+    unsigned long long r = 0, b = 1ULL << 62;
+
+    while (b > v)
+        b >>= 2;
+    while (b)
+    {
+        if (v >= r + b)
+        {
+            v -= r + b;
+            r = (r >> 1) + b;
+        } else {
+            r >>= 1;
+        }
+        b >>= 2;
+    }
+    return (unsigned long)r;
+}
+
+
+/******************************************************************************
+* Function Name  : wuPoints
+* Description    : Sub for wuCircle, blend a point in all eight octants
+* Input          : - xc, yc: center
+*                  - x, y: point of the first octant
+*                  - col: Line color
+*                  - a: coverage, 0..32
+* Output         : None
+* Return         : None
+* Attention      : Points on an axis or the diagonal are blended once
+******************************************************************************/
+static void wuPoints(int xc, int yc, int x, int y, unsigned short col, int a)
+{
+    blendPixel(xc + x, yc + y, col, a);
+    if (y) blendPixel(xc + x, yc - y, col, a);
+    if (x) blendPixel(xc - x, yc + y, col, a);
+    if (x && y) blendPixel(xc - x, yc - y, col, a);
+    if (x == y) return;
+    blendPixel(xc + y, yc + x, col, a);
+    if (x) blendPixel(xc + y, yc - x, col, a);
+    if (y) blendPixel(xc - y, yc + x, col, a);
+    if (x && y) blendPixel(xc - y, yc - x, col, a);
+}
+
+
+/******************************************************************************
+* Function Name  : wuCircle
+* Description    : Sub for LCD_DrawCircle, anti-aliased circle
+* Input          : - xc, yc: center
+*                  - r: radius
+*                  - col: Line color
+* Output         : None
+* Return         : None
+* Attention      : Screen coordinates. Every column of the first octant gets
+*                  its exact height in 8 bit fixed point from isqrt and
+*                  blends the two pixels across it
+******************************************************************************/
+static void wuCircle(int xc, int yc, int r, unsigned short col)
+{
+    long long rr = (long long)r * r;
+    unsigned long h;
+    int x, y, f;
+
+    for (x = 0; ; x++)
+    {
+        h = isqrt((unsigned long long)(rr - (long long)x * x) << 16);
+        y = (int)(h >> 8);
+        if (x > y) break;
+        f = (int)(h >> 3) & 31;
+        wuPoints(xc, yc, x, y, col, 32 - f);
+        if (y + 1 > x) wuPoints(xc, yc, x, y + 1, col, f);
+    }
+    markDirty(xc - r, yc - r, xc + r, yc + r);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_DrawCircle
+* Description    : Draw a circle
+* Input          : - xc: A point line coordinates center
+*                  - yc: A point column coordinates center
+*                  - r: radius of circle
+*                  - col: Line color
+* Output         : None
+* Return         : None
+* Attention      : Drawn as spans of the midpoint circle, clipped per row;
+*                  wuCircle in anti-aliased mode
+******************************************************************************/
+void LCD_DrawCircle(int xc, int yc, int r, unsigned short col)
+{
+    DrawCmd *c;
+
+    if (r < 0) r = -r;
+    if (Rec && (c = cmdAdd(CMD_CIRCLE, xc - r - 1, yc - r - 1, xc + r + 1, yc + r + 1)) != NULL)
+    {
+        c->a[0] = xc;
+        c->a[1] = yc;
+        c->a[2] = r;
+        c->col = col;
+        return;
+    }
+    xc += Ctx.ox;
+    yc += Ctx.oy;
+    if (xc + r < Ctx.clip.x0 || xc - r > Ctx.clip.x1 || yc + r < Ctx.clip.y0 || yc - r > Ctx.clip.y1) return;
+    if (Antialias)
+    {
+        wuCircle(xc, yc, r, col);
+        return;
+    }
+    if (circleSpans(r) == -1) return;
+    roundShape(xc - r, yc - r, xc + r, yc + r, r, col, 1);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_DrawCircleFill
+* Description    : Draw a circle filled
+* Input          : - xc: A point line coordinates center
+*                  - yc: A point column coordinates center
+*                  - r: radius of circle
+*                  - bcol: border color
+*                  - col: fill color
+* Output         : None
+* Return         : None
+* Attention      : One span per row from the integer midpoint circle, the
+*                  fill covers the outline of LCD_DrawCircle exactly. In
+*                  anti-aliased mode the rows end inside the exact circle
+*                  and wuCircle blends the edge in bcol
+******************************************************************************/
+void LCD_DrawCircleFill(int x, int y, int r, unsigned short bcol, unsigned short col) {
+    int dy, w;
+    DrawCmd *c;
+
+    /* Ensure radius is positive */
+    if (r < 0) {
+        r = -r;
+    }
+    if (Rec && (c = cmdAdd(CMD_CIRCLEFILL, x - r - 1, y - r - 1, x + r + 1, y + r + 1)) != NULL)
+    {
+        c->a[0] = x;
+        c->a[1] = y;
+        c->a[2] = r;
+        c->bcol = bcol;
+        c->col = col;
+        return;
+    }
+    x += Ctx.ox;
+    y += Ctx.oy;
+    if (x + r < Ctx.clip.x0 || x - r > Ctx.clip.x1 || y + r < Ctx.clip.y0 || y - r > Ctx.clip.y1) return;
+    if (Antialias)
+    {
+        for (dy = 0; dy <= r; dy++)
+        {
+            w = (int)isqrt((long long)r * r - (long long)dy * dy);
+            spanClip(y + dy, x - w, x + w, col);
+            if (dy) spanClip(y - dy, x - w, x + w, col);
+        }
+        wuCircle(x, y, r, bcol);
+        return;
+    }
+    if (circleSpans(r) == -1) return;
+
+    roundShape(x - r, y - r, x + r, y + r, r, col, 0);
+    if (col != bcol) roundShape(x - r, y - r, x + r, y + r, r, bcol, 1);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_DrawRoundBox
+* Description    : Box with round corners
+* Input          : - x0, y0: upper left corner
+*                  - x1, y1: lower right corner
+*                  - r: corner radius, cut to half the width and height
+*                  - col: Line color
+*                  - fcol: fill color -1 means no fill
+* Output         : None
+* Return         : None
+* Attention      : r 0 is LCD_DrawBox
+******************************************************************************/
+void LCD_DrawRoundBox(int x0, int y0, int x1, int y1, int r, unsigned short col, int fcol)
+{
+    int t;
+    DrawCmd *c;
+
+    if (x0 > x1)
+    {
+        t = x0;
+        x0 = x1;
+        x1 = t;
+    }
+    if (y0 > y1)
+    {
+        t = y0;
+        y0 = y1;
+        y1 = t;
+    }
+    if (Rec && (c = cmdAdd(CMD_ROUNDBOX, x0, y0, x1, y1)) != NULL)
+    {
+        c->a[0] = x0;
+        c->a[1] = y0;
+        c->a[2] = x1;
+        c->a[3] = y1;
+        c->a[4] = r;
+        c->a[5] = fcol;
+        c->col = col;
+        return;
+    }
+    x0 += Ctx.ox;
+    y0 += Ctx.oy;
+    x1 += Ctx.ox;
+    y1 += Ctx.oy;
+    if (x1 < Ctx.clip.x0 || x0 > Ctx.clip.x1 || y1 < Ctx.clip.y0 || y0 > Ctx.clip.y1) return;
+    if (r < 0) r = 0;
+    if (r > (x1 - x0) / 2) r = (x1 - x0) / 2;
+    if (r > (y1 - y0) / 2) r = (y1 - y0) / 2;
+    if (circleSpans(r) == -1) return;
+
+    if (fcol != -1) roundShape(x0, y0, x1, y1, r, (unsigned short)fcol, 0);
+    roundShape(x0, y0, x1, y1, r, col, 1);
+}
+
+
+/******************************************************************************
+* Function Name  : LCD_DrawArc
+* Description    : Draw part of a circle
+* Input          : - xc: A point line coordinates center
+*                  - yc: A point column coordinates center
+*                  - r: radius of circle
+*                  - start: first angle in degrees, 0 is right of the center
+*                  - end: last angle in degrees, clockwise from start
+*                  - col: Line color
+* Output         : None
+* Return         : None
+* Attention      : The pixels of the LCD_DrawCircle outline between the two
+*                  angles; a sweep of 360 or more is the whole circle
+******************************************************************************/
+void LCD_DrawArc(int xc, int yc, int r, int start, int end, unsigned short col)
+{
+    int sweep, dy, dx, lo, q, px, py;
+    long sx, sy, ex, ey, cs, ce;
+    int *w;
+    DrawCmd *c;
+
+    if (r < 0) r = -r;
+    if (Rec && (c = cmdAdd(CMD_ARC, xc - r - 1, yc - r - 1, xc + r + 1, yc + r + 1)) != NULL)
+    {
+        c->a[0] = xc;
+        c->a[1] = yc;
+        c->a[2] = r;
+        c->a[3] = start;
+        c->a[4] = end;
+        c->col = col;
+        return;
+    }
+    sweep = end - start;
+    if (sweep >= 360 || sweep <= -360)
+    {
+        LCD_DrawCircle(xc, yc, r, col);
+        return;
+    }
+    if (sweep < 0) sweep += 360;
+    start %= 360;
+    if (start < 0) start += 360;
+
+    xc += Ctx.ox;
+    yc += Ctx.oy;
+    if (xc + r < Ctx.clip.x0 || xc - r > Ctx.clip.x1 || yc + r < Ctx.clip.y0 || yc - r > Ctx.clip.y1) return;
+    if (circleSpans(r) == -1) return;
+    w = CircleSpan;
+
+    // unit vectors of both ends, y is down so clockwise is positive
+    sx = lround(cos(start * M_PI / 180) * 4096);
+    sy = lround(sin(start * M_PI / 180) * 4096);
+    ex = lround(cos((start + sweep) * M_PI / 180) * 4096);
+    ey = lround(sin((start + sweep) * M_PI / 180) * 4096);
+
+    for (dy = 0; dy <= r; dy++)
+    {
+        lo = w[dy + 1] + 1 < w[dy] ? w[dy + 1] + 1 : w[dy];
+        for (dx = lo; dx <= w[dy]; dx++)
+        {
+            for (q = 0; q < 4; q++)
+            {
+                px = q & 1 ? -dx : dx;
+                py = q & 2 ? -dy : dy;
+                cs = sx * py - sy * px;
+                ce = px * ey - py * ex;
+                // a narrow sweep must not take the opposite ray as well
+                if (sweep <= 180 ? cs >= 0 && ce >= 0 && (sweep >= 90 || sx * px + sy * py > 0) : cs >= 0 || ce >= 0)
+                    setPixel(xc + px, yc + py, col);
+            }
+        }
+    }
+    markDirty(xc - r, yc - r, xc + r, yc + r);
+}
+
+
+/*******************************************************************************
+* Function Name  : TP_GetAdXY
+* Description    : Read ADS7843 ADC value of X + Y + channel
+* Input          : None
+* Output         : - x, y: raw position of the next touch down or move
+* Return         : None
+* Attention	 	 : Blocks until the finger is on the panel; after a read
+*                  error or the end of a replay the last position
+*******************************************************************************/
+void TP_GetAdXY(int *x,int *y)
+{
+    TouchEvent e;
+
+    while (1)
+    {
+        while (!TP_GetTouch(&e))
+        {
+            if (TP_Read() < 0) {
+                *x = TouchX;
+                *y = TouchY;
+                return;
+            }
+        }
+        if (e.type != TOUCH_UP) break;
+    }
+    *x = e.x;
+    *y = e.y;
+}
+
+
+/*******************************************************************************
+* Function Name  : TP_Read
+* Description    : Read the pointing device once and queue the touch events
+*                  of every complete EV_SYN frame
+* Input          : None
+* Output         : None
+* Return         : events queued, -1 read error or end of a replay
+* Attention      : Blocks while nothing can be read. A frame, even an
+*                  event, may end in the next read. Allocates nothing
+*******************************************************************************/
+int TP_Read(void)
+{
+    const struct input_event *e;
+    int n, bytes, queued = 0;
+
+    bytes = read(fd, (char*)TouchRaw + TouchRawBytes, sizeof(TouchRaw) - TouchRawBytes);
+    if (bytes == 0) {
+        // the end of a replay
+        TouchEnded = 1;
+        return -1;
+    }
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        printf("Error reading\n");
+        return -1;
+    }
+
+    bytes += TouchRawBytes;
+    n = bytes / sizeof(struct input_event);
+    if (n > 0) TouchTime = TouchRaw[n - 1].time;
+    if (TouchLog) tpLog(TouchRaw, n);
+    for (e = TouchRaw; e < TouchRaw + n; e++)
+        queued += tpEvent(e);
+
+    // part of an event waits for the rest
+    TouchRawBytes = bytes - n * sizeof(struct input_event);
+    memmove(TouchRaw, TouchRaw + n, TouchRawBytes);
+    return queued;
+}
+
+
+/*******************************************************************************
+* Function Name  : tpEvent
+* Description    : Sub for TP_Read, one step of the frame assembly
+* Input          : - e: the event
+* Output         : None
+* Return         : events queued
+* Attention      : After SYN_DROPPED everything up to the next SYN_REPORT
+*                  is incomplete, the state is read back from the device
+*******************************************************************************/
+static int tpEvent(const struct input_event *e)
+{
+    if (e->type == EV_SYN && e->code == SYN_DROPPED) {
+        TouchDropping = 1;
+        return 0;
+    }
+    if (e->type == EV_SYN && e->code == SYN_REPORT) {
+        if (TouchDropping) tpResync();
+        TouchDropping = 0;
+        return tpFrame(&e->time);
+    }
+    if (TouchDropping) return 0;
+
+    if (e->type == EV_KEY && e->code == BTN_TOUCH) {
+        FrameDown = e->value != 0;
+    } else if (e->type == EV_ABS) {
+        if (e->code == ABS_X) FrameX = e->value;
+        if (e->code == ABS_Y) FrameY = e->value;
+        if (e->code == ABS_PRESSURE) FrameP = e->value;
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function Name  : tpResync
+* Description    : Sub for tpEvent, read the state after SYN_DROPPED
+* Input          : None
+* Output         : None
+* Return         : None
+* Attention      : A replay cannot be asked, the state stays as it was
+*******************************************************************************/
+static void tpResync(void)
+{
+    struct input_absinfo a;
+    unsigned long keys[NBITS(KEY_MAX)];
+
+    if (ioctl(fd, EVIOCGABS(ABS_X), &a) == 0) FrameX = a.value;
+    if (ioctl(fd, EVIOCGABS(ABS_Y), &a) == 0) FrameY = a.value;
+    if (ioctl(fd, EVIOCGABS(ABS_PRESSURE), &a) == 0) FrameP = a.value;
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) >= 0) FrameDown = test_bit(BTN_TOUCH, keys);
+}
+
+
+/*******************************************************************************
+* Function Name  : tpFrame
+* Description    : Sub for tpEvent, queue a complete frame
+* Input          : - t: time of its SYN_REPORT
+* Output         : None
+* Return         : events queued
+* Attention      : Every frame with the finger on the panel is a down or a
+*                  move, the kernel sends none while nothing changes. A full
+*                  ring drops the event; TouchDown is what was queued so
+*                  downs and ups stay paired. One producer, TouchHead is
+*                  published after the event is written
+*******************************************************************************/
+static int tpFrame(const struct timeval *t)
+{
+    TouchEvent *e;
+    unsigned int head, tail;
+    int type = 0;
+
+    if (FrameDown && !TouchDown) type = TOUCH_DOWN;
+    else if (!FrameDown && TouchDown) type = TOUCH_UP;
+    else if (FrameDown) type = TOUCH_MOVE;
+    TouchX = FrameX;
+    TouchY = FrameY;
+    TouchP = FrameP;
+    if (type == 0) return 0;
+
+    // moves leave room for a down and an up
+    head = TouchHead;
+    tail = __atomic_load_n(&TouchTail, __ATOMIC_ACQUIRE);
+    if (head - tail > (type == TOUCH_MOVE ? TOUCH_RING - 3 : TOUCH_RING - 1)) {
+        TouchLost++;
+        return 0;
+    }
+    TouchDown = FrameDown;
+    e = &TouchRing[head % TOUCH_RING];
+    e->type = type;
+    e->x = TouchX;
+    e->y = TouchY;
+    e->pressure = TouchP;
+    e->time = *t;
+    __atomic_store_n(&TouchHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/*******************************************************************************
+* Function Name  : TP_GetTouch
+* Description    : Take the next touch event queued by TP_Read
+* Input          : None
+* Output         : - e: TOUCH_DOWN, TOUCH_MOVE or TOUCH_UP, raw position,
+*                    pressure and time of the frame
+* Return         : 1 an event, 0 none
+* Attention      : Does not read the device. A move followed by another
+*                  move is stale and skipped, downs and ups are all given.
+*                  TP_Read may run in another thread, one consumer
+*******************************************************************************/
+int TP_GetTouch(TouchEvent *e)
+{
+    unsigned int head, tail = TouchTail;
+
+    head = __atomic_load_n(&TouchHead, __ATOMIC_ACQUIRE);
+    if (tail == head) return 0;
+    while (head - tail > 1 && TouchRing[tail % TOUCH_RING].type == TOUCH_MOVE &&
+           TouchRing[(tail + 1) % TOUCH_RING].type == TOUCH_MOVE)
+    {
+        tail++;
+        TouchStale++;
+    }
+    *e = TouchRing[tail % TOUCH_RING];
+    __atomic_store_n(&TouchTail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+
+/*******************************************************************************
+* Function Name  : TP_DrawPoint
+* Description    : Draw point Must have a LCD driver
+* Input          : - Xpos: Row Coordinate
+*                  - Ypos: Line Coordinate
+* Output         : None
+* Return         : None
+* Attention	 	 : None
+*******************************************************************************/
+void TP_DrawPoint(unsigned short Xpos,unsigned short Ypos)
+{
+    LCD_SetPoint(Xpos,Ypos,0xf800);     /* Center point */
+    LCD_SetPoint(Xpos+1,Ypos,0xf800);
+    LCD_SetPoint(Xpos,Ypos+1,0xf800);
+    LCD_SetPoint(Xpos+1,Ypos+1,0xf800);
+}
+
+
+/*******************************************************************************
+* Function Name  : DrawCross
+* Description    : specified coordinates painting crosshairs
+* Input          : - Xpos: Row Coordinate
+*                  - Ypos: Line Coordinate
+* Output         : None
+* Return         : None
+* Attention		 : None
+*******************************************************************************/
+void DrawCross(unsigned short Xpos,unsigned short Ypos)
+{
+    LCD_DrawLine(Xpos-15,Ypos,Xpos-2,Ypos,0xffff);
+    LCD_DrawLine(Xpos+2,Ypos,Xpos+15,Ypos,0xffff);
+    LCD_DrawLine(Xpos,Ypos-15,Xpos,Ypos-2,0xffff);
+    LCD_DrawLine(Xpos,Ypos+2,Xpos,Ypos+15,0xffff);
+}
+
+
+/*******************************************************************************
+* Function Name  : TP_QueueStats
+* Description    : Report the touch events that were not given
+* Input          : None
+* Output         : - stale: moves skipped by TP_GetTouch for a newer one
+*                  - lost: events TP_Read could not queue, the ring was full
+* Return         : None
+* Attention      : None
 *******************************************************************************/
-void LCD_Clear(unsigned short Color)
+void TP_QueueStats(unsigned long *stale, unsigned long *lost)
 {
-    memset((unsigned short*)fbp, Color, vinfo.xres * vinfo.yres * vinfo.bits_per_pixel / 8);
+    *stale = TouchStale;
+    *lost = TouchLost;
 }
 
 
-/******************************************************************************
-* Function Name  : LCD_GetPoint
-* Description    : Get color value for the specified coordinates
-* Input          : - Xpos: Row Coordinate
-*                  - Xpos: Line Coordinate
+/*******************************************************************************
+* Function Name  : Read_Ads7846
+* Description    : X Y obtained after filtering
+* Input          : None
 * Output         : None
-* Return         : Screen Color - -1 out of coordinate
-* Attention	 	 : None
+* Return         : Coordinate Structure address, 0 when the finger lifted
+* Attention      : Blocks until the next touch event, one point per frame
 *******************************************************************************/
-short LCD_GetPoint( unsigned short x, unsigned short y)
+Coordinate *Read_Ads7846(void)
 {
-    if( x >= vinfo.xres || y >= vinfo.yres )
-    {
-        return -1;
-    } else {
-        // calculate the pixel's byte offset inside the buffer
-        // note: x * 2 as every pixel is 2 consecutive bytes
-        unsigned int pix_offset = x * 2 + y * finfo.line_length;
+    TouchEvent e;
 
-        // now this is about the same as 'fbp[pix_offset] = value'
-        // but a bit more complicated for RGB565
-        //unsigned short c = ((r / 8) << 11) + ((g / 4) << 5) + (b / 8);
-        //unsigned short c = ((r / 8) * 2048) + ((g / 4) * 32) + (b / 8);
-        // write 'two bytes at once'
-        //*((unsigned short*)(fbp + pix_offset)) = c;
-        return *((unsigned short*)(fbp + pix_offset));
+    while (!TP_GetTouch(&e))
+    {
+        if (TP_Read() < 0) {
+            printf(TouchEnded ? "Error: end of touch input\n" : "Error: touch input\n");
+            exit(1);
+        }
+    }
+    if (e.type == TOUCH_UP) {
+        tpFilterReset();
+        return 0;
     }
+    return tpFilter(&e);
 }
 
 
-/******************************************************************************
-* Function Name  : PutChar
-* Description    : Lcd screen displays a character
-* Input          : - Xpos: Horizontal coordinate
-*                  - Ypos: Vertical coordinate
-*				   - ASCI: Displayed character
-*				   - charColor: Character color
-*				   - bkColor: Background color
+/*******************************************************************************
+* Function Name  : TP_Sample
+* Description    : Read the device once, X Y of the last touch position
+*                  after filtering
+* Input          : None
 * Output         : None
-* Return         : None
-* Attention	 	 : None
+* Return         : Coordinate Structure address, 0 if no finger moved or
+*                  touched
+* Attention      : One read, it does not block when the device is readable.
+*                  Every position is filtered, the last one returned, and
+*                  goes to the gesture recognition
 *******************************************************************************/
-void PutChar(unsigned short Xpos, unsigned short Ypos, unsigned char ASCI, unsigned short charColor, unsigned short bkColor )
+Coordinate *TP_Sample(void)
 {
-    unsigned short i, j;
-    unsigned char buffer[16], tmp_char;
+    Coordinate *p = 0;
+    TouchEvent e;
 
-    GetASCIICode(buffer,ASCI);  /* get font data */
-
-    for( i=0; i<16; i++ )
+    TouchSettled = 0;
+    buttonLate();
+    TP_Read();
+    while (TP_GetTouch(&e))
     {
-        tmp_char = buffer[i];
-        for( j=0; j<8; j++ )
-        {
-            if( ((tmp_char >> (7 - j)) & 0x01) == 0x01 )
-            {
-                LCD_SetPoint( Xpos + j, Ypos + i, charColor ); /* Character color */
-            }
-            else
-            {
-                LCD_SetPoint( Xpos + j, Ypos + i, bkColor );   /* Background color */
-            }
+        if (e.type == TOUCH_UP) {
+            tpFilterReset();
+            gestureFeed(e.type, 0, &e.time);
+            continue;
         }
+        // the window fills up once per touch
+        if (FilterCount == FilterMedian - 1) TouchSettled = 1;
+        p = tpFilter(&e);
+        gestureFeed(e.type, p, &e.time);
     }
+    return p;
 }
 
 
-/******************************************************************************
-* Function Name  : LCD_Text
-* Description    : Displays the string
-* Input          : - Xpos: Horizontal coordinate
-*                  - Ypos: Vertical coordinate
-*		   - str: Displayed string
-*		   - charColor: Character color
-*		   - bkColor: Background color
+/*******************************************************************************
+* Function Name  : TP_Settled
+* Description    : Whether the median window of the touch filled up with
+*                  the positions of the last TP_Sample
+* Input          : None
 * Output         : None
-* Return         : None
-* Attention      : None
+* Return         : 1 once per touch, else 0
+* Attention      : A touch shorter than the window never settles
 *******************************************************************************/
-void LCD_Text(unsigned short Xpos, unsigned short Ypos, char *str, unsigned short Color, unsigned short bkColor)
+int TP_Settled(void)
 {
-    unsigned short TempChar;
-    do
-    {
-        TempChar = *str++;
-        PutChar( Xpos, Ypos, TempChar, Color, bkColor );
-        if( Xpos < vinfo.xres - 8 )
-        {
-            Xpos += 8;
-        }
-        else if ( Ypos < vinfo.yres - 16 )
-        {
-            Xpos = 0;
-            Ypos += 16;
-        }
-        else
-        {
-            Xpos = 0;
-            Ypos = 0;
-        }
-    }
-    while ( *str != 0 );
+    return TouchSettled;
 }
 
 
-/******************************************************************************
-* Function Name  : sgn
-* Description    : return the sign of number
-* Input          : - nu: the number
+/*******************************************************************************
+* Function Name  : TP_SetFilter
+* Description    : Configure the touch filter: the median of the last
+*                  positions, then a 1 euro low pass whose cutoff rises
+*                  with the speed
+* Input          : - median: positions in the median window, 1 turns it off
+*                  - mincutoff: cutoff in Hz at rest, 0 turns the low pass off
+*                  - beta: cutoff increase per raw unit per second, 0 for a
+*                    plain low pass
 * Output         : None
-* Return         : 1 if > 0; -1 if < 0; 0 of = 0
-* Attention      : None
+* Return         : 0 ok, -1 for a median outside 1 to TP_MEDIAN_MAX
+* Attention      : The default is 3, 1.0, 0.007. Restarts a running touch
 *******************************************************************************/
-int sgn(int nu)
+int TP_SetFilter(int median, double mincutoff, double beta)
 {
-    if (nu > 0) return 1;
-    if (nu < 0) return -1;
-    if (nu == 0) return 0;
-
+    if (median < 1 || median > TP_MEDIAN_MAX) {
+        printf("Error: median window %d\n", median);
+        return -1;
+    }
+    FilterMedian = median;
+    FilterMinCutoff = mincutoff;
+    FilterBeta = beta;
+    tpFilterReset();
     return 0;
 }
 
 
-/******************************************************************************
-* Function Name  : LCD_DrawLine
-* Description    : Bresenham's line algorithm
-* Input          : - x1: A point line coordinates
-*                  - y1: A point column coordinates
-*                  - x2: B point line coordinates
-*                  - y2: B point column coordinates
-*                  - col: Line color
+/*******************************************************************************
+* Function Name  : tpFilter
+* Description    : Sub for Read_Ads7846 and TP_Sample, filter one position
+* Input          : - e: touch down or move
 * Output         : None
-* Return         : None
-* Attention      : None
+* Return         : Coordinate Structure address
+* Attention      : Constant work, the window has at most TP_MEDIAN_MAX
+*                  positions. The first position of a touch is kept as is
 *******************************************************************************/
-void LCD_DrawLine(unsigned short x1, unsigned short y1, unsigned short x2, unsigned short y2, unsigned short col)
-{
-    unsigned short n, deltax, deltay, sgndeltax, sgndeltay, deltaxabs, deltayabs, x, y, drawx, drawy;
-
-    deltax = x2 - x1;
-    deltay = y2 - y1;
-    deltaxabs = abs(deltax);
-    deltayabs = abs(deltay);
-    sgndeltax = sgn(deltax);
-    sgndeltay = sgn(deltay);
-    x = deltayabs >> 1;
-    y = deltaxabs >> 1;
-    drawx = x1;
-    drawy = y1;
-
-    LCD_SetPoint(drawx, drawy, col);
-
-    if (deltaxabs >= deltayabs){
-        for (n = 0; n < deltaxabs; n++){
-            y += deltayabs;
-            if (y >= deltaxabs){
-                y -= deltaxabs;
-                drawy += sgndeltay;
-            }
-            drawx += sgndeltax;
-            LCD_SetPoint(drawx, drawy, col);
-        }
+static Coordinate *tpFilter(const TouchEvent *e)
+{
+    static Coordinate screen;
+    double x, y, dt, a;
+
+    FilterRaw[0][FilterNext] = e->x;
+    FilterRaw[1][FilterNext] = e->y;
+    FilterNext = (FilterNext + 1) % FilterMedian;
+    if (FilterCount < FilterMedian) FilterCount++;
+    // the median drops single spikes of the ADS7843
+    x = tpMedian(FilterRaw[0], FilterCount);
+    y = tpMedian(FilterRaw[1], FilterCount);
+
+    if (FilterCount == 1 || FilterMinCutoff <= 0) {
+        FilterDX = FilterDY = 0;
     } else {
-        for (n = 0; n < deltayabs; n++){
-            x += deltaxabs;
-            if (x >= deltayabs){
-                 x -= deltayabs;
-                 drawx += sgndeltax;
-            }
-            drawy += sgndeltay;
-            LCD_SetPoint(drawx, drawy, col);
-        }
+        dt = (e->time.tv_sec - FilterTime.tv_sec) + (e->time.tv_usec - FilterTime.tv_usec) / 1e6;
+        // frames with one time stamp, e.g. a fast replay
+        if (dt <= 0) dt = 1e-3;
+        a = tpAlpha(TP_DCUTOFF, dt);
+        FilterDX += a * ((x - FilterX) / dt - FilterDX);
+        FilterDY += a * ((y - FilterY) / dt - FilterDY);
+        // smooth at rest, little lag when moving fast
+        a = tpAlpha(FilterMinCutoff + FilterBeta * sqrt(FilterDX * FilterDX + FilterDY * FilterDY), dt);
+        x = FilterX + a * (x - FilterX);
+        y = FilterY + a * (y - FilterY);
     }
+    FilterX = x;
+    FilterY = y;
+    FilterTime = e->time;
+
+    screen.x = x < 0 ? 0 : (unsigned short)(x + 0.5);
+    screen.y = y < 0 ? 0 : (unsigned short)(y + 0.5);
+    Screen.x = screen.x;
+    Screen.y = screen.y;
+    return &screen;
 }
 
 
-/******************************************************************************
-* Function Name  : LCD_DrawBox
-* Description    : Multiple line  makes box
-* Input          : - x1: A point line coordinates upper left corner
-*                  - y1: A point column coordinates
-*                  - x2: B point line coordinates lower right corner
-*                  - y2: B point column coordinates
-*                  - col: Line color
+/*******************************************************************************
+* Function Name  : tpFilterReset
+* Description    : Sub for TP_Sample and Read_Ads7846, forget the touch
+* Input          : None
 * Output         : None
 * Return         : None
-******************************************************************************/
-void LCD_DrawBox(unsigned short x0, unsigned short y0, unsigned short x1, unsigned short y1 , unsigned short col, int fcol )
+* Attention      : None
+*******************************************************************************/
+static void tpFilterReset(void)
 {
-    unsigned short i, xx0, xx1, yy0;
+    FilterCount = 0;
+    FilterNext = 0;
+}
 
-    LCD_DrawLine(x0, y0, x1, y0, col);
-    LCD_DrawLine(x1, y0, x1, y1, col);
-    LCD_DrawLine(x0, y0, x0, y1, col);
-    LCD_DrawLine(x0, y1, x1, y1, col);
 
-    if  (fcol!=-1)
-    {
-        for (i=0; i<y1-y0-1; i++)
-        {
-            xx0=x0+1;
-            yy0=y0+1+i;
-            xx1=x1-1;
+/*******************************************************************************
+* Function Name  : tpMedian
+* Description    : Sub for tpFilter, median of a few values
+* Input          : - v: values
+*                  - n: number of values, at most TP_MEDIAN_MAX
+* Output         : None
+* Return         : the median, of an even number the upper middle value
+* Attention      : None
+*******************************************************************************/
+static int tpMedian(const int *v, int n)
+{
+    int s[TP_MEDIAN_MAX], i, j, t;
 
-            LCD_DrawLine(xx0, yy0, xx1, yy0, (unsigned short)fcol);
-        }
+    // insertion sort, n is tiny
+    for (i = 0; i < n; i++)
+    {
+        t = v[i];
+        for (j = i; j > 0 && s[j - 1] > t; j--)
+            s[j] = s[j - 1];
+        s[j] = t;
     }
+    return s[n / 2];
 }
 
-/******************************************************************************
-* Function Name  : drawCircle
-* Description    : Sub for LCD_DrawCircle
-* Input          : - xc:
-*                  - yc:
-*                  - x:
-*                  - y:
-*                  - col: Line color
+
+/*******************************************************************************
+* Function Name  : tpAlpha
+* Description    : Sub for tpFilter, smoothing factor of a low pass
+* Input          : - cutoff: in Hz
+*                  - dt: seconds since the last position
 * Output         : None
-* Return         : None
-******************************************************************************/
-void drawCircle(unsigned short xc, unsigned short yc, unsigned short x, unsigned short y, unsigned short col)
+* Return         : 0 to 1, the share of the new position
+* Attention      : None
+*******************************************************************************/
+static double tpAlpha(double cutoff, double dt)
+{
+    double tau = 1.0 / (2 * M_PI * cutoff);
+
+    return 1.0 / (1.0 + tau / dt);
+}
+
+
+/*******************************************************************************
+* Function Name  : TP_GetGesture
+* Description    : Take the oldest gesture recognised by TP_Sample
+* Input          : None
+* Output         : - g: the gesture
+* Return         : 1 if there was one, else 0
+* Attention      : The oldest is dropped when GESTURE_QUEUE are waiting.
+*                  LOOP_Run reads them for the LOOP_OnGesture handler
+*******************************************************************************/
+int TP_GetGesture(Gesture *g)
 {
-    LCD_SetPoint(xc+x, yc+y, col);
-    LCD_SetPoint(xc-x, yc+y, col);
-    LCD_SetPoint(xc+x, yc-y, col);
-    LCD_SetPoint(xc-x, yc-y, col);
-    LCD_SetPoint(xc+y, yc+x, col);
-    LCD_SetPoint(xc-y, yc+x, col);
-    LCD_SetPoint(xc+y, yc-x, col);
-    LCD_SetPoint(xc-y, yc-x, col);
+    if (GestCount == 0) return 0;
+    *g = GestQueue[GestFirst];
+    GestFirst = (GestFirst + 1) % GESTURE_QUEUE;
+    GestCount--;
+    return 1;
 }
 
 
-/******************************************************************************
-* Function Name  : LCD_DrawCircle
-* Description    : Draw a circle
-* Input          : - xc: A point line coordinates center
-*                  - yc: A point column coordinates center
-*                  - r: radius of circle
-*                  - col: Line color
+/*******************************************************************************
+* Function Name  : gestureFeed
+* Description    : Sub for TP_Sample, one step of the gesture recognition
+* Input          : - type: TOUCH_DOWN, TOUCH_MOVE or TOUCH_UP
+*                  - p: filtered point of a down or move, else unused
+*                  - time: of the event, the clock of TouchClock
 * Output         : None
 * Return         : None
-******************************************************************************/
-void LCD_DrawCircle(unsigned short xc, unsigned short yc, unsigned short r, unsigned short col)
+* Attention      : Constant work and memory per event. A tap is reported
+*                  at the lift, the second of a double tap as
+*                  GESTURE_DOUBLE_TAP; a long press after GESTURE_LONG_MS
+*                  at the next event or by a LOOP_AddTimer timer
+*******************************************************************************/
+static void gestureFeed(int type, const Coordinate *p, const struct timeval *time)
 {
-    int x = 0, y = r;
-    int p = 1 - r;
+    long long t = time->tv_sec * 1000000LL + time->tv_usec;
+    int x, y, vx, vy;
 
-    while (x < y)
+    if (type == TOUCH_UP)
     {
-        drawCircle(xc, yc, x, y, col);
-        x++;
-
-        if (p < 0)
-            p = p + 2 * x + 1;
-        else
+        if (GestState == GEST_PRESSED)
         {
-            y--;
-            p = p + 2 * (x-y) + 1;
+            if (GestTapped && GestDown - GestTapTime <= GESTURE_DOUBLE_MS * 1000LL &&
+                abs(GestX0 - GestTapX) <= 2 * GESTURE_SLOP && abs(GestY0 - GestTapY) <= 2 * GESTURE_SLOP)
+            {
+                gestureAdd(GESTURE_DOUBLE_TAP, GestX0, GestY0, 0, 0, 0, 0, t);
+                GestTapped = 0;
+            } else {
+                gestureAdd(GESTURE_TAP, GestX0, GestY0, 0, 0, 0, 0, t);
+                GestTapped = 1;
+                GestTapTime = t;
+                GestTapX = GestX0;
+                GestTapY = GestY0;
+            }
+        }
+        else if (GestState == GEST_DRAGGING)
+        {
+            gestureVelocity(t, &vx, &vy);
+            x = GestX - GestX0;
+            y = GestY - GestY0;
+            if (t - GestDown <= GESTURE_SWIPE_MS * 1000LL && x * x + y * y >= GESTURE_SWIPE_MIN * GESTURE_SWIPE_MIN)
+                gestureAdd(GESTURE_SWIPE, GestX, GestY, x, y, vx, vy, t);
+            if ((long long)vx * vx + (long long)vy * vy >= (long long)GESTURE_FLING_MIN * GESTURE_FLING_MIN)
+                gestureAdd(GESTURE_FLING, GestX, GestY, 0, 0, vx, vy, t);
         }
-        drawCircle(xc, yc, x, y, col);
+        if (GestState != GEST_PRESSED) GestTapped = 0;
+        GestState = GEST_UP;
+        LOOP_CancelTimer(GestTimer);
+        GestTimer = 0;
+        return;
     }
-}
-
 
-/******************************************************************************
-* Function Name  : LCD_DrawCircleFill
-* Description    : Draw a circle filled
-* Input          : - xc: A point line coordinates center
-*                  - yc: A point column coordinates center
-*                  - r: radius of circle
-*                  - bcol: border color
-*                  - col: fill color
-* Output         : None
-* Return         : None
-******************************************************************************/
-void LCD_DrawCircleFill(unsigned short x, unsigned short y, unsigned short r, unsigned short bcol, unsigned short col) {
-    int xc, yc;
-    double testRadius;
-    double rsqMin = (double)(r-1)*(r-1);
-    double rsqMax = (double)r*r;
-
-    int fillFlag = 1;
-
-    /* Ensure radius is positive */
-    if (r < 0) {
-        r = -r;
+    gestureDisplay(p, &x, &y);
+    if (type == TOUCH_DOWN || GestState == GEST_UP)
+    {
+        GestState = GEST_PRESSED;
+        GestDown = t;
+        GestX0 = GestX = x;
+        GestY0 = GestY = y;
+        GestHistCount = 0;
+        LOOP_CancelTimer(GestTimer);
+        if ((GestTimer = LOOP_AddTimer(GESTURE_LONG_MS, 0, gestureLong, 0)) == -1) GestTimer = 0;
     }
+    GestHistX[GestHistNext] = x;
+    GestHistY[GestHistNext] = y;
+    GestHistTime[GestHistNext] = t;
+    GestHistNext = (GestHistNext + 1) % GESTURE_HISTORY;
+    if (GestHistCount < GESTURE_HISTORY) GestHistCount++;
 
-    for (yc = -r; yc < r; yc++) {
-        for (xc = -r; xc < r; xc++) {
-            testRadius = (double)(xc*xc + yc*yc);
-            if (((rsqMin < testRadius)&&(testRadius <= rsqMax))
-                || ((fillFlag)&&(testRadius <= rsqMax))) {
-                LCD_SetPoint(x + xc, y + yc, col);
-            }
+    if (GestState == GEST_PRESSED)
+    {
+        if (abs(x - GestX0) > GESTURE_SLOP || abs(y - GestY0) > GESTURE_SLOP) {
+            // the drag starts at the press
+            GestState = GEST_DRAGGING;
+            LOOP_CancelTimer(GestTimer);
+            GestTimer = 0;
+        } else if (t - GestDown >= GESTURE_LONG_MS * 1000LL) {
+            gestureAdd(GESTURE_LONG_PRESS, GestX0, GestY0, 0, 0, 0, 0, t);
+            GestState = GEST_LONG;
+            LOOP_CancelTimer(GestTimer);
+            GestTimer = 0;
         }
     }
-    if (col != bcol) LCD_DrawCircle(x, y, r, bcol);
+    if (GestState == GEST_DRAGGING && (x != GestX || y != GestY))
+    {
+        gestureVelocity(t, &vx, &vy);
+        gestureAdd(GESTURE_DRAG, x, y, x - GestX, y - GestY, vx, vy, t);
+        GestX = x;
+        GestY = y;
+    }
 }
 
 
 /*******************************************************************************
-* Function Name  : TP_GetAdXY
-* Description    : Read ADS7843 ADC value of X + Y + channel
-* Input          : None
+* Function Name  : gestureLong
+* Description    : Sub for gestureFeed, the long press of a finger held
+*                  still without events
+* Input          : - arg: unused
 * Output         : None
-* Return         : return X + Y + channel ADC value
-* Attention	 	 : None
+* Return         : None
+* Attention      : Runs from the LOOP_AddTimer timer
 *******************************************************************************/
-void TP_GetAdXY(int *x,int *y)
+static void gestureLong(void *arg)
 {
-    int xx, yy;
-    int catch = 0;
-		   
-	rd = read(fd, ev, sizeof(struct input_event) * 64);
-
-	if (rd < (int) sizeof(struct input_event)) 
-	{
-		printf("Error reading\n");
-		return;
-	}
-
-	for (i = 0; i < rd / sizeof(struct input_event); i++)
-	{
-        if (ev[i].type == 1 && ev[i].code == 330) catch = 1;
-		if (ev[i].type == EV_SYN) 
-		{
-			//printf("Event: time %ld.%06ld, -------------- %s ------------\n",	ev[i].time.tv_sec, ev[i].time.tv_usec, ev[i].code ? "Config Sync" : "Report Sync" );
-			//printf("x: %4u -  y: %4u\n", (unsigned int) xx, (unsigned int) yy);
-			catch = 0;
-		} else { 
-			if (ev[i].type == EV_MSC && (ev[i].code == MSC_RAW || ev[i].code == MSC_SCAN)) {
-				//printf("Event: time %ld.%06ld, type %d (%s), code %d (%s), value %02x\n", ev[i].time.tv_sec, ev[i].time.tv_usec, ev[i].type, events[ev[i].type] ? events[ev[i].type] : "?", ev[i].code, names[ev[i].type] ? (names[ev[i].type][ev[i].code] ? names[ev[i].type][ev[i].code] : "?") : "?", ev[i].value);
-			} else {
-				//printf("Event: time %ld.%06ld, type %d (%s), code %d (%s), value %d\n", ev[i].time.tv_sec, ev[i].time.tv_usec, ev[i].type, events[ev[i].type] ? events[ev[i].type] : "?", ev[i].code, names[ev[i].type] ? (names[ev[i].type][ev[i].code] ? names[ev[i].type][ev[i].code] : "?") : "?", ev[i].value);
-				if (catch == 1) {		
-					if (ev[i].code == 0) xx = ev[i].value;
-					if (ev[i].code == 1) yy = ev[i].value;
-				}
-			}
-		}
-    }
-    *x = xx;
-    *y = yy;
-    //printf("x: %4u -  y: %4u\n", (unsigned int) xx, (unsigned int) yy);
+    GestTimer = 0;
+    if (GestState != GEST_PRESSED) return;
+    gestureAdd(GESTURE_LONG_PRESS, GestX0, GestY0, 0, 0, 0, 0, GestDown + GESTURE_LONG_MS * 1000LL);
+    GestState = GEST_LONG;
 }
 
 
 /*******************************************************************************
-* Function Name  : TP_DrawPoint
-* Description    : Draw point Must have a LCD driver
-* Input          : - Xpos: Row Coordinate
-*                  - Ypos: Line Coordinate
-* Output         : None
+* Function Name  : gestureVelocity
+* Description    : Sub for gestureFeed, finger speed from the positions of
+*                  the last GESTURE_VELOCITY_MS
+* Input          : - t: now, microseconds
+* Output         : - vx, vy: pixels per second, 0 if the finger rested
 * Return         : None
-* Attention	 	 : None
+* Attention      : None
 *******************************************************************************/
-void TP_DrawPoint(unsigned short Xpos,unsigned short Ypos)
+static void gestureVelocity(long long t, int *vx, int *vy)
 {
-    LCD_SetPoint(Xpos,Ypos,0xf800);     /* Center point */
-    LCD_SetPoint(Xpos+1,Ypos,0xf800);
-    LCD_SetPoint(Xpos,Ypos+1,0xf800);
-    LCD_SetPoint(Xpos+1,Ypos+1,0xf800);
+    int last, first, n, i;
+    long long dt;
+
+    *vx = *vy = 0;
+    last = (GestHistNext + GESTURE_HISTORY - 1) % GESTURE_HISTORY;
+    if (GestHistCount < 2 || t - GestHistTime[last] > GESTURE_VELOCITY_MS * 1000LL) return;
+
+    // the oldest position inside the window
+    first = last;
+    for (n = 1; n < GestHistCount; n++)
+    {
+        i = (last + GESTURE_HISTORY - n) % GESTURE_HISTORY;
+        if (GestHistTime[last] - GestHistTime[i] > GESTURE_VELOCITY_MS * 1000LL) break;
+        first = i;
+    }
+    if ((dt = GestHistTime[last] - GestHistTime[first]) <= 0) return;
+    // samples microseconds apart, keep the squares of gestureFeed in range
+    if (dt < 1000) dt = 1000;
+    *vx = (GestHistX[last] - GestHistX[first]) * 1000000LL / dt;
+    *vy = (GestHistY[last] - GestHistY[first]) * 1000000LL / dt;
 }
 
 
 /*******************************************************************************
-* Function Name  : DrawCross
-* Description    : specified coordinates painting crosshairs
-* Input          : - Xpos: Row Coordinate
-*                  - Ypos: Line Coordinate
-* Output         : None
+* Function Name  : gestureDisplay
+* Description    : Sub for gestureFeed, touch panel point to screen pixels
+* Input          : - p: filtered point
+* Output         : - x, y: with the calibration matrix
 * Return         : None
-* Attention		 : None
+* Attention      : Without calibration the raw values
 *******************************************************************************/
-void DrawCross(unsigned short Xpos,unsigned short Ypos)
+static void gestureDisplay(const Coordinate *p, int *x, int *y)
 {
-    LCD_DrawLine(Xpos-15,Ypos,Xpos-2,Ypos,0xffff);
-    LCD_DrawLine(Xpos+2,Ypos,Xpos+15,Ypos,0xffff);
-    LCD_DrawLine(Xpos,Ypos-15,Xpos,Ypos-2,0xffff);
-    LCD_DrawLine(Xpos,Ypos+2,Xpos,Ypos+15,0xffff);
+    if (matrix.Divider == 0) {
+        *x = p->x;
+        *y = p->y;
+        return;
+    }
+    *x = (matrix.An * p->x + matrix.Bn * p->y + matrix.Cn) / matrix.Divider;
+    *y = (matrix.Dn * p->x + matrix.En * p->y + matrix.Fn) / matrix.Divider;
 }
 
 
 /*******************************************************************************
-* Function Name  : Read_Ads7846
-* Description    : X Y obtained after filtering
-* Input          : None
+* Function Name  : gestureAdd
+* Description    : Sub for gestureFeed, queue a gesture for TP_GetGesture
+* Input          : - type: GESTURE_TAP to GESTURE_FLING
+*                  - x, y, dx, dy, vx, vy: see Gesture
+*                  - t: microseconds
 * Output         : None
-* Return         : Coordinate Structure address
-* Attention      : None
+* Return         : None
+* Attention      : The oldest is dropped when GESTURE_QUEUE are waiting
 *******************************************************************************/
-Coordinate *Read_Ads7846(void)
+static void gestureAdd(int type, int x, int y, int dx, int dy, int vx, int vy, long long t)
 {
-    static Coordinate screen;
-    int m0,m1,m2,TP_X[1],TP_Y[1],temp[3];
-    unsigned char count = 0;
-    int buffer[2][9] = {{0},{0}};  /* Multiple sampling coordinates X and Y */
-
-    do  /* Loop sampling 9 times */
-    {
-        TP_GetAdXY(TP_X,TP_Y);
-	    buffer[0][count] = TP_X[0];
-	    buffer[1][count] = TP_Y[0];
-
-        //printf("count: %u - x: %d -  y: %d\n", count, TP_X[0], TP_Y[0]);
-
-        count++;
-	}
-    while( count < 9 );
-
-    if( count == 9 )   /* Successful sampling 9, filtering */
-    {
-    /* In order to reduce the amount of computation, were divided into three groups averaged */
-    temp[0] = ( buffer[0][0] + buffer[0][1] + buffer[0][2] ) / 3;
-	temp[1] = ( buffer[0][3] + buffer[0][4] + buffer[0][5] ) / 3;
-	temp[2] = ( buffer[0][6] + buffer[0][7] + buffer[0][8] ) / 3;
-	/* Calculate the three groups of data */
-	m0 = temp[0] - temp[1];
-	m1 = temp[1] - temp[2];
-	m2 = temp[2] - temp[0];
-	/* Absolute value of the above difference */
-	m0 = m0 > 0 ? m0 : (-m0);
-        m1 = m1 > 0 ? m1 : (-m1);
-	m2 = m2 > 0 ? m2 : (-m2);
-	/* Judge whether the absolute difference exceeds the difference between the threshold,
-	   If these three absolute difference exceeds the threshold,
-       The sampling point is judged as outliers, Discard sampling points */
-	if( m0 > THRESHOLD  &&  m1 > THRESHOLD  &&  m2 > THRESHOLD )
-	{
-	    return 0;
-	}
-	/* Calculating their average value */
-	if( m0 < m1 )
-	{
-	    if( m2 < m0 )
-	    {
-	        screen.x = ( temp[0] + temp[2] ) / 2;
-	    }
-	    else
-	    {
- 	        screen.x = ( temp[0] + temp[1] ) / 2;
-	    }
-	}
-	else if(m2<m1)
-	{
- 	    screen.x = ( temp[0] + temp[2] ) / 2;
-	}
-	else
-	{
- 	    screen.x = ( temp[1] + temp[2] ) / 2;
-	}
-
-	/* calculate the average value of Y */
-    temp[0] = ( buffer[1][0] + buffer[1][1] + buffer[1][2] ) / 3;
-	temp[1] = ( buffer[1][3] + buffer[1][4] + buffer[1][5] ) / 3;
-	temp[2] = ( buffer[1][6] + buffer[1][7] + buffer[1][8] ) / 3;
-
-	m0 = temp[0] - temp[1];
-	m1 = temp[1] - temp[2];
-	m2 = temp[2] - temp[0];
-
-	m0 = m0 > 0 ? m0 : (-m0);
-	m1 = m1 > 0 ? m1 : (-m1);
-	m2 = m2 > 0 ? m2 : (-m2);
-	if( m0 > THRESHOLD && m1 > THRESHOLD && m2 > THRESHOLD )
-	{
-	    return 0;
-	}
-
-	if( m0 < m1 )
-	{
-	    if( m2 < m0 )
-	    {
-	        screen.y = ( temp[0] + temp[2] ) / 2;
-	    }
-	    else
-	    {
-    	        screen.y = ( temp[0] + temp[1] ) / 2;
-            }
-        }
-	else if( m2 < m1 )
-	{
-	    screen.y = ( temp[0] + temp[2] ) / 2;
-	}
-	else
-	{
-    	    screen.y = ( temp[1] + temp[2] ) / 2;
-        }
+    Gesture *g;
 
-       //printf("x: %4u -  y: %4u\n", screen.x, screen.y);
-       Screen.x = screen.x;
-       Screen.y = screen.y;
-
-       return &screen;
+    if (GestCount == GESTURE_QUEUE) {
+        GestFirst = (GestFirst + 1) % GESTURE_QUEUE;
+        GestCount--;
     }
-
-    return 0;
+    g = &GestQueue[(GestFirst + GestCount++) % GESTURE_QUEUE];
+    g->type = type;
+    g->x = x;
+    g->y = y;
+    g->dx = dx;
+    g->dy = dy;
+    g->vx = vx;
+    g->vy = vy;
+    g->time.tv_sec = t / 1000000;
+    g->time.tv_usec = t % 1000000;
 }
 
 
@@ -1355,7 +7987,9 @@ FunctionalState getDisplayPoint(Coordinate * displayPtr, Coordinate * screenPtr,
 {
     FunctionalState retTHRESHOLD = ENABLE ;
     long double an, bn, cn, dn, en, fn, sx, sy, md;
-    int i;
+    int i, n;
+
+    buttonLate();
 
     /*an = matrixPtr->An;
     bn = matrixPtr->Bn;
@@ -1388,20 +8022,16 @@ FunctionalState getDisplayPoint(Coordinate * displayPtr, Coordinate * screenPtr,
         
         //printf("x: %d -  y: %d\n", display.x, display.y);
         
-        for (i=0; i<20; i++)
+        // only the buttons listed in the touched grid cell are tested
+        if (GridDirty && buttonGrid()) return DISABLE;
+        if (display.x < GridCols * BUTTON_CELL && display.y < GridRows * BUTTON_CELL)
         {
-            if (Butt[i].exist)
+            for (n = GridHead[(display.y / BUTTON_CELL) * GridCols + display.x / BUTTON_CELL]; n != -1; n = GridNode[n * 2 + 1])
             {
-                if ( (display.x > Butt[i].x0) && (display.x < Butt[i].x1) && (display.y > Butt[i].y0) && (display.y < Butt[i].y1) ) {
-                	Butt[i].pressed = 1;
-                    LCD_DrawBox(Butt[i].x0, Butt[i].y0, Butt[i].x1, Butt[i].y1, Butt[i].fcol, Butt[i].col);
-				    LCD_Text(Butt[i].xo, Butt[i].yo, Butt[i].text, Butt[i].fcol, Butt[i].col);
-				    DelayMicrosecondsNoSleep(150000);
-                    LCD_DrawBox(Butt[i].x0, Butt[i].y0, Butt[i].x1, Butt[i].y1, Butt[i].col, Butt[i].fcol);
-				    LCD_Text(Butt[i].xo, Butt[i].yo, Butt[i].text, Butt[i].col, Butt[i].fcol);
-                } else {
-                	Butt[i].pressed = 0;
-                }
+                i = GridNode[n * 2];
+                if (Butt[i].widget && !uiShown(Butt[i].widget - 1)) continue;
+                if ( (display.x > Butt[i].x0) && (display.x < Butt[i].x1) && (display.y > Butt[i].y0) && (display.y < Butt[i].y1) )
+                    buttonPress(i);
             }
         }
     }
@@ -1424,6 +8054,7 @@ FunctionalState getDisplayPoint(Coordinate * displayPtr, Coordinate * screenPtr,
 void TP_Cal(void)
 {
     unsigned char i;
+    int n;
     Coordinate * Ptr;
     FILE *fp, *fp2;
 
@@ -1438,14 +8069,16 @@ void TP_Cal(void)
             LCD_Text(10,10,"Touch crosshair to calibrate",White,Black);
 
             DrawCross(DisplaySample[i].x,DisplaySample[i].y);
-            do
+            LCD_Flush();
+            // the last filtered point before the finger lifts
+            n = 0;
+            while ((Ptr = Read_Ads7846()) != 0 || n == 0)
             {
-                Ptr = Read_Ads7846();
+                if (Ptr == 0) continue;
+                ScreenSample[i].x = Ptr->x;
+                ScreenSample[i].y = Ptr->y;
+                n++;
             }
-            while( Ptr == (void*)0 );
-
-            ScreenSample[i].x = Ptr->x;
-            ScreenSample[i].y = Ptr->y;
             printf("cal: %u  x: %4u y: %4u\n", i, ScreenSample[i].x, ScreenSample[i].y);
         }
 
@@ -1455,6 +8088,7 @@ void TP_Cal(void)
         Screen.x = -1;
         Screen.y = -1;
         LCD_Clear(Black);
+        LCD_Flush();
 
         // write the values
         if ((fp2=fopen("cal", "wb"))==NULL)
@@ -0,0 +1,240 @@
+/*******************************************************************************
+* File Name      : rgb565.h
+* Description    : Pre-converted RGB565 image format (.565) and the RGB888 to
+*                  RGB565 row conversion, shared by fblcd (LCD_PutImage) and
+*                  the bmp2raw converter
+*
+*                  offset  size  field
+*                   0      4     magic "R565"
+*                   4      2     version (1)
+*                   6      2     flags (RAW565_HAS_KEY)
+*                   8      2     width
+*                  10      2     height
+*                  12      2     stride, pixels per row (>= width)
+*                  14      2     key, transparent color when RAW565_HAS_KEY
+*                  16      4     offset of the first pixel from file start
+*
+*                  All fields and pixels are little endian. Rows are stride
+*                  pixels apart so a mapped file can be blitted as it is.
+*******************************************************************************/
+#ifndef __RGB565_H
+#define __RGB565_H
+
+/* Defines */
+#define RAW565_MAGIC        "R565"
+#define RAW565_VERSION      1
+#define RAW565_HEADER_SIZE  20
+#define RAW565_OFFSET       32      /* first pixel, keeps rows 32 byte aligned */
+#define RAW565_HAS_KEY      0x0001
+
+
+/* Includes */
+#include <string.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+/* 4x4 ordered dither thresholds 0..15 */
+static const unsigned char RGB565_Bayer[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+
+/*******************************************************************************
+* Function Name  : rgb565Dither
+* Description    : Sub for RGB565_ConvertRow, dither offsets for 4 pixels
+* Input          : - x: column of the first pixel
+*                  - y: line
+*                  - dither: 0 gives no offsets
+* Output         : - d: B G R A offsets per pixel, 16 bytes
+* Return         : None
+* Attention      : 5 bit channels get 0..7, the 6 bit green 0..3
+*******************************************************************************/
+static void rgb565Dither(unsigned char *d, int x, int y, int dither)
+{
+    int i, t;
+
+    for (i = 0; i < 4; i++)
+    {
+        t = dither ? RGB565_Bayer[y & 3][(x + i) & 3] : 0;
+        d[i * 4 + 0] = t >> 1;
+        d[i * 4 + 1] = t >> 2;
+        d[i * 4 + 2] = t >> 1;
+        d[i * 4 + 3] = 0;
+    }
+}
+
+
+#if defined(__SSE2__) && !(defined(__ARM_NEON) || defined(__ARM_NEON__))
+/*******************************************************************************
+* Function Name  : rgb565Pack4
+* Description    : Sub for RGB565_ConvertRow, 4 BGRx pixels to RGB565
+* Input          : - p: pixels in 32 bit lanes
+* Output         : None
+* Return         : RGB565 values in the low half of each lane, sign extended
+* Attention      : None
+*******************************************************************************/
+static inline __m128i rgb565Pack4(__m128i p)
+{
+    __m128i v;
+
+    v = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xF800)),
+                     _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07E0)));
+    v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F)));
+    // sign extend so packs keeps the 16 bits as they are
+    return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+#endif
+
+
+/*******************************************************************************
+* Function Name  : RGB565_ConvertRow
+* Description    : Convert a row of BMP pixels to RGB565
+* Input          : - src: B G R (bytespp 3) or B G R A (bytespp 4) pixels
+*                  - n: pixels
+*                  - bytespp: 3 or 4
+*                  - x: column of the first pixel, for the dither pattern
+*                  - y: line, for the dither pattern
+*                  - dither: 1 for 4x4 ordered dithering, 0 truncates
+* Output         : - dst: RGB565 pixels
+* Return         : None
+* Attention      : NEON converts 16 pixels per step, SSE2/SSSE3/AVX2 4 to 16,
+*                  the remainder is done one pixel at a time
+*******************************************************************************/
+static void RGB565_ConvertRow(unsigned short *dst, const unsigned char *src, int n, int bytespp, int x, int y, int dither)
+{
+    unsigned char d[16];
+    int i = 0, t, r, g, b;
+
+    rgb565Dither(d, x, y, dither);
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    {
+        uint8x16_t db, dg;
+        uint8x16x3_t p3;
+        uint8x16x4_t p4;
+        uint8x16_t B, G, R;
+        uint16x8_t o;
+        unsigned char dbv[16], dgv[16];
+
+        for (t = 0; t < 16; t++)
+        {
+            dbv[t] = d[(t & 3) * 4];
+            dgv[t] = d[(t & 3) * 4 + 1];
+        }
+        db = vld1q_u8(dbv);
+        dg = vld1q_u8(dgv);
+        for (; i + 16 <= n; i += 16)
+        {
+            if (bytespp == 3)
+            {
+                p3 = vld3q_u8(src + i * 3);
+                B = p3.val[0];
+                G = p3.val[1];
+                R = p3.val[2];
+            } else {
+                p4 = vld4q_u8(src + i * 4);
+                B = p4.val[0];
+                G = p4.val[1];
+                R = p4.val[2];
+            }
+            B = vqaddq_u8(B, db);
+            G = vqaddq_u8(G, dg);
+            R = vqaddq_u8(R, db);
+            o = vsriq_n_u16(vshll_n_u8(vget_low_u8(R), 8), vshll_n_u8(vget_low_u8(G), 8), 5);
+            o = vsriq_n_u16(o, vshll_n_u8(vget_low_u8(B), 8), 11);
+            vst1q_u16(dst + i, o);
+            o = vsriq_n_u16(vshll_n_u8(vget_high_u8(R), 8), vshll_n_u8(vget_high_u8(G), 8), 5);
+            o = vsriq_n_u16(o, vshll_n_u8(vget_high_u8(B), 8), 11);
+            vst1q_u16(dst + i + 8, o);
+        }
+    }
+#elif defined(__SSE2__)
+    {
+        __m128i dv = _mm_loadu_si128((const __m128i*)d);
+        __m128i a, c;
+        unsigned int w[8];
+
+        if (bytespp == 4)
+        {
+#if defined(__AVX2__)
+            __m256i dv2 = _mm256_broadcastsi128_si256(dv), a2, c2;
+            __m256i mr = _mm256_set1_epi32(0xF800), mg = _mm256_set1_epi32(0x07E0), mb = _mm256_set1_epi32(0x001F);
+
+            for (; i + 16 <= n; i += 16)
+            {
+                a2 = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i*)(src + i * 4)), dv2);
+                c2 = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i*)(src + i * 4 + 32)), dv2);
+                a2 = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(a2, 8), mr),
+                                                     _mm256_and_si256(_mm256_srli_epi32(a2, 5), mg)),
+                                     _mm256_and_si256(_mm256_srli_epi32(a2, 3), mb));
+                c2 = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(c2, 8), mr),
+                                                     _mm256_and_si256(_mm256_srli_epi32(c2, 5), mg)),
+                                     _mm256_and_si256(_mm256_srli_epi32(c2, 3), mb));
+                a2 = _mm256_srai_epi32(_mm256_slli_epi32(a2, 16), 16);
+                c2 = _mm256_srai_epi32(_mm256_slli_epi32(c2, 16), 16);
+                // packs works per 128 bit lane, put the quarters back in order
+                a2 = _mm256_permute4x64_epi64(_mm256_packs_epi32(a2, c2), 0xD8);
+                _mm256_storeu_si256((__m256i*)(dst + i), a2);
+            }
+#endif
+            for (; i + 8 <= n; i += 8)
+            {
+                a = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(src + i * 4)), dv);
+                c = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(src + i * 4 + 16)), dv);
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(rgb565Pack4(a), rgb565Pack4(c)));
+            }
+        } else {
+#if defined(__SSSE3__)
+            __m128i shuf = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+            // each load reads 16 bytes for 12, stop while that stays in the row
+            for (; i + 10 <= n; i += 8)
+            {
+                a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3)), shuf);
+                c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3 + 12)), shuf);
+                a = _mm_adds_epu8(a, dv);
+                c = _mm_adds_epu8(c, dv);
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(rgb565Pack4(a), rgb565Pack4(c)));
+            }
+#else
+            // 4 byte loads, the top byte belongs to the next pixel and is masked
+            for (; i + 9 <= n; i += 8)
+            {
+                for (t = 0; t < 8; t++)
+                    memcpy(&w[t], src + (i + t) * 3, 4);
+                a = _mm_adds_epu8(_mm_setr_epi32(w[0], w[1], w[2], w[3]), dv);
+                c = _mm_adds_epu8(_mm_setr_epi32(w[4], w[5], w[6], w[7]), dv);
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(rgb565Pack4(a), rgb565Pack4(c)));
+            }
+#endif
+        }
+        (void)w;
+    }
+#endif
+
+    for (src += i * bytespp; i < n; i++, src += bytespp)
+    {
+        t = (i & 3) * 4;
+        b = src[0] + d[t];
+        g = src[1] + d[t + 1];
+        r = src[2] + d[t + 2];
+        if (b > 255) b = 255;
+        if (g > 255) g = 255;
+        if (r > 255) r = 255;
+        dst[i] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    }
+}
+
+#endif
+
+
+/*******************************************************************************
+      END FILE
+*******************************************************************************/